@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "backend.h"
+#include "print.h"
+
+static const struct backend_ops *backends[] = {
+#ifdef HAVE_CUDA
+	&cuda_backend_ops,
+#endif
+	&host_backend_ops,
+	&mock_backend_ops,
+	&comp_backend_ops,
+	&dedup_backend_ops,
+	&cache_backend_ops,
+	&log_backend_ops,
+	&stripe_backend_ops,
+	&tier_backend_ops,
+	&file_backend_ops,
+	&snap_backend_ops,
+};
+
+int setup_backend(struct backend *backend, const char *spec, unsigned int slots)
+{
+	int i;
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? arg - spec : strlen(spec);
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+		if (strlen(backends[i]->name) == len && !strncmp(backends[i]->name, spec, len)) {
+			backend->ops = backends[i];
+			backend->priv = NULL;
+			return backend->ops->init(backend, arg ? arg + 1 : NULL, slots);
+		}
+	}
+
+	pr_err("Unknown backend '%s'\n", spec);
+	return -1;
+}
+
+int init_backend(struct backend *backend, const char *spec, unsigned long long size, unsigned int slots)
+{
+	if (setup_backend(backend, spec, slots))
+		return -1;
+
+	return backend->ops->alloc(backend, size);
+}
+
+int spec_uses(const char *spec, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	/* The names of the inner backends follow a ':' or a ',' */
+	for (p = spec; (p = strstr(p, name)); p += len) {
+		if ((p == spec || p[-1] == ':' || p[-1] == ',') && (p[len] == ':' || p[len] == ',' || !p[len]))
+			return 1;
+	}
+
+	return 0;
+}
+
+void print_metric(FILE *out, const char *name, const char *id, unsigned long long value)
+{
+	fprintf(out, "cudaramd_%s{backend=\"%s\"} %llu\n", name, id, value);
+}
+
+void inner_metrics(struct backend *inner, FILE *out, const char *id, unsigned int i)
+{
+	char inner_id[64];
+
+	if (!inner->ops->metrics)
+		return;
+
+	snprintf(inner_id, sizeof(inner_id), "%s.%u", id, i);
+	inner->ops->metrics(inner, out, inner_id);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#ifndef _CUDARAMD_BACKEND_H_
+#define _CUDARAMD_BACKEND_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+struct backend;
+
+/*
+ * Storage backend operations.
+ *
+ * Transfers are asynchronous and issued on a slot, a slot is only used by one
+ * thread at a time. Several transfers can be issued on a slot for a single
+ * request, query() returns 0 once all the transfers issued on the slot are
+ * done, -EAGAIN if any is still in progress and another negative errno if one
+ * failed. wait() blocks until they are done and returns the same.
+ *
+ * The other operations are synchronous, zero() and discard() are only issued
+ * for ranges with no transfers in flight.
+ */
+struct backend_ops {
+	const char *name;
+	/* Set up the backend for a number of slots, arg is the part of the spec after ':' */
+	int (*init)(struct backend *backend, const char *arg, unsigned int slots);
+	/* Optional, make the backend usable from the calling thread */
+	int (*attach)(struct backend *backend);
+	/* Allocate the zeroed storage */
+	int (*alloc)(struct backend *backend, unsigned long long size);
+	/* Allocate a host buffer suitable for transfers */
+	void *(*alloc_buffer)(struct backend *backend, size_t size);
+	int (*read)(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len);
+	int (*write)(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len);
+	int (*query)(struct backend *backend, unsigned int slot);
+	int (*wait)(struct backend *backend, unsigned int slot);
+	int (*zero)(struct backend *backend, unsigned long long offset, size_t len);
+	/* Zero a range and release the memory backing it where possible */
+	int (*discard)(struct backend *backend, unsigned long long offset, size_t len);
+	/* Wait for all the transfers to finish */
+	int (*sync)(struct backend *backend);
+	/* Optional, make the data of all the completed writes durable in the final storage */
+	int (*flush)(struct backend *backend);
+	/* Optional, print the backend's counters */
+	void (*stats)(struct backend *backend);
+	/* Optional, print the counters as Prometheus metrics labeled with backend="id" */
+	void (*metrics)(struct backend *backend, FILE *out, const char *id);
+};
+
+struct backend {
+	const struct backend_ops *ops;
+	void *priv;
+};
+
+#ifdef HAVE_CUDA
+extern const struct backend_ops cuda_backend_ops;
+#endif
+extern const struct backend_ops host_backend_ops;
+extern const struct backend_ops mock_backend_ops;
+extern const struct backend_ops comp_backend_ops;
+extern const struct backend_ops dedup_backend_ops;
+extern const struct backend_ops cache_backend_ops;
+extern const struct backend_ops log_backend_ops;
+extern const struct backend_ops stripe_backend_ops;
+extern const struct backend_ops tier_backend_ops;
+extern const struct backend_ops file_backend_ops;
+extern const struct backend_ops snap_backend_ops;
+
+/* Initialize a backend from a name[:arg] spec without allocating its storage */
+extern int setup_backend(struct backend *backend, const char *spec, unsigned int slots);
+
+/* Initialize a backend from a name[:arg] spec and allocate its storage */
+extern int init_backend(struct backend *backend, const char *spec, unsigned long long size, unsigned int slots);
+
+/* Whether the backend of a spec or any of its inner backends is the named one */
+extern int spec_uses(const char *spec, const char *name);
+
+/* Print a counter of a backend as a Prometheus metric */
+extern void print_metric(FILE *out, const char *name, const char *id, unsigned long long value);
+
+/* Print the metrics of the i-th inner backend of the backend with id, the inner's id is id.i */
+extern void inner_metrics(struct backend *inner, FILE *out, const char *id, unsigned int i);
+
+#endif /* _CUDARAMD_BACKEND_H_ */
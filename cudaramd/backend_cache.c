@@ -0,0 +1,1125 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Caching backend.
+ *
+ * The spec is cache:sizeMB:backend[:arg], e.g. cache:256:cuda:0. The hot pages
+ * are kept in sizeMB of the inner backend's transfer buffers, pinned host
+ * memory with cuda, and reads hitting them never reach the inner backend.
+ * Writes only go to the cache, a write-back thread stores the dirty pages in
+ * the inner backend in large batches once too many of them are dirty or when
+ * the cache is flushed.
+ *
+ * The pages are replaced with 2Q. A page enters a FIFO on its first use and
+ * only gets into the LRU of the frequently used pages if it's used again after
+ * falling out of the FIFO, which is remembered in a FIFO of ghosts. A scan
+ * only ever cycles through the first FIFO.
+ *
+ * Pages missing in the cache are read from the inner backend straight into the
+ * caller's buffer and added to the cache once the transfer is done, unless the
+ * page was written in the meantime. Writes bypass the cache if there is no
+ * clean page to replace.
+ *
+ * Sequential read streams are detected in a small table keyed by the page
+ * each stream is expected to read next. The pages ahead of a stream are
+ * prefetched into the cache one window at a time, the window doubles while
+ * the stream keeps hitting the prefetched pages and halves when it doesn't.
+ * The spec takes the largest window in pages, cache:sizeMB[/readahead]:...,
+ * 0 turns the read-ahead off.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define NONE (~0U)
+#define GHOST (~1U) /* map value of the pages remembered as ghosts */
+
+#define BATCH_PAGES 256 /* pages written back at once */
+#define SCAN_PAGES 16 /* pages checked for being clean when looking for one to replace */
+/* in_flight of a page counts the reads and the writes, STALE if written while in flight */
+#define READ_ONE 1U
+#define WRITE_ONE (1U << 15)
+#define WRITES (0xffffU << 15)
+#define STALE (1U << 31)
+
+#define DEFAULT_READAHEAD 256 /* largest prefetch window in pages */
+#define MIN_WINDOW 16
+#define STREAMS 8
+#define STREAM_SLACK 64 /* reads of a stream can be reordered across the channels */
+
+enum { LIST_IN, LIST_MAIN };
+enum { LINK_LRU, LINK_DIRTY };
+
+struct cache_link {
+	unsigned int prev, next;
+};
+
+/* A list of entries, the head is the most recently added */
+struct cache_list {
+	unsigned int head, tail;
+	unsigned int len;
+};
+
+struct cache_entry {
+	struct cache_link links[2]; /* in the FIFO or the LRU and in the dirty list */
+	unsigned int page;
+	unsigned short pins; /* copies in progress */
+	unsigned char list; /* LIST_IN or LIST_MAIN */
+	unsigned char dirty;
+	unsigned char writeback; /* being written back */
+	unsigned char prefetched; /* prefetched and not read yet */
+	unsigned long long dirty_seq; /* when the page became dirty */
+};
+
+#define PENDING_WRITE (1 << 0)
+#define PENDING_PREFETCH (1 << 1)
+
+/* A transfer of a page that bypasses the cache */
+struct cache_pending {
+	unsigned int page;
+	unsigned int flags; /* PENDING_* */
+	void *buf;
+};
+
+/* A copy between a cached page and the caller's buffer */
+struct cache_copy {
+	unsigned int entry;
+	void *buf;
+};
+
+struct cache_slot {
+	struct cache_pending *pending; /* added to the cache once the slot is done */
+	unsigned int nr_pending;
+	unsigned int max_pending;
+	struct cache_copy *copies;
+	unsigned int max_copies;
+};
+
+/* A sequential read stream */
+struct cache_stream {
+	unsigned int next; /* page expected to be read next */
+	unsigned int ahead; /* end of the pages prefetched so far */
+	unsigned int window; /* pages prefetched at once */
+	unsigned int seq; /* reads following each other, 0 for a new stream */
+	unsigned int read; /* pages read since the window was adjusted */
+	unsigned int used; /* prefetched pages among them */
+	unsigned long long used_at;
+};
+
+/* A page being written back */
+struct cache_writeback {
+	unsigned int page;
+	unsigned int entry;
+};
+
+struct cache_backend {
+	struct backend inner;
+	unsigned long page_size;
+	unsigned long long size;
+
+	unsigned int *map; /* entry of each page, NONE or GHOST if not cached */
+	unsigned int *in_flight; /* transfers bypassing the cache for each page */
+	unsigned int nr_pages;
+
+	pthread_mutex_t lock; /* protect everything but the cached data */
+	pthread_cond_t writeback_cond; /* wake up the write-back thread */
+	pthread_cond_t done_cond; /* write-back progress */
+
+	void *data;
+	struct cache_entry *entries;
+	unsigned int nr_entries;
+	unsigned int *free_entries;
+	unsigned int nr_free;
+	struct cache_list in; /* FIFO of the pages used once */
+	struct cache_list main; /* LRU of the pages used again */
+	unsigned int max_in; /* the FIFO is replaced from first once over this size */
+	unsigned int *ghosts; /* ring of the pages replaced from the FIFO */
+	unsigned int nr_ghosts;
+	unsigned int next_ghost;
+
+	struct cache_list dirty;
+	unsigned int high_dirty; /* write back once more pages are dirty */
+	unsigned int low_dirty; /* down to this many */
+	int draining;
+	int pressure; /* no clean page was found to replace */
+	unsigned long long dirty_seq; /* last dirty_seq given out */
+	unsigned long long flush_seq; /* pages dirtied up to this have to be written back */
+	unsigned long long clean_seq; /* pages dirtied up to this are written back */
+	int err; /* write-back error reported by the next flush */
+
+	pthread_t thread;
+	unsigned int slot; /* inner slot of the write-back thread */
+	void *staging; /* BATCH_PAGES pages of inner backend buffer */
+	struct cache_writeback *batch;
+
+	struct cache_slot *slots; /* the last one prefetches */
+	unsigned int nr_slots;
+
+	pthread_mutex_t ra_lock; /* protect the streams and the prefetch slot */
+	struct cache_stream streams[STREAMS];
+	unsigned long long ra_clock;
+	unsigned int max_window; /* 0 if there is no read-ahead */
+	void *ra_buf; /* max_window pages of inner backend buffer */
+	int ra_busy; /* a prefetch is in flight */
+	unsigned int ra_start, ra_end; /* pages of the prefetch in flight */
+
+	/* Counters, updated with the lock held */
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long bypassed; /* writes with no page to replace */
+	unsigned long long replaced;
+	unsigned long long written_back;
+	unsigned long long prefetched;
+	unsigned long long prefetch_hits;
+	unsigned long long prefetch_wasted; /* replaced before being read */
+};
+
+static struct cache_link *link_of(struct cache_backend *cache, unsigned int entry, int link)
+{
+	return &cache->entries[entry].links[link];
+}
+
+static void list_init(struct cache_list *list)
+{
+	list->head = list->tail = NONE;
+	list->len = 0;
+}
+
+static void list_add(struct cache_backend *cache, struct cache_list *list, unsigned int entry, int link)
+{
+	struct cache_link *l = link_of(cache, entry, link);
+
+	l->prev = NONE;
+	l->next = list->head;
+	if (list->head != NONE)
+		link_of(cache, list->head, link)->prev = entry;
+	else
+		list->tail = entry;
+	list->head = entry;
+	++list->len;
+}
+
+static void list_del(struct cache_backend *cache, struct cache_list *list, unsigned int entry, int link)
+{
+	struct cache_link *l = link_of(cache, entry, link);
+
+	if (l->prev != NONE)
+		link_of(cache, l->prev, link)->next = l->next;
+	else
+		list->head = l->next;
+	if (l->next != NONE)
+		link_of(cache, l->next, link)->prev = l->prev;
+	else
+		list->tail = l->prev;
+	--list->len;
+}
+
+static struct cache_list *lru_of(struct cache_backend *cache, unsigned int entry)
+{
+	return cache->entries[entry].list == LIST_IN ? &cache->in : &cache->main;
+}
+
+static int cached(struct cache_backend *cache, unsigned int page)
+{
+	return cache->map[page] < cache->nr_entries;
+}
+
+static void set_dirty(struct cache_backend *cache, unsigned int entry)
+{
+	struct cache_entry *e = &cache->entries[entry];
+
+	if (e->dirty)
+		return;
+
+	e->dirty = 1;
+	e->dirty_seq = ++cache->dirty_seq;
+	list_add(cache, &cache->dirty, entry, LINK_DIRTY);
+}
+
+static void clear_dirty(struct cache_backend *cache, unsigned int entry)
+{
+	struct cache_entry *e = &cache->entries[entry];
+
+	if (!e->dirty)
+		return;
+
+	e->dirty = 0;
+	list_del(cache, &cache->dirty, entry, LINK_DIRTY);
+}
+
+/* Wake up the write-back thread if it has something to do */
+static void kick_writeback(struct cache_backend *cache)
+{
+	if (cache->dirty.len > cache->high_dirty || cache->draining || cache->pressure ||
+	    cache->flush_seq > cache->clean_seq)
+		pthread_cond_signal(&cache->writeback_cond);
+}
+
+/*
+ * Remember a page replaced from the FIFO and forget the oldest one. A page
+ * remembered twice is forgotten early, which only costs a promotion.
+ */
+static void add_ghost(struct cache_backend *cache, unsigned int page)
+{
+	unsigned int old = cache->ghosts[cache->next_ghost];
+
+	if (old != NONE && cache->map[old] == GHOST)
+		cache->map[old] = NONE;
+
+	cache->ghosts[cache->next_ghost] = page;
+	cache->map[page] = GHOST;
+	cache->next_ghost = (cache->next_ghost + 1) % cache->nr_ghosts;
+}
+
+/* Find a clean page near the tail of a list */
+static unsigned int scan_list(struct cache_backend *cache, struct cache_list *list)
+{
+	unsigned int entry, i;
+
+	for (entry = list->tail, i = 0; entry != NONE && i < SCAN_PAGES;
+	     entry = link_of(cache, entry, LINK_LRU)->prev, ++i) {
+		struct cache_entry *e = &cache->entries[entry];
+
+		if (!e->dirty && !e->writeback && !e->pins)
+			return entry;
+	}
+
+	return NONE;
+}
+
+/* Get an entry for a new page, replacing a clean page if needed. Must be called with the lock held */
+static unsigned int get_entry(struct cache_backend *cache)
+{
+	unsigned int entry;
+	struct cache_entry *e;
+	int over = cache->in.len > cache->max_in;
+
+	if (cache->nr_free)
+		return cache->free_entries[--cache->nr_free];
+
+	entry = scan_list(cache, over ? &cache->in : &cache->main);
+	if (entry == NONE)
+		entry = scan_list(cache, over ? &cache->main : &cache->in);
+	if (entry == NONE) {
+		/* Everything is dirty, write some back */
+		cache->pressure = 1;
+		kick_writeback(cache);
+		return NONE;
+	}
+
+	e = &cache->entries[entry];
+	list_del(cache, lru_of(cache, entry), entry, LINK_LRU);
+	if (e->prefetched)
+		++cache->prefetch_wasted;
+	if (e->list == LIST_IN)
+		add_ghost(cache, e->page);
+	else
+		cache->map[e->page] = NONE;
+	++cache->replaced;
+
+	return entry;
+}
+
+/* Cache a page, returns its entry or NONE if there is no room. Must be called with the lock held */
+static unsigned int insert_page(struct cache_backend *cache, unsigned int page)
+{
+	int promote = cache->map[page] == GHOST;
+	unsigned int entry = get_entry(cache);
+	struct cache_entry *e;
+
+	if (entry == NONE)
+		return NONE;
+
+	e = &cache->entries[entry];
+	e->page = page;
+	e->prefetched = 0;
+	e->list = promote ? LIST_MAIN : LIST_IN;
+	list_add(cache, lru_of(cache, entry), entry, LINK_LRU);
+	cache->map[page] = entry;
+
+	return entry;
+}
+
+/* Only pages in the LRU move on use, the FIFO keeps the order of the first use */
+static void touch(struct cache_backend *cache, unsigned int entry)
+{
+	if (cache->entries[entry].list != LIST_MAIN)
+		return;
+
+	list_del(cache, &cache->main, entry, LINK_LRU);
+	list_add(cache, &cache->main, entry, LINK_LRU);
+}
+
+/* Make room for the transfers of pages pages on a slot */
+static int reserve(struct cache_slot *slot, unsigned int pages)
+{
+	if (slot->max_copies < pages) {
+		struct cache_copy *copies = realloc(slot->copies, pages * sizeof(*copies));
+
+		if (!copies)
+			return -ENOMEM;
+
+		slot->copies = copies;
+		slot->max_copies = pages;
+	}
+
+	if (slot->max_pending - slot->nr_pending < pages) {
+		unsigned int max_pending = slot->nr_pending + pages;
+		struct cache_pending *pending = realloc(slot->pending, max_pending * sizeof(*pending));
+
+		if (!pending)
+			return -ENOMEM;
+
+		slot->pending = pending;
+		slot->max_pending = max_pending;
+	}
+
+	return 0;
+}
+
+static void add_pending(struct cache_backend *cache, struct cache_slot *slot, unsigned int page,
+		unsigned int flags, void *buf)
+{
+	struct cache_pending *p = &slot->pending[slot->nr_pending++];
+
+	p->page = page;
+	p->flags = flags;
+	p->buf = buf;
+
+	if (flags & PENDING_WRITE)
+		cache->in_flight[page] = (cache->in_flight[page] + WRITE_ONE) | STALE;
+	else
+		cache->in_flight[page] += READ_ONE;
+}
+
+/*
+ * Account for the transfers bypassing the cache from the pending one first on,
+ * the pages read are added to the cache unless they were written meanwhile.
+ */
+static void finish_pending(struct cache_backend *cache, struct cache_slot *slot, unsigned int first, int err)
+{
+	unsigned int i;
+
+	if (slot->nr_pending == first)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = first; i < slot->nr_pending; ++i) {
+		struct cache_pending *p = &slot->pending[i];
+		unsigned int *in_flight = &cache->in_flight[p->page];
+		int stale = *in_flight & STALE;
+		unsigned int entry;
+
+		*in_flight -= p->flags & PENDING_WRITE ? WRITE_ONE : READ_ONE;
+		if (!(*in_flight & ~STALE))
+			*in_flight = 0;
+
+		if (err || (p->flags & PENDING_WRITE) || stale || cached(cache, p->page))
+			continue;
+
+		entry = insert_page(cache, p->page);
+		if (entry == NONE)
+			continue;
+
+		memcpy(cache->data + (size_t)entry * cache->page_size, p->buf, cache->page_size);
+		cache->entries[entry].prefetched = !!(p->flags & PENDING_PREFETCH);
+	}
+	kick_writeback(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	slot->nr_pending = first;
+}
+
+/* Issue an inner transfer for each run of consecutive pending pages from first on */
+static int issue_pending(struct cache_backend *cache, unsigned int slot, unsigned int first)
+{
+	struct backend *inner = &cache->inner;
+	struct cache_pending *pending = cache->slots[slot].pending;
+	unsigned int i, start, nr = cache->slots[slot].nr_pending;
+	int err;
+
+	for (i = first, start = first; i < nr; ++i) {
+		if (i + 1 < nr && pending[i + 1].page == pending[i].page + 1)
+			continue;
+
+		if (pending[start].flags & PENDING_WRITE)
+			err = inner->ops->write(inner, slot, pending[start].buf,
+					(unsigned long long)pending[start].page * cache->page_size,
+					(i + 1 - start) * cache->page_size);
+		else
+			err = inner->ops->read(inner, slot, pending[start].buf,
+					(unsigned long long)pending[start].page * cache->page_size,
+					(i + 1 - start) * cache->page_size);
+		if (err) {
+			/* Nothing was issued from start on */
+			finish_pending(cache, &cache->slots[slot], start, err);
+			return err;
+		}
+		start = i + 1;
+	}
+
+	return 0;
+}
+
+static void unpin(struct cache_backend *cache, struct cache_copy *copies, unsigned int nr, int dirty)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < nr; ++i) {
+		--cache->entries[copies[i].entry].pins;
+		if (dirty)
+			set_dirty(cache, copies[i].entry);
+	}
+	kick_writeback(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Account for a finished prefetch, waiting for it if it has pages about to be read. Must be called with ra_lock held */
+static void reap_prefetch(struct cache_backend *cache, unsigned int page, unsigned int pages)
+{
+	struct backend *inner = &cache->inner;
+	unsigned int slot = cache->nr_slots;
+	int err;
+
+	if (!cache->ra_busy)
+		return;
+
+	if (page < cache->ra_end && page + pages > cache->ra_start)
+		err = inner->ops->wait(inner, slot);
+	else
+		err = inner->ops->query(inner, slot);
+
+	if (err == -EAGAIN)
+		return;
+
+	finish_pending(cache, &cache->slots[slot], 0, err);
+	cache->ra_busy = 0;
+}
+
+/* Find the stream of a read or start a new one in place of the least recently used. Must be called with ra_lock held */
+static struct cache_stream *find_stream(struct cache_backend *cache, unsigned int page, unsigned int pages)
+{
+	struct cache_stream *stream, *oldest = &cache->streams[0];
+
+	for (stream = cache->streams; stream < cache->streams + STREAMS; ++stream) {
+		if (stream->used_at && page + STREAM_SLACK >= stream->next && page <= stream->next + STREAM_SLACK) {
+			++stream->seq;
+			goto found;
+		}
+		if (stream->used_at < oldest->used_at)
+			oldest = stream;
+	}
+
+	stream = oldest;
+	memset(stream, 0, sizeof(*stream));
+	stream->window = MIN_WINDOW < cache->max_window ? MIN_WINDOW : cache->max_window;
+found:
+	stream->used_at = ++cache->ra_clock;
+	if (stream->next < page + pages)
+		stream->next = page + pages;
+	stream->read += pages;
+
+	return stream;
+}
+
+/*
+ * Prefetch the next window of a sequential stream once less than half of a
+ * window is left ahead of it. Must be called with ra_lock held.
+ */
+static void prefetch(struct cache_backend *cache, struct cache_stream *stream)
+{
+	unsigned int slot = cache->nr_slots;
+	struct cache_slot *s = &cache->slots[slot];
+	unsigned int page, end;
+
+	if (!stream->seq || cache->ra_busy)
+		return;
+
+	if (stream->ahead < stream->next)
+		stream->ahead = stream->next;
+	if (stream->ahead - stream->next >= stream->window / 2)
+		return;
+
+	/* Grow the window while the stream hits the prefetched pages, shrink it when it doesn't */
+	if (stream->used * 4 >= stream->read * 3)
+		stream->window = stream->window * 2 < cache->max_window ? stream->window * 2 : cache->max_window;
+	else if (stream->used * 2 < stream->read && stream->window / 2 >= MIN_WINDOW)
+		stream->window /= 2;
+	stream->read = stream->used = 0;
+
+	end = stream->next + stream->window;
+	if (end > cache->nr_pages)
+		end = cache->nr_pages;
+	if (stream->ahead >= end)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	for (page = stream->ahead; page < end; ++page) {
+		if (!cached(cache, page) && !cache->in_flight[page])
+			add_pending(cache, s, page, PENDING_PREFETCH,
+					cache->ra_buf + (page - stream->ahead) * cache->page_size);
+	}
+	cache->prefetched += s->nr_pending;
+	pthread_mutex_unlock(&cache->lock);
+
+	/* What failed to be issued is dropped, the rest is still reaped */
+	issue_pending(cache, slot, 0);
+	if (s->nr_pending) {
+		cache->ra_busy = 1;
+		cache->ra_start = stream->ahead;
+		cache->ra_end = end;
+	}
+	stream->ahead = end;
+}
+
+static int cache_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	struct cache_backend *cache = backend->priv;
+	struct cache_slot *s = &cache->slots[slot];
+	unsigned int page = offset / cache->page_size;
+	unsigned int pages = len / cache->page_size;
+	unsigned int i, nr_copies = 0, used = 0, first = s->nr_pending;
+	struct cache_stream *stream = NULL;
+	int err;
+
+	err = reserve(s, pages);
+	if (err)
+		return err;
+
+	if (cache->max_window) {
+		pthread_mutex_lock(&cache->ra_lock);
+		reap_prefetch(cache, page, pages);
+		stream = find_stream(cache, page, pages);
+		pthread_mutex_unlock(&cache->ra_lock);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < pages; ++i) {
+		void *dst = buf + i * cache->page_size;
+		unsigned int entry = cache->map[page + i];
+
+		if (entry < cache->nr_entries) {
+			struct cache_entry *e = &cache->entries[entry];
+
+			++e->pins;
+			touch(cache, entry);
+			s->copies[nr_copies].entry = entry;
+			s->copies[nr_copies++].buf = dst;
+			++cache->hits;
+			if (e->prefetched) {
+				e->prefetched = 0;
+				++cache->prefetch_hits;
+				++used;
+			}
+		} else {
+			add_pending(cache, s, page + i, 0, dst);
+			++cache->misses;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	/* The pinned pages are not replaced while being copied */
+	for (i = 0; i < nr_copies; ++i)
+		memcpy(s->copies[i].buf, cache->data + (size_t)s->copies[i].entry * cache->page_size, cache->page_size);
+
+	if (nr_copies)
+		unpin(cache, s->copies, nr_copies, 0);
+
+	err = issue_pending(cache, slot, first);
+
+	if (stream) {
+		pthread_mutex_lock(&cache->ra_lock);
+		stream->used += used;
+		prefetch(cache, stream);
+		pthread_mutex_unlock(&cache->ra_lock);
+	}
+
+	return err;
+}
+
+static int cache_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	struct cache_backend *cache = backend->priv;
+	struct cache_slot *s = &cache->slots[slot];
+	unsigned int page = offset / cache->page_size;
+	unsigned int pages = len / cache->page_size;
+	unsigned int i, nr_copies = 0, first = s->nr_pending;
+	int err;
+
+	err = reserve(s, pages);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < pages; ++i) {
+		void *src = (void *)buf + i * cache->page_size;
+		unsigned int entry = cache->map[page + i];
+
+		/* Don't cache what's being read from the inner backend */
+		if (cache->in_flight[page + i])
+			cache->in_flight[page + i] |= STALE;
+
+		if (entry >= cache->nr_entries)
+			entry = insert_page(cache, page + i);
+
+		if (entry != NONE) {
+			++cache->entries[entry].pins;
+			cache->entries[entry].prefetched = 0;
+			touch(cache, entry);
+			s->copies[nr_copies].entry = entry;
+			s->copies[nr_copies++].buf = src;
+		} else {
+			add_pending(cache, s, page + i, PENDING_WRITE, src);
+			++cache->bypassed;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	for (i = 0; i < nr_copies; ++i)
+		memcpy(cache->data + (size_t)s->copies[i].entry * cache->page_size, s->copies[i].buf, cache->page_size);
+
+	if (nr_copies)
+		unpin(cache, s->copies, nr_copies, 1);
+
+	return issue_pending(cache, slot, first);
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	const struct cache_writeback *x = a, *y = b;
+
+	return x->page < y->page ? -1 : x->page > y->page;
+}
+
+/* Take up to BATCH_PAGES of the oldest dirty pages for writing back. Must be called with the lock held */
+static unsigned int collect_batch(struct cache_backend *cache)
+{
+	unsigned int entry, prev, nr = 0;
+
+	for (entry = cache->dirty.tail; entry != NONE && nr < BATCH_PAGES; entry = prev) {
+		struct cache_entry *e = &cache->entries[entry];
+
+		prev = link_of(cache, entry, LINK_DIRTY)->prev;
+
+		/* Being copied or written by a transfer bypassing the cache, wait for it */
+		if (e->pins || (cache->in_flight[e->page] & WRITES))
+			continue;
+
+		clear_dirty(cache, entry);
+		e->writeback = 1;
+		cache->batch[nr].page = e->page;
+		cache->batch[nr++].entry = entry;
+	}
+
+	return nr;
+}
+
+/* Store a batch in the inner backend, a transfer for each run of consecutive pages */
+static int write_batch(struct cache_backend *cache, unsigned int nr)
+{
+	struct backend *inner = &cache->inner;
+	struct cache_writeback *batch = cache->batch;
+	unsigned int i, start;
+	int err = 0;
+
+	qsort(batch, nr, sizeof(*batch), compare_pages);
+
+	/* Pages written meanwhile are dirty again and written back later */
+	for (i = 0; i < nr; ++i)
+		memcpy(cache->staging + i * cache->page_size,
+				cache->data + (size_t)batch[i].entry * cache->page_size, cache->page_size);
+
+	for (i = 0, start = 0; i < nr && !err; ++i) {
+		if (i + 1 < nr && batch[i + 1].page == batch[i].page + 1)
+			continue;
+
+		err = inner->ops->write(inner, cache->slot, cache->staging + start * cache->page_size,
+				(unsigned long long)batch[start].page * cache->page_size,
+				(i + 1 - start) * cache->page_size);
+		if (!err)
+			start = i + 1;
+	}
+
+	if (start) {
+		int wait_err = inner->ops->wait(inner, cache->slot);
+
+		if (!err)
+			err = wait_err;
+	}
+
+	return err;
+}
+
+/* All the pages dirtied up to clean_seq are written back once nothing older is dirty */
+static void update_clean(struct cache_backend *cache)
+{
+	unsigned long long clean = cache->dirty.len ?
+		cache->entries[cache->dirty.tail].dirty_seq - 1 : cache->dirty_seq;
+
+	if (clean != cache->clean_seq) {
+		cache->clean_seq = clean;
+		pthread_cond_broadcast(&cache->done_cond);
+	}
+}
+
+static void *writeback_thread(void *arg)
+{
+	struct cache_backend *cache = arg;
+	struct backend *inner = &cache->inner;
+
+	if (inner->ops->attach && inner->ops->attach(inner))
+		exit(EXIT_FAILURE);
+
+	pthread_mutex_lock(&cache->lock);
+	while (1) {
+		unsigned int i, nr;
+		int err;
+
+		update_clean(cache);
+
+		if (cache->dirty.len > cache->high_dirty)
+			cache->draining = 1;
+		else if (cache->dirty.len <= cache->low_dirty)
+			cache->draining = 0;
+
+		nr = 0;
+		if (cache->draining || cache->pressure || cache->flush_seq > cache->clean_seq)
+			nr = collect_batch(cache);
+		cache->pressure = 0;
+
+		/* Idle or only busy pages left, the transfers kick the thread when done */
+		if (!nr) {
+			pthread_cond_wait(&cache->writeback_cond, &cache->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+		err = write_batch(cache, nr);
+		pthread_mutex_lock(&cache->lock);
+
+		for (i = 0; i < nr; ++i) {
+			cache->entries[cache->batch[i].entry].writeback = 0;
+			if (err)
+				set_dirty(cache, cache->batch[i].entry);
+		}
+		pthread_cond_broadcast(&cache->done_cond);
+
+		if (err) {
+			pr_err("Writing back %u pages failed (%d)\n", nr, err);
+			cache->err = err;
+			pthread_mutex_unlock(&cache->lock);
+			/* Retry after a while */
+			sleep(1);
+			pthread_mutex_lock(&cache->lock);
+		} else {
+			cache->written_back += nr;
+		}
+	}
+
+	return NULL;
+}
+
+static int cache_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct cache_backend *cache;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	char *end;
+
+	if (!spec) {
+		pr_err("The cache backend needs a size and an inner backend, cache:sizeMB[/readahead]:backend[:arg]\n");
+		return -1;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -1;
+
+	cache->size = strtoull(arg, &end, 10) << 20;
+	cache->max_window = DEFAULT_READAHEAD;
+	if (*end == '/')
+		cache->max_window = strtoul(end + 1, &end, 10);
+	if (end != spec || !cache->size) {
+		pr_err("Invalid cache size '%.*s'\n", (int)(spec - arg), arg);
+		goto err_free;
+	}
+
+	cache->page_size = sysconf(_SC_PAGESIZE);
+	cache->nr_slots = slots;
+	cache->slots = calloc(slots + 1, sizeof(*cache->slots));
+	if (!cache->slots)
+		goto err_free;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->writeback_cond, NULL);
+	pthread_cond_init(&cache->done_cond, NULL);
+	pthread_mutex_init(&cache->ra_lock, NULL);
+
+	/* Extra inner slots for prefetching and writing back */
+	cache->slot = slots + 1;
+	if (setup_backend(&cache->inner, spec + 1, slots + 2))
+		goto err_free_slots;
+
+	backend->priv = cache;
+
+	return 0;
+
+err_free_slots:
+	free(cache->slots);
+err_free:
+	free(cache);
+
+	return -1;
+}
+
+/* The FIFO is kept at a quarter of the cache and as many ghosts as half of the cache are remembered */
+static int cache_alloc(struct backend *backend, unsigned long long size)
+{
+	unsigned int i;
+	int err;
+	struct cache_backend *cache = backend->priv;
+	struct backend *inner = &cache->inner;
+
+	if (size / cache->page_size >= GHOST) {
+		pr_err("The cache backend supports up to %u pages\n", GHOST - 1);
+		return -1;
+	}
+
+	cache->nr_pages = size / cache->page_size;
+	cache->nr_entries = cache->size / cache->page_size;
+	if (cache->nr_entries > cache->nr_pages)
+		cache->nr_entries = cache->nr_pages;
+	cache->nr_ghosts = cache->nr_entries / 2 ? cache->nr_entries / 2 : 1;
+	cache->max_in = cache->nr_entries / 4;
+	cache->high_dirty = cache->nr_entries / 2;
+	cache->low_dirty = cache->nr_entries / 4;
+
+	cache->map = malloc(cache->nr_pages * sizeof(*cache->map));
+	cache->in_flight = calloc(cache->nr_pages, sizeof(*cache->in_flight));
+	cache->entries = calloc(cache->nr_entries, sizeof(*cache->entries));
+	cache->free_entries = malloc(cache->nr_entries * sizeof(*cache->free_entries));
+	cache->ghosts = malloc(cache->nr_ghosts * sizeof(*cache->ghosts));
+	cache->batch = malloc(BATCH_PAGES * sizeof(*cache->batch));
+	if (!cache->map || !cache->in_flight || !cache->entries || !cache->free_entries ||
+	    !cache->ghosts || !cache->batch) {
+		pr_err("Allocating the cache tables failed\n");
+		return -1;
+	}
+	memset(cache->map, 0xff, cache->nr_pages * sizeof(*cache->map));
+	memset(cache->ghosts, 0xff, cache->nr_ghosts * sizeof(*cache->ghosts));
+
+	/* Hand out the entries from the first one */
+	for (i = 0; i < cache->nr_entries; ++i)
+		cache->free_entries[i] = cache->nr_entries - 1 - i;
+	cache->nr_free = cache->nr_entries;
+
+	list_init(&cache->in);
+	list_init(&cache->main);
+	list_init(&cache->dirty);
+
+	if (inner->ops->alloc(inner, size))
+		return -1;
+
+	cache->data = inner->ops->alloc_buffer(inner, (size_t)cache->nr_entries * cache->page_size);
+	cache->staging = inner->ops->alloc_buffer(inner, BATCH_PAGES * cache->page_size);
+	if (!cache->data || !cache->staging) {
+		pr_err("Allocating %u cache pages failed\n", cache->nr_entries);
+		return -1;
+	}
+
+	if (cache->max_window) {
+		cache->ra_buf = inner->ops->alloc_buffer(inner, (size_t)cache->max_window * cache->page_size);
+		if (!cache->ra_buf || reserve(&cache->slots[cache->nr_slots], cache->max_window)) {
+			pr_err("Allocating the read-ahead buffer failed\n");
+			return -1;
+		}
+	}
+
+	err = pthread_create(&cache->thread, NULL, writeback_thread, cache);
+	if (err) {
+		pr_err("Creating the write-back thread failed (%s)\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cache_attach(struct backend *backend)
+{
+	struct cache_backend *cache = backend->priv;
+	struct backend *inner = &cache->inner;
+
+	return inner->ops->attach ? inner->ops->attach(inner) : 0;
+}
+
+static void *cache_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct cache_backend *cache = backend->priv;
+
+	return cache->inner.ops->alloc_buffer(&cache->inner, size);
+}
+
+static int cache_query(struct backend *backend, unsigned int slot)
+{
+	struct cache_backend *cache = backend->priv;
+	int err = cache->inner.ops->query(&cache->inner, slot);
+
+	if (err != -EAGAIN)
+		finish_pending(cache, &cache->slots[slot], 0, err);
+
+	return err;
+}
+
+static int cache_wait(struct backend *backend, unsigned int slot)
+{
+	struct cache_backend *cache = backend->priv;
+	int err = cache->inner.ops->wait(&cache->inner, slot);
+
+	finish_pending(cache, &cache->slots[slot], 0, err);
+
+	return err;
+}
+
+/* Drop the cached pages of a range, waiting for them to be written back first */
+static void drop_range(struct cache_backend *cache, unsigned long long offset, size_t len)
+{
+	unsigned int page = offset / cache->page_size;
+	unsigned int end = (offset + len) / cache->page_size;
+
+	pthread_mutex_lock(&cache->lock);
+	for (; page < end; ++page) {
+		unsigned int entry;
+
+		/* Don't cache a prefetch of the old data */
+		if (cache->in_flight[page])
+			cache->in_flight[page] |= STALE;
+
+		while ((entry = cache->map[page]) < cache->nr_entries && cache->entries[entry].writeback)
+			pthread_cond_wait(&cache->done_cond, &cache->lock);
+
+		if (entry == GHOST)
+			cache->map[page] = NONE;
+		if (entry >= cache->nr_entries)
+			continue;
+
+		clear_dirty(cache, entry);
+		list_del(cache, lru_of(cache, entry), entry, LINK_LRU);
+		cache->map[page] = NONE;
+		cache->free_entries[cache->nr_free++] = entry;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int cache_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct cache_backend *cache = backend->priv;
+
+	drop_range(cache, offset, len);
+
+	return cache->inner.ops->zero(&cache->inner, offset, len);
+}
+
+static int cache_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct cache_backend *cache = backend->priv;
+
+	drop_range(cache, offset, len);
+
+	return cache->inner.ops->discard(&cache->inner, offset, len);
+}
+
+static int cache_sync(struct backend *backend)
+{
+	struct cache_backend *cache = backend->priv;
+
+	return cache->inner.ops->sync(&cache->inner);
+}
+
+/* Write back all the pages dirty by now */
+static int cache_flush(struct backend *backend)
+{
+	int err;
+	struct cache_backend *cache = backend->priv;
+	struct backend *inner = &cache->inner;
+	unsigned long long target;
+
+	pthread_mutex_lock(&cache->lock);
+	target = cache->dirty_seq;
+	if (cache->flush_seq < target) {
+		cache->flush_seq = target;
+		pthread_cond_signal(&cache->writeback_cond);
+	}
+	while (cache->clean_seq < target)
+		pthread_cond_wait(&cache->done_cond, &cache->lock);
+	err = cache->err;
+	cache->err = 0;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!err && inner->ops->flush)
+		err = inner->ops->flush(inner);
+
+	return err;
+}
+
+static void cache_stats(struct backend *backend)
+{
+	struct cache_backend *cache = backend->priv;
+
+	pthread_mutex_lock(&cache->lock);
+	pr_info("cache: %u of %u pages used, %u dirty, %llu hits, %llu misses, %llu writes bypassed, "
+			"%llu replaced, %llu written back, %llu prefetched, %llu prefetch hits, %llu wasted\n",
+			cache->nr_entries - cache->nr_free, cache->nr_entries, cache->dirty.len,
+			cache->hits, cache->misses, cache->bypassed, cache->replaced, cache->written_back,
+			cache->prefetched, cache->prefetch_hits, cache->prefetch_wasted);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (cache->inner.ops->stats)
+		cache->inner.ops->stats(&cache->inner);
+}
+
+static void cache_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	struct cache_backend *cache = backend->priv;
+
+	pthread_mutex_lock(&cache->lock);
+	print_metric(out, "cache_used_pages", id, cache->nr_entries - cache->nr_free);
+	print_metric(out, "cache_pages", id, cache->nr_entries);
+	print_metric(out, "cache_dirty_pages", id, cache->dirty.len);
+	print_metric(out, "cache_hits_total", id, cache->hits);
+	print_metric(out, "cache_misses_total", id, cache->misses);
+	print_metric(out, "cache_bypassed_total", id, cache->bypassed);
+	print_metric(out, "cache_replaced_total", id, cache->replaced);
+	print_metric(out, "cache_written_back_total", id, cache->written_back);
+	print_metric(out, "cache_prefetched_total", id, cache->prefetched);
+	print_metric(out, "cache_prefetch_hits_total", id, cache->prefetch_hits);
+	print_metric(out, "cache_prefetch_wasted_total", id, cache->prefetch_wasted);
+	pthread_mutex_unlock(&cache->lock);
+
+	inner_metrics(&cache->inner, out, id, 0);
+}
+
+const struct backend_ops cache_backend_ops = {
+	.name = "cache",
+	.init = cache_init,
+	.attach = cache_attach,
+	.alloc = cache_alloc,
+	.alloc_buffer = cache_alloc_buffer,
+	.read = cache_read,
+	.write = cache_write,
+	.query = cache_query,
+	.wait = cache_wait,
+	.zero = cache_zero,
+	.discard = cache_discard,
+	.sync = cache_sync,
+	.flush = cache_flush,
+	.stats = cache_stats,
+	.metrics = cache_metrics,
+};
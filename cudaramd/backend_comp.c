@@ -0,0 +1,801 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Compressing backend.
+ *
+ * The spec is comp:codec[/threads]:backend[:arg], e.g. comp:lz4/4:cuda:0.
+ * Pages are compressed by a pool of threads and stored in the inner backend,
+ * packed into slabs of slots of a single size class each. A table maps each
+ * page to its slot. Pages that don't compress below the largest class are
+ * stored raw.
+ *
+ * A slab is bound to a class only while it has slots in use, empty slabs go
+ * back to a shared pool for any class. A page that gets no slot of its class,
+ * e.g. when the slabs are all held by other classes, takes a free slot of a
+ * larger class, and failing that is stored raw in its own home slot in the
+ * first part of the inner backend, so a write never runs out of space. A page
+ * moves back into a slab when it is written again.
+ *
+ * Transfers are queued to the threads as jobs, each thread stages the data of
+ * a batch of pages in its own buffer and issues the inner transfers on its own
+ * inner slot.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "codec.h"
+#include "print.h"
+
+#define DEFAULT_THREADS 2
+
+#define SLAB_SHIFT 21
+#define SLAB_SIZE (1ULL << SLAB_SHIFT)
+#define CLASS_SHIFT 6 /* the size classes are 64 bytes apart */
+#define BATCH_PAGES 64
+
+#define NONE (~0U)
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* Where a page is stored */
+struct comp_page {
+	unsigned long long offset; /* offset of the slot in the inner backend */
+	unsigned int size; /* compressed size, page_size if raw, 0 if not stored */
+};
+
+/* A slab of slots of a single class, or a free one */
+struct comp_slab {
+	unsigned int class; /* NONE if free */
+	unsigned int used; /* slots in use */
+	unsigned int nr_slots;
+	unsigned int hint; /* word of the map to look for a free slot from */
+	unsigned long *map; /* bitmap of the slots in use, the bits past nr_slots are set */
+	unsigned int next; /* next slab with free slots of the class or next free slab, NONE if last */
+	unsigned int prev; /* previous slab with free slots of the class, NONE if first */
+};
+
+/* Slots of a single size */
+struct comp_class {
+	unsigned int partial; /* first slab with free slots, NONE if none */
+};
+
+/* Counters of a thread, only updated by the thread itself */
+struct comp_stats {
+	unsigned long long pages;
+	unsigned long long raw_pages;
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	unsigned long long compress_ns;
+	unsigned long long decompressed_pages;
+	unsigned long long decompress_ns;
+	unsigned long long home_pages; /* stored raw in their home slots for lack of space */
+};
+
+struct comp_job {
+	struct comp_job *next;
+	int write;
+	unsigned int slot;
+	void *buf;
+	unsigned long long offset;
+	size_t len;
+};
+
+struct comp_slot {
+	unsigned int pending; /* jobs not done yet */
+	int err; /* first error of the jobs since the slot was last done */
+};
+
+struct comp_thread {
+	struct comp_backend *comp;
+	pthread_t thread;
+	unsigned int slot; /* inner backend slot */
+	void *staging; /* BATCH_PAGES pages of inner backend buffer */
+	struct comp_stats stats;
+};
+
+struct comp_backend {
+	struct backend inner;
+	const struct codec *codec;
+	unsigned long page_size;
+
+	struct comp_page *pages;
+	unsigned long long nr_pages;
+
+	pthread_mutex_t alloc_lock; /* protect the classes and the slabs */
+	struct comp_class *classes;
+	unsigned int nr_classes;
+	struct comp_slab *slabs;
+	unsigned int nr_slabs;
+	unsigned int next_slab; /* first never used slab */
+	unsigned int free_slabs; /* first free slab, NONE if none */
+	unsigned long long slab_base; /* the slabs follow the home slots of the pages */
+	unsigned long long slabs_released; /* emptied and discarded in the inner backend */
+	unsigned long long size; /* size of the inner backend */
+
+	pthread_mutex_t lock; /* protect the job queue and the slots */
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct comp_job *first_job;
+	struct comp_job *last_job;
+	struct comp_slot *slots;
+	unsigned int nr_slots;
+	unsigned int pending; /* jobs not done yet */
+
+	struct comp_thread *threads;
+	unsigned int nr_threads;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int class_of(unsigned int size)
+{
+	return (size - 1) >> CLASS_SHIFT;
+}
+
+static unsigned int class_size(unsigned int class)
+{
+	return (class + 1) << CLASS_SHIFT;
+}
+
+static void unlink_partial(struct comp_backend *comp, unsigned int index)
+{
+	struct comp_slab *slab = &comp->slabs[index];
+
+	if (slab->prev != NONE)
+		comp->slabs[slab->prev].next = slab->next;
+	else
+		comp->classes[slab->class].partial = slab->next;
+	if (slab->next != NONE)
+		comp->slabs[slab->next].prev = slab->prev;
+}
+
+static void link_partial(struct comp_backend *comp, unsigned int index)
+{
+	struct comp_slab *slab = &comp->slabs[index];
+	struct comp_class *c = &comp->classes[slab->class];
+
+	slab->prev = NONE;
+	slab->next = c->partial;
+	if (c->partial != NONE)
+		comp->slabs[c->partial].prev = index;
+	c->partial = index;
+}
+
+/* Bind a free slab to a class, returns NONE if there is none, must be called with alloc_lock held */
+static unsigned int get_slab(struct comp_backend *comp, unsigned int class)
+{
+	unsigned int index = comp->free_slabs;
+	unsigned int words, nr_slots = SLAB_SIZE / class_size(class);
+	struct comp_slab *slab;
+
+	if (index == NONE && comp->next_slab == comp->nr_slabs)
+		return NONE;
+
+	words = (nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	slab = &comp->slabs[index != NONE ? index : comp->next_slab];
+	slab->map = calloc(words, sizeof(*slab->map));
+	if (!slab->map)
+		return NONE;
+
+	if (nr_slots % BITS_PER_WORD)
+		slab->map[words - 1] = ~0UL << (nr_slots % BITS_PER_WORD);
+
+	if (index != NONE)
+		comp->free_slabs = slab->next;
+	else
+		index = comp->next_slab++;
+
+	slab->class = class;
+	slab->used = 0;
+	slab->nr_slots = nr_slots;
+	slab->hint = 0;
+	link_partial(comp, index);
+
+	return index;
+}
+
+/* Take a free slot of a slab with some, must be called with alloc_lock held */
+static unsigned long long take_slot(struct comp_backend *comp, unsigned int index)
+{
+	struct comp_slab *slab = &comp->slabs[index];
+	unsigned int word = slab->hint, bit;
+
+	while (slab->map[word] == ~0UL)
+		word = (word + 1) % ((slab->nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD);
+
+	bit = __builtin_ctzl(~slab->map[word]);
+	slab->map[word] |= 1UL << bit;
+	slab->hint = word;
+
+	if (++slab->used == slab->nr_slots)
+		unlink_partial(comp, index);
+
+	return comp->slab_base + ((unsigned long long)index << SLAB_SHIFT) +
+		(unsigned long long)(word * BITS_PER_WORD + bit) * class_size(slab->class);
+}
+
+/*
+ * Get a free slot of a class or, if there are no free slabs left, of a
+ * larger one. Returns -1 if there is none, the page is stored in its home
+ * slot then.
+ */
+static long long alloc_slot(struct comp_backend *comp, unsigned int class)
+{
+	long long slot = -1;
+	unsigned int c, index;
+
+	pthread_mutex_lock(&comp->alloc_lock);
+	index = comp->classes[class].partial;
+	if (index == NONE)
+		index = get_slab(comp, class);
+	for (c = class + 1; index == NONE && c < comp->nr_classes; ++c)
+		index = comp->classes[c].partial;
+	if (index != NONE)
+		slot = take_slot(comp, index);
+	pthread_mutex_unlock(&comp->alloc_lock);
+
+	return slot;
+}
+
+/*
+ * Free the slot of a page, a slab left empty goes back to the free slabs and
+ * its memory to the inner backend. That's done with the lock held so that the
+ * slab isn't reused before, emptying a slab is rare enough.
+ */
+static void free_slot(struct comp_backend *comp, struct comp_page *page)
+{
+	unsigned long long offset = page->offset - comp->slab_base;
+	unsigned int index, slot;
+	struct comp_slab *slab;
+
+	/* Nothing to free in the home slots */
+	if (!page->size || page->offset < comp->slab_base)
+		goto out;
+
+	index = offset >> SLAB_SHIFT;
+	slab = &comp->slabs[index];
+
+	pthread_mutex_lock(&comp->alloc_lock);
+	slot = (offset & (SLAB_SIZE - 1)) / class_size(slab->class);
+	slab->map[slot / BITS_PER_WORD] &= ~(1UL << (slot % BITS_PER_WORD));
+	if (slab->used-- == slab->nr_slots)
+		link_partial(comp, index);
+
+	if (!slab->used) {
+		/* Only a release of memory, a failure leaves the free slab backed */
+		comp->inner.ops->discard(&comp->inner, comp->slab_base + ((unsigned long long)index << SLAB_SHIFT),
+				SLAB_SIZE);
+		++comp->slabs_released;
+		unlink_partial(comp, index);
+		free(slab->map);
+		slab->map = NULL;
+		slab->class = NONE;
+		slab->next = comp->free_slabs;
+		comp->free_slabs = index;
+	}
+	pthread_mutex_unlock(&comp->alloc_lock);
+
+out:
+	page->size = 0;
+}
+
+/* Compress and store a batch of pages */
+static int write_batch(struct comp_thread *thread, const void *buf, unsigned long long first, unsigned int nr)
+{
+	struct comp_backend *comp = thread->comp;
+	struct backend *inner = &comp->inner;
+	struct comp_page stored[BATCH_PAGES];
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < nr; ++i) {
+		const void *src = buf + i * comp->page_size;
+		void *dst = thread->staging + i * comp->page_size;
+		unsigned long long start = now_ns();
+		size_t size = comp->codec->compress(src, comp->page_size, dst, comp->page_size);
+		long long slot;
+
+		thread->stats.compress_ns += now_ns() - start;
+		thread->stats.in_bytes += comp->page_size;
+		++thread->stats.pages;
+
+		/* Not worth decompressing if it doesn't save a class */
+		if (!size || class_of(size) == class_of(comp->page_size)) {
+			size = comp->page_size;
+			memcpy(dst, src, size);
+			++thread->stats.raw_pages;
+		}
+		slot = alloc_slot(comp, class_of(size));
+		if (slot < 0) {
+			if (size != comp->page_size)
+				memcpy(dst, src, comp->page_size);
+			size = comp->page_size;
+			slot = (first + i) * comp->page_size;
+			++thread->stats.home_pages;
+		}
+		thread->stats.out_bytes += size;
+
+		stored[i].offset = slot;
+		stored[i].size = size;
+
+		err = inner->ops->write(inner, thread->slot, dst, slot, size);
+		if (err) {
+			free_slot(comp, &stored[i]);
+			break;
+		}
+	}
+
+	if (i) {
+		int wait_err = inner->ops->wait(inner, thread->slot);
+
+		if (!err)
+			err = wait_err;
+	}
+
+	/* Switch the pages over only if all of them were stored */
+	while (i-- > 0) {
+		struct comp_page *page = &comp->pages[first + i];
+
+		if (err) {
+			free_slot(comp, &stored[i]);
+		} else {
+			free_slot(comp, page);
+			*page = stored[i];
+		}
+	}
+
+	return err;
+}
+
+/* Load and decompress a batch of pages */
+static int read_batch(struct comp_thread *thread, void *buf, unsigned long long first, unsigned int nr)
+{
+	struct comp_backend *comp = thread->comp;
+	struct backend *inner = &comp->inner;
+	struct comp_page loaded[BATCH_PAGES];
+	unsigned int i, issued = 0;
+	int err = 0;
+
+	for (i = 0; i < nr; ++i) {
+		loaded[i] = comp->pages[first + i];
+		if (!loaded[i].size)
+			continue;
+
+		err = inner->ops->read(inner, thread->slot, thread->staging + i * comp->page_size,
+				loaded[i].offset, loaded[i].size);
+		if (err)
+			break;
+		++issued;
+	}
+
+	if (issued) {
+		int wait_err = inner->ops->wait(inner, thread->slot);
+
+		if (i == nr)
+			err = wait_err;
+	}
+
+	if (i != nr || err)
+		return err;
+
+	for (i = 0; i < nr; ++i) {
+		void *src = thread->staging + i * comp->page_size;
+		void *dst = buf + i * comp->page_size;
+		unsigned long long start;
+
+		if (!loaded[i].size) {
+			memset(dst, 0, comp->page_size);
+		} else if (loaded[i].size == comp->page_size) {
+			memcpy(dst, src, comp->page_size);
+		} else {
+			start = now_ns();
+			if (comp->codec->decompress(src, loaded[i].size, dst, comp->page_size)) {
+				pr_err("Decompressing page %llu failed\n", first + i);
+				return -EIO;
+			}
+			thread->stats.decompress_ns += now_ns() - start;
+			++thread->stats.decompressed_pages;
+		}
+	}
+
+	return 0;
+}
+
+static int run_job(struct comp_thread *thread, struct comp_job *job)
+{
+	struct comp_backend *comp = thread->comp;
+	unsigned long long first = job->offset / comp->page_size;
+	unsigned int pages = job->len / comp->page_size;
+	unsigned int i, nr;
+	int err = 0;
+
+	for (i = 0; i < pages && !err; i += nr) {
+		nr = pages - i < BATCH_PAGES ? pages - i : BATCH_PAGES;
+
+		if (job->write)
+			err = write_batch(thread, job->buf + i * comp->page_size, first + i, nr);
+		else
+			err = read_batch(thread, job->buf + i * comp->page_size, first + i, nr);
+	}
+
+	return err;
+}
+
+static void *comp_thread(void *arg)
+{
+	struct comp_thread *thread = arg;
+	struct comp_backend *comp = thread->comp;
+	struct backend *inner = &comp->inner;
+
+	if (inner->ops->attach && inner->ops->attach(inner))
+		exit(EXIT_FAILURE);
+
+	while (1) {
+		struct comp_job *job;
+		struct comp_slot *slot;
+		int err;
+
+		pthread_mutex_lock(&comp->lock);
+		while (!comp->first_job)
+			pthread_cond_wait(&comp->work_cond, &comp->lock);
+		job = comp->first_job;
+		comp->first_job = job->next;
+		if (!comp->first_job)
+			comp->last_job = NULL;
+		pthread_mutex_unlock(&comp->lock);
+
+		err = run_job(thread, job);
+
+		pthread_mutex_lock(&comp->lock);
+		slot = &comp->slots[job->slot];
+		if (err && !slot->err)
+			slot->err = err;
+		--comp->pending;
+		/* query() reads pending without the lock, make the error visible first */
+		__sync_synchronize();
+		--slot->pending;
+		pthread_cond_broadcast(&comp->done_cond);
+		pthread_mutex_unlock(&comp->lock);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+static int comp_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct comp_backend *comp;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	const char *threads;
+
+	if (!spec) {
+		pr_err("The comp backend needs a codec and an inner backend, comp:codec[/threads]:backend[:arg]\n");
+		return -1;
+	}
+
+	comp = calloc(1, sizeof(*comp));
+	if (!comp)
+		return -1;
+
+	threads = memchr(arg, '/', spec - arg);
+	comp->codec = find_codec(arg, (threads ? threads : spec) - arg);
+	if (!comp->codec) {
+		pr_err("Unknown codec '%.*s'\n", (int)((threads ? threads : spec) - arg), arg);
+		goto err_free;
+	}
+
+	comp->nr_threads = threads ? atoi(threads + 1) : DEFAULT_THREADS;
+	if (comp->nr_threads == 0) {
+		pr_err("Invalid number of compression threads\n");
+		goto err_free;
+	}
+
+	comp->page_size = sysconf(_SC_PAGESIZE);
+	comp->nr_classes = class_of(comp->page_size) + 1;
+	comp->classes = malloc(comp->nr_classes * sizeof(*comp->classes));
+	comp->slots = calloc(slots, sizeof(*comp->slots));
+	comp->threads = calloc(comp->nr_threads, sizeof(*comp->threads));
+	if (!comp->classes || !comp->slots || !comp->threads)
+		goto err_free;
+	comp->nr_slots = slots;
+	memset(comp->classes, 0xff, comp->nr_classes * sizeof(*comp->classes));
+
+	pthread_mutex_init(&comp->alloc_lock, NULL);
+	pthread_mutex_init(&comp->lock, NULL);
+	pthread_cond_init(&comp->work_cond, NULL);
+	pthread_cond_init(&comp->done_cond, NULL);
+
+	/* An inner slot per thread */
+	if (setup_backend(&comp->inner, spec + 1, comp->nr_threads))
+		goto err_free;
+
+	backend->priv = comp;
+
+	return 0;
+
+err_free:
+	free(comp->threads);
+	free(comp->slots);
+	free(comp->classes);
+	free(comp);
+
+	return -1;
+}
+
+/*
+ * The inner backend gets the home slots of all the pages followed by as much
+ * again for the slabs, the backends only back the parts that are used.
+ */
+static int comp_alloc(struct backend *backend, unsigned long long size)
+{
+	unsigned int i;
+	struct comp_backend *comp = backend->priv;
+	struct backend *inner = &comp->inner;
+
+	comp->nr_pages = size / comp->page_size;
+	comp->pages = calloc(comp->nr_pages, sizeof(*comp->pages));
+	if (!comp->pages) {
+		pr_err("Allocating the page table failed\n");
+		return -1;
+	}
+
+	comp->slab_base = (size + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+	comp->nr_slabs = comp->slab_base >> SLAB_SHIFT;
+	comp->free_slabs = NONE;
+	comp->slabs = calloc(comp->nr_slabs, sizeof(*comp->slabs));
+	if (!comp->slabs) {
+		pr_err("Allocating the slab table failed\n");
+		return -1;
+	}
+
+	comp->size = comp->slab_base * 2;
+	if (inner->ops->alloc(inner, comp->size))
+		return -1;
+
+	for (i = 0; i < comp->nr_threads; ++i) {
+		struct comp_thread *thread = &comp->threads[i];
+		int err;
+
+		thread->comp = comp;
+		thread->slot = i;
+		thread->staging = inner->ops->alloc_buffer(inner, BATCH_PAGES * comp->page_size);
+		if (!thread->staging) {
+			pr_err("Allocating the staging buffer of compression thread %u failed\n", i);
+			return -1;
+		}
+
+		err = pthread_create(&thread->thread, NULL, comp_thread, thread);
+		if (err) {
+			pr_err("Creating compression thread %u failed (%s)\n", i, strerror(err));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *comp_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct comp_backend *comp = backend->priv;
+
+	return comp->inner.ops->alloc_buffer(&comp->inner, size);
+}
+
+static int queue_job(struct comp_backend *comp, int write, unsigned int slot, void *buf,
+		unsigned long long offset, size_t len)
+{
+	struct comp_job *job = malloc(sizeof(*job));
+
+	if (!job)
+		return -ENOMEM;
+
+	job->next = NULL;
+	job->write = write;
+	job->slot = slot;
+	job->buf = buf;
+	job->offset = offset;
+	job->len = len;
+
+	pthread_mutex_lock(&comp->lock);
+	++comp->slots[slot].pending;
+	++comp->pending;
+
+	if (comp->last_job)
+		comp->last_job->next = job;
+	else
+		comp->first_job = job;
+	comp->last_job = job;
+
+	pthread_cond_signal(&comp->work_cond);
+	pthread_mutex_unlock(&comp->lock);
+
+	return 0;
+}
+
+static int comp_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	return queue_job(backend->priv, 0, slot, buf, offset, len);
+}
+
+static int comp_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	return queue_job(backend->priv, 1, slot, (void *)buf, offset, len);
+}
+
+static int comp_query(struct backend *backend, unsigned int slot)
+{
+	struct comp_backend *comp = backend->priv;
+	struct comp_slot *s = &comp->slots[slot];
+	int err;
+
+	if (ACCESS_ONCE(s->pending))
+		return -EAGAIN;
+
+	/* Read the error only after pending, no job of the slot can set it anymore */
+	__sync_synchronize();
+
+	/* Report the error once, for all the transfers issued on the slot since it was last done */
+	err = s->err;
+	s->err = 0;
+
+	return err;
+}
+
+static int comp_wait(struct backend *backend, unsigned int slot)
+{
+	int err;
+	struct comp_backend *comp = backend->priv;
+
+	pthread_mutex_lock(&comp->lock);
+	while (comp->slots[slot].pending)
+		pthread_cond_wait(&comp->done_cond, &comp->lock);
+	err = comp->slots[slot].err;
+	comp->slots[slot].err = 0;
+	pthread_mutex_unlock(&comp->lock);
+
+	return err;
+}
+
+/* Zeroed pages are not stored at all */
+static int comp_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct comp_backend *comp = backend->priv;
+	unsigned long long page = offset / comp->page_size;
+	unsigned long long end = (offset + len) / comp->page_size;
+
+	for (; page < end; ++page)
+		free_slot(comp, &comp->pages[page]);
+
+	return 0;
+}
+
+/* Also release the home slots of the range, the slab slots are released with their slabs */
+static int comp_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct comp_backend *comp = backend->priv;
+	struct backend *inner = &comp->inner;
+
+	comp_zero(backend, offset, len);
+
+	return inner->ops->discard(inner, offset, len);
+}
+
+static int comp_sync(struct backend *backend)
+{
+	struct comp_backend *comp = backend->priv;
+
+	pthread_mutex_lock(&comp->lock);
+	while (comp->pending)
+		pthread_cond_wait(&comp->done_cond, &comp->lock);
+	pthread_mutex_unlock(&comp->lock);
+
+	return 0;
+}
+
+static int comp_flush(struct backend *backend)
+{
+	struct comp_backend *comp = backend->priv;
+	struct backend *inner = &comp->inner;
+
+	return inner->ops->flush ? inner->ops->flush(inner) : 0;
+}
+
+static void comp_stats(struct backend *backend)
+{
+	unsigned int i;
+	struct comp_backend *comp = backend->priv;
+	struct comp_stats total;
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < comp->nr_threads; ++i) {
+		struct comp_stats *stats = &comp->threads[i].stats;
+
+		total.pages += stats->pages;
+		total.raw_pages += stats->raw_pages;
+		total.in_bytes += stats->in_bytes;
+		total.out_bytes += stats->out_bytes;
+		total.compress_ns += stats->compress_ns;
+		total.decompressed_pages += stats->decompressed_pages;
+		total.decompress_ns += stats->decompress_ns;
+		total.home_pages += stats->home_pages;
+	}
+
+	pr_info("comp %s: %llu pages written, %llu raw, %llu in home slots, %llu slabs released, ratio %.2f, "
+			"compress %.1f MB/s, decompress %.1f MB/s\n",
+			comp->codec->name, total.pages, total.raw_pages, total.home_pages, comp->slabs_released,
+			total.out_bytes ? (double)total.in_bytes / total.out_bytes : 0.0,
+			total.compress_ns ? total.in_bytes * 1000.0 / total.compress_ns : 0.0,
+			total.decompress_ns ?
+				total.decompressed_pages * comp->page_size * 1000.0 / total.decompress_ns : 0.0);
+
+	if (comp->inner.ops->stats)
+		comp->inner.ops->stats(&comp->inner);
+}
+
+/* The ratio and throughputs are left to the queries, e.g. in_bytes / out_bytes */
+static void comp_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	unsigned int i;
+	struct comp_backend *comp = backend->priv;
+	struct comp_stats total;
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < comp->nr_threads; ++i) {
+		struct comp_stats *stats = &comp->threads[i].stats;
+
+		total.pages += stats->pages;
+		total.raw_pages += stats->raw_pages;
+		total.in_bytes += stats->in_bytes;
+		total.out_bytes += stats->out_bytes;
+		total.compress_ns += stats->compress_ns;
+		total.decompressed_pages += stats->decompressed_pages;
+		total.decompress_ns += stats->decompress_ns;
+		total.home_pages += stats->home_pages;
+	}
+
+	print_metric(out, "comp_pages_total", id, total.pages);
+	print_metric(out, "comp_raw_pages_total", id, total.raw_pages);
+	print_metric(out, "comp_home_pages_total", id, total.home_pages);
+	print_metric(out, "comp_slabs_released_total", id, comp->slabs_released);
+	print_metric(out, "comp_in_bytes_total", id, total.in_bytes);
+	print_metric(out, "comp_out_bytes_total", id, total.out_bytes);
+	print_metric(out, "comp_compress_nanoseconds_total", id, total.compress_ns);
+	print_metric(out, "comp_decompressed_pages_total", id, total.decompressed_pages);
+	print_metric(out, "comp_decompress_nanoseconds_total", id, total.decompress_ns);
+
+	inner_metrics(&comp->inner, out, id, 0);
+}
+
+const struct backend_ops comp_backend_ops = {
+	.name = "comp",
+	.init = comp_init,
+	.alloc = comp_alloc,
+	.alloc_buffer = comp_alloc_buffer,
+	.read = comp_read,
+	.write = comp_write,
+	.query = comp_query,
+	.wait = comp_wait,
+	.zero = comp_zero,
+	.discard = comp_discard,
+	.sync = comp_sync,
+	.flush = comp_flush,
+	.stats = comp_stats,
+	.metrics = comp_metrics,
+};
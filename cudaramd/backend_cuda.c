@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * CUDA backend.
+ *
+ * The device memory is allocated lazily in chunks on the first write to
+ * them and freed again when they are discarded as a whole. Reads from chunks
+ * that are not allocated are answered with zeros without a transfer.
+ *
+ * Each backend has its own context, several of them can be used from a single
+ * thread, e.g. for striping over devices, as every operation makes the context
+ * of its backend current first.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <cuda.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define CHUNK_SHIFT 21
+#define CHUNK_SIZE (1ULL << CHUNK_SHIFT)
+
+struct cuda_backend {
+	CUcontext context;
+	CUdeviceptr *chunks; /* 0 if not allocated yet */
+	unsigned long long nr_chunks;
+	pthread_mutex_t lock; /* protect chunk allocation */
+	CUstream *streams; /* a stream per slot */
+};
+
+static int cuda_result(CUresult res)
+{
+	switch (res) {
+	case CUDA_SUCCESS:
+		return 0;
+	case CUDA_ERROR_NOT_READY:
+		return -EAGAIN;
+	default:
+		return -EIO;
+	}
+}
+
+/* Make the backend's context current in the calling thread */
+static int cuda_enter(struct cuda_backend *cuda)
+{
+	return cuda_result(cuCtxSetCurrent(cuda->context));
+}
+
+static int cuda_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	int i;
+	int device_count, device_id = 0;
+	CUdevice device;
+	struct cuda_backend *cuda;
+
+	cuda = calloc(1, sizeof(*cuda));
+	if (!cuda)
+		return -1;
+
+	pthread_mutex_init(&cuda->lock, NULL);
+
+	if (arg)
+		device_id = atoi(arg);
+
+	cuInit(0);
+	cuDeviceGetCount(&device_count);
+	if (device_count == 0) {
+		pr_err("There is no device supporting CUDA.\n");
+		goto err_free;
+	}
+
+	if (device_id < 0 || device_id >= device_count) {
+		pr_err("Invalid CUDA device %d\n", device_id);
+		goto err_free;
+	}
+
+	cuDeviceGet(&device, device_id);
+
+	if (cuCtxCreate(&cuda->context, CU_CTX_MAP_HOST, device) != CUDA_SUCCESS) {
+		pr_err("Failed to created the cuda context\n");
+		goto err_free;
+	}
+
+	cuda->streams = calloc(slots, sizeof(*cuda->streams));
+	if (!cuda->streams)
+		goto err_free;
+
+	for (i = 0; i < slots; ++i) {
+		if (cuStreamCreate(&cuda->streams[i], 0) != CUDA_SUCCESS) {
+			pr_err("Creating cuda stream %d failed\n", i);
+			goto err_free_streams;
+		}
+	}
+
+	backend->priv = cuda;
+
+	return 0;
+
+err_free_streams:
+	while (i-- > 0)
+		cuStreamDestroy(cuda->streams[i]);
+	free(cuda->streams);
+err_free:
+	free(cuda);
+
+	return -1;
+}
+
+static int cuda_attach(struct backend *backend)
+{
+	return cuda_enter(backend->priv);
+}
+
+/* Only the chunk table is allocated up front */
+static int cuda_alloc(struct backend *backend, unsigned long long size)
+{
+	struct cuda_backend *cuda = backend->priv;
+
+	cuda->nr_chunks = (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+	cuda->chunks = calloc(cuda->nr_chunks, sizeof(*cuda->chunks));
+	if (!cuda->chunks) {
+		pr_err("Allocating the chunk table failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the device memory of a chunk, 0 if it's not allocated.
+ *
+ * With alloc the chunk is allocated and zeroed first if needed. The memset is
+ * issued on the NULL stream, which the slot streams implicitly wait for, so
+ * any transfer issued after getting the chunk sees it zeroed.
+ */
+static CUdeviceptr cuda_chunk(struct cuda_backend *cuda, unsigned long long index, int alloc)
+{
+	CUdeviceptr chunk = ACCESS_ONCE(cuda->chunks[index]);
+
+	if (chunk || !alloc)
+		return chunk;
+
+	pthread_mutex_lock(&cuda->lock);
+	chunk = cuda->chunks[index];
+	if (!chunk) {
+		if (cuMemAlloc(&chunk, CHUNK_SIZE) != CUDA_SUCCESS) {
+			pr_err("Allocating cuda chunk %llu failed\n", index);
+			chunk = 0;
+		} else if (cuMemsetD32(chunk, 0, CHUNK_SIZE >> 2) != CUDA_SUCCESS) {
+			pr_err("Zeroing cuda chunk %llu failed\n", index);
+			cuMemFree(chunk);
+			chunk = 0;
+		} else {
+			/* Make the chunk visible only once it's zeroed */
+			__sync_synchronize();
+			cuda->chunks[index] = chunk;
+		}
+	}
+	pthread_mutex_unlock(&cuda->lock);
+
+	return chunk;
+}
+
+/* Length of the part of a range that fits in the chunk of its offset */
+static size_t chunk_len(unsigned long long offset, size_t len)
+{
+	size_t left = CHUNK_SIZE - (offset & (CHUNK_SIZE - 1));
+
+	return len < left ? len : left;
+}
+
+/* Portable so that the buffer is pinned for the contexts of all the backends */
+static void *cuda_alloc_buffer(struct backend *backend, size_t size)
+{
+	void *buf;
+
+	if (cuda_enter(backend->priv) || cuMemHostAlloc(&buf, size, CU_MEMHOSTALLOC_PORTABLE) != CUDA_SUCCESS)
+		return NULL;
+
+	return buf;
+}
+
+static int cuda_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	int err;
+	struct cuda_backend *cuda = backend->priv;
+
+	err = cuda_enter(cuda);
+	if (err)
+		return err;
+
+	while (len) {
+		size_t part = chunk_len(offset, len);
+		CUdeviceptr chunk = cuda_chunk(cuda, offset >> CHUNK_SHIFT, 0);
+
+		if (!chunk) {
+			memset(buf, 0, part);
+		} else {
+			err = cuda_result(cuMemcpyDtoHAsync(buf, chunk + (offset & (CHUNK_SIZE - 1)), part,
+						cuda->streams[slot]));
+			if (err)
+				return err;
+		}
+
+		buf += part;
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+static int cuda_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	int err;
+	struct cuda_backend *cuda = backend->priv;
+
+	err = cuda_enter(cuda);
+	if (err)
+		return err;
+
+	while (len) {
+		size_t part = chunk_len(offset, len);
+		CUdeviceptr chunk = cuda_chunk(cuda, offset >> CHUNK_SHIFT, 1);
+
+		if (!chunk)
+			return -ENOMEM;
+
+		err = cuda_result(cuMemcpyHtoDAsync(chunk + (offset & (CHUNK_SIZE - 1)), buf, part,
+					cuda->streams[slot]));
+		if (err)
+			return err;
+
+		buf += part;
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+static int cuda_query(struct backend *backend, unsigned int slot)
+{
+	struct cuda_backend *cuda = backend->priv;
+
+	if (cuda_enter(cuda))
+		return -EIO;
+
+	return cuda_result(cuStreamQuery(cuda->streams[slot]));
+}
+
+static int cuda_wait(struct backend *backend, unsigned int slot)
+{
+	struct cuda_backend *cuda = backend->priv;
+
+	if (cuda_enter(cuda))
+		return -EIO;
+
+	return cuda_result(cuStreamSynchronize(cuda->streams[slot]));
+}
+
+/* Chunks that were never written are already zero */
+static int cuda_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	int err;
+	struct cuda_backend *cuda = backend->priv;
+
+	err = cuda_enter(cuda);
+	if (err)
+		return err;
+
+	while (len) {
+		size_t part = chunk_len(offset, len);
+		CUdeviceptr chunk = cuda_chunk(cuda, offset >> CHUNK_SHIFT, 0);
+
+		if (chunk) {
+			err = cuda_result(cuMemsetD32(chunk + (offset & (CHUNK_SIZE - 1)), 0, part >> 2));
+			if (err)
+				return err;
+		}
+
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+/* Free the chunks fully covered by the range, zero the rest */
+static int cuda_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	int err;
+	struct cuda_backend *cuda = backend->priv;
+
+	err = cuda_enter(cuda);
+	if (err)
+		return err;
+
+	while (len) {
+		size_t part = chunk_len(offset, len);
+		unsigned long long index = offset >> CHUNK_SHIFT;
+
+		if (part == CHUNK_SIZE) {
+			CUdeviceptr chunk;
+
+			pthread_mutex_lock(&cuda->lock);
+			chunk = cuda->chunks[index];
+			cuda->chunks[index] = 0;
+			pthread_mutex_unlock(&cuda->lock);
+
+			if (chunk)
+				cuMemFree(chunk);
+		} else {
+			err = cuda_zero(backend, offset, part);
+			if (err)
+				return err;
+		}
+
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+static int cuda_sync(struct backend *backend)
+{
+	if (cuda_enter(backend->priv))
+		return -EIO;
+
+	return cuda_result(cuCtxSynchronize());
+}
+
+const struct backend_ops cuda_backend_ops = {
+	.name = "cuda",
+	.init = cuda_init,
+	.attach = cuda_attach,
+	.alloc = cuda_alloc,
+	.alloc_buffer = cuda_alloc_buffer,
+	.read = cuda_read,
+	.write = cuda_write,
+	.query = cuda_query,
+	.wait = cuda_wait,
+	.zero = cuda_zero,
+	.discard = cuda_discard,
+	.sync = cuda_sync,
+};
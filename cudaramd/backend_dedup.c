@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Deduplicating backend.
+ *
+ * The spec is dedup:backend[:arg], e.g. dedup:cuda:0. Each written page is
+ * hashed with a 128-bit hash and if a stored page with the same hash has the
+ * same contents, the page is mapped to it instead of being stored again. The
+ * stored pages are reference counted and packed from the start of the inner
+ * backend, so with a lazily allocated inner backend the memory used follows
+ * the number of unique pages.
+ *
+ * The written pages are only mapped to their stored pages, and the new stored
+ * pages added to the hash table, once the transfers on the slot are known to
+ * be done, so that comparing with a stored page never reads stale data and a
+ * failed write leaves the old contents mapped.
+ *
+ * A hash hit is verified by reading the stored page back, synchronously on the
+ * calling thread, so each hit costs a round trip to the inner backend that
+ * also waits for the transfers already issued on the slot. Writes of mostly
+ * duplicate pages are bound by that latency rather than the bandwidth.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define NONE (~0U)
+
+/* A page stored in the inner backend */
+struct dedup_phys {
+	uint64_t hash[2];
+	unsigned int refs; /* number of pages mapped to it, 0 if free */
+	unsigned int next; /* next page in the hash bucket, NONE if last */
+	int hashed; /* in the hash table */
+};
+
+/* A page written on a slot, holding a reference to its stored page */
+struct dedup_pending {
+	unsigned int page;
+	unsigned int phys;
+	int new; /* stored by the write, hashed once it's done */
+};
+
+/* Pages written on a slot that are mapped once the slot is done */
+struct dedup_slot {
+	struct dedup_pending *pending;
+	unsigned int nr_pending;
+	unsigned int max_pending;
+	void *scratch; /* a page for comparing with stored pages */
+};
+
+struct dedup_backend {
+	struct backend inner;
+	unsigned long page_size;
+
+	unsigned int *map; /* stored page of each page, NONE if not stored */
+	unsigned int nr_pages;
+
+	pthread_mutex_t lock; /* protect the stored pages and the hash table */
+	struct dedup_phys *phys;
+	unsigned int nr_phys;
+	unsigned int next_phys; /* first never used stored page */
+	unsigned int *free_phys; /* stack of freed stored pages */
+	unsigned int nr_free_phys;
+	unsigned int *buckets;
+	unsigned int bucket_mask;
+
+	struct dedup_slot *slots;
+	unsigned int nr_slots;
+
+	/* Counters, updated with the lock held */
+	unsigned long long hits; /* pages found already stored */
+	unsigned long long collisions; /* same hash, different contents */
+	unsigned int mapped; /* pages mapped to a stored page */
+	unsigned int unique; /* stored pages in use */
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/* MurmurHash3 x64 128-bit of a page, size is a multiple of 16 bytes */
+static void hash_page(const void *page, size_t size, uint64_t hash[2])
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	const uint64_t *p = page, *end = page + size;
+	uint64_t h1 = 0, h2 = 0;
+
+	for (; p < end; p += 2) {
+		uint64_t k1 = p[0], k2 = p[1];
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	h1 ^= size;
+	h2 ^= size;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	hash[0] = h1;
+	hash[1] = h2;
+}
+
+static unsigned int *bucket_of(struct dedup_backend *dedup, const uint64_t hash[2])
+{
+	return &dedup->buckets[hash[0] & dedup->bucket_mask];
+}
+
+/* Find a stored page with the hash and take a reference, must be called with the lock held */
+static unsigned int lookup(struct dedup_backend *dedup, const uint64_t hash[2])
+{
+	unsigned int phys;
+
+	for (phys = *bucket_of(dedup, hash); phys != NONE; phys = dedup->phys[phys].next) {
+		if (dedup->phys[phys].hash[0] == hash[0] && dedup->phys[phys].hash[1] == hash[1]) {
+			++dedup->phys[phys].refs;
+			return phys;
+		}
+	}
+
+	return NONE;
+}
+
+/* Get a free stored page with a single reference, must be called with the lock held */
+static unsigned int alloc_phys(struct dedup_backend *dedup, const uint64_t hash[2])
+{
+	unsigned int phys;
+
+	if (dedup->nr_free_phys)
+		phys = dedup->free_phys[--dedup->nr_free_phys];
+	else if (dedup->next_phys < dedup->nr_phys)
+		phys = dedup->next_phys++;
+	else
+		return NONE;
+
+	dedup->phys[phys].hash[0] = hash[0];
+	dedup->phys[phys].hash[1] = hash[1];
+	dedup->phys[phys].refs = 1;
+	dedup->phys[phys].hashed = 0;
+	++dedup->unique;
+
+	return phys;
+}
+
+/* Drop a reference to a stored page, must be called with the lock held */
+static void put_phys(struct dedup_backend *dedup, unsigned int phys)
+{
+	struct dedup_phys *p = &dedup->phys[phys];
+	unsigned int *link;
+
+	if (--p->refs)
+		return;
+
+	if (p->hashed) {
+		for (link = bucket_of(dedup, p->hash); *link != phys; link = &dedup->phys[*link].next)
+			;
+		*link = p->next;
+		p->hashed = 0;
+	}
+
+	dedup->free_phys[dedup->nr_free_phys++] = phys;
+	--dedup->unique;
+}
+
+/* Map a page to a stored page, dropping the reference to the old one */
+static void map_page(struct dedup_backend *dedup, unsigned int page, unsigned int phys)
+{
+	unsigned int old = dedup->map[page];
+
+	if (old != NONE) {
+		put_phys(dedup, old);
+		--dedup->mapped;
+	}
+	if (phys != NONE)
+		++dedup->mapped;
+
+	dedup->map[page] = phys;
+}
+
+/* Add a new stored page to the hash table, must be called with the lock held */
+static void hash_phys(struct dedup_backend *dedup, unsigned int phys)
+{
+	struct dedup_phys *p = &dedup->phys[phys];
+	unsigned int *bucket = bucket_of(dedup, p->hash);
+
+	p->next = *bucket;
+	p->hashed = 1;
+	*bucket = phys;
+}
+
+/*
+ * Map the pages written on a finished slot to their stored pages, dropping
+ * the old ones, or if it failed keep the old mappings and drop the new ones.
+ */
+static void map_pending(struct dedup_backend *dedup, struct dedup_slot *slot, int err)
+{
+	unsigned int i;
+
+	if (!slot->nr_pending)
+		return;
+
+	pthread_mutex_lock(&dedup->lock);
+	for (i = 0; i < slot->nr_pending; ++i) {
+		struct dedup_pending *pending = &slot->pending[i];
+
+		if (err) {
+			put_phys(dedup, pending->phys);
+			continue;
+		}
+
+		if (pending->new)
+			hash_phys(dedup, pending->phys);
+		map_page(dedup, pending->page, pending->phys);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+
+	slot->nr_pending = 0;
+}
+
+static int add_pending(struct dedup_slot *slot, unsigned int page, unsigned int phys, int new)
+{
+	if (slot->nr_pending == slot->max_pending) {
+		unsigned int max_pending = slot->max_pending ? slot->max_pending * 2 : 64;
+		struct dedup_pending *pending = realloc(slot->pending, max_pending * sizeof(*pending));
+
+		if (!pending)
+			return -ENOMEM;
+
+		slot->pending = pending;
+		slot->max_pending = max_pending;
+	}
+	slot->pending[slot->nr_pending].page = page;
+	slot->pending[slot->nr_pending].phys = phys;
+	slot->pending[slot->nr_pending].new = new;
+	++slot->nr_pending;
+
+	return 0;
+}
+
+/* Report the slot done once the inner backend is, mapping its written pages */
+static int finish_slot(struct dedup_backend *dedup, unsigned int slot, int wait)
+{
+	struct backend *inner = &dedup->inner;
+	int err = wait ? inner->ops->wait(inner, slot) : inner->ops->query(inner, slot);
+
+	if (err != -EAGAIN)
+		map_pending(dedup, &dedup->slots[slot], err);
+
+	return err;
+}
+
+static int dedup_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct dedup_backend *dedup;
+
+	if (!arg) {
+		pr_err("The dedup backend needs an inner backend, dedup:backend[:arg]\n");
+		return -1;
+	}
+
+	dedup = calloc(1, sizeof(*dedup));
+	if (!dedup)
+		return -1;
+
+	dedup->page_size = sysconf(_SC_PAGESIZE);
+	dedup->nr_slots = slots;
+	dedup->slots = calloc(slots, sizeof(*dedup->slots));
+	if (!dedup->slots)
+		goto err_free;
+
+	pthread_mutex_init(&dedup->lock, NULL);
+
+	if (setup_backend(&dedup->inner, arg, slots))
+		goto err_free_slots;
+
+	backend->priv = dedup;
+
+	return 0;
+
+err_free_slots:
+	free(dedup->slots);
+err_free:
+	free(dedup);
+
+	return -1;
+}
+
+/*
+ * A stored page is only freed after its replacement is, leave some room for
+ * the pages being overwritten.
+ */
+static int dedup_alloc(struct backend *backend, unsigned long long size)
+{
+	unsigned int i, buckets = 1;
+	struct dedup_backend *dedup = backend->priv;
+	struct backend *inner = &dedup->inner;
+
+	if (size / dedup->page_size >= NONE / 2) {
+		pr_err("The dedup backend supports up to %u pages\n", NONE / 2);
+		return -1;
+	}
+
+	dedup->nr_pages = size / dedup->page_size;
+	dedup->nr_phys = dedup->nr_pages + dedup->nr_pages / 8 + 1;
+	while (buckets < dedup->nr_phys)
+		buckets <<= 1;
+	dedup->bucket_mask = buckets - 1;
+
+	dedup->map = malloc(dedup->nr_pages * sizeof(*dedup->map));
+	dedup->phys = calloc(dedup->nr_phys, sizeof(*dedup->phys));
+	dedup->free_phys = malloc(dedup->nr_phys * sizeof(*dedup->free_phys));
+	dedup->buckets = malloc(buckets * sizeof(*dedup->buckets));
+	if (!dedup->map || !dedup->phys || !dedup->free_phys || !dedup->buckets) {
+		pr_err("Allocating the dedup tables failed\n");
+		return -1;
+	}
+	memset(dedup->map, 0xff, dedup->nr_pages * sizeof(*dedup->map));
+	memset(dedup->buckets, 0xff, buckets * sizeof(*dedup->buckets));
+
+	if (inner->ops->alloc(inner, (unsigned long long)dedup->nr_phys * dedup->page_size))
+		return -1;
+
+	for (i = 0; i < dedup->nr_slots; ++i) {
+		dedup->slots[i].scratch = inner->ops->alloc_buffer(inner, dedup->page_size);
+		if (!dedup->slots[i].scratch) {
+			pr_err("Allocating the dedup scratch pages failed\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int dedup_attach(struct backend *backend)
+{
+	struct dedup_backend *dedup = backend->priv;
+	struct backend *inner = &dedup->inner;
+
+	return inner->ops->attach ? inner->ops->attach(inner) : 0;
+}
+
+static void *dedup_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct dedup_backend *dedup = backend->priv;
+
+	return dedup->inner.ops->alloc_buffer(&dedup->inner, size);
+}
+
+/* Read pages into buf, a transfer for each run of pages stored one after another */
+static int dedup_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	int err;
+	struct dedup_backend *dedup = backend->priv;
+	struct backend *inner = &dedup->inner;
+	unsigned int page = offset / dedup->page_size;
+	unsigned int pages = len / dedup->page_size;
+	unsigned int i, start;
+
+	for (i = 0, start = 0; i <= pages; ++i) {
+		unsigned int phys = i < pages ? ACCESS_ONCE(dedup->map[page + i]) : NONE;
+
+		if (i > start && (phys == NONE || phys != dedup->map[page + i - 1] + 1)) {
+			err = inner->ops->read(inner, slot, buf + start * dedup->page_size,
+					(unsigned long long)dedup->map[page + start] * dedup->page_size,
+					(i - start) * dedup->page_size);
+			if (err)
+				return err;
+			start = i;
+		}
+
+		if (i < pages && phys == NONE) {
+			memset(buf + i * dedup->page_size, 0, dedup->page_size);
+			start = i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a stored page has the same contents, 1 if so, 0 if not or a
+ * negative errno. Waits for all the transfers on the slot.
+ */
+static int same_contents(struct dedup_backend *dedup, unsigned int slot, const void *page, unsigned int phys)
+{
+	struct backend *inner = &dedup->inner;
+	void *scratch = dedup->slots[slot].scratch;
+	int err;
+
+	err = inner->ops->read(inner, slot, scratch, (unsigned long long)phys * dedup->page_size, dedup->page_size);
+	if (!err)
+		err = inner->ops->wait(inner, slot);
+	if (err)
+		return err;
+
+	return !memcmp(page, scratch, dedup->page_size);
+}
+
+/*
+ * Find a stored page with the same contents or store each written page, a
+ * transfer for each run of new pages stored one after another. The pages are
+ * mapped when the slot is done.
+ */
+static int dedup_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	int err = 0;
+	struct dedup_backend *dedup = backend->priv;
+	struct backend *inner = &dedup->inner;
+	unsigned int page = offset / dedup->page_size;
+	unsigned int pages = len / dedup->page_size;
+	unsigned int i, run = 0, run_phys = NONE;
+
+	for (i = 0; i < pages; ++i) {
+		const void *data = buf + i * dedup->page_size;
+		unsigned int phys;
+		uint64_t hash[2];
+		int stored = 0;
+
+		hash_page(data, dedup->page_size, hash);
+
+		pthread_mutex_lock(&dedup->lock);
+		phys = lookup(dedup, hash);
+		pthread_mutex_unlock(&dedup->lock);
+
+		if (phys != NONE) {
+			stored = same_contents(dedup, slot, data, phys);
+
+			pthread_mutex_lock(&dedup->lock);
+			if (stored <= 0)
+				put_phys(dedup, phys);
+			if (!stored)
+				++dedup->collisions;
+			pthread_mutex_unlock(&dedup->lock);
+
+			if (stored < 0) {
+				err = stored;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&dedup->lock);
+		if (stored) {
+			++dedup->hits;
+		} else {
+			phys = alloc_phys(dedup, hash);
+			if (phys == NONE)
+				err = -ENOSPC;
+		}
+		pthread_mutex_unlock(&dedup->lock);
+
+		if (err)
+			break;
+
+		err = add_pending(&dedup->slots[slot], page + i, phys, !stored);
+		if (err) {
+			pthread_mutex_lock(&dedup->lock);
+			put_phys(dedup, phys);
+			pthread_mutex_unlock(&dedup->lock);
+			break;
+		}
+
+		/* An already stored page or a new one not following the run ends the run */
+		if (run && (stored || phys != run_phys + run)) {
+			err = inner->ops->write(inner, slot, data - run * dedup->page_size,
+					(unsigned long long)run_phys * dedup->page_size, run * dedup->page_size);
+			if (err)
+				break;
+			run = 0;
+		}
+
+		if (!stored && !run++)
+			run_phys = phys;
+	}
+
+	if (run && !err)
+		err = inner->ops->write(inner, slot, buf + (i - run) * dedup->page_size,
+				(unsigned long long)run_phys * dedup->page_size, run * dedup->page_size);
+
+	if (!err)
+		return 0;
+
+	/* The slot isn't queried after a failed transfer, wait for the ones issued and keep the old mappings */
+	inner->ops->wait(inner, slot);
+	map_pending(dedup, &dedup->slots[slot], err);
+
+	return err;
+}
+
+static int dedup_query(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 0);
+}
+
+static int dedup_wait(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 1);
+}
+
+/* Unmapped pages read as zeros, drop the stored pages */
+static int dedup_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct dedup_backend *dedup = backend->priv;
+	unsigned int page = offset / dedup->page_size;
+	unsigned int end = (offset + len) / dedup->page_size;
+
+	pthread_mutex_lock(&dedup->lock);
+	for (; page < end; ++page)
+		map_page(dedup, page, NONE);
+	pthread_mutex_unlock(&dedup->lock);
+
+	return 0;
+}
+
+static int dedup_sync(struct backend *backend)
+{
+	struct dedup_backend *dedup = backend->priv;
+
+	return dedup->inner.ops->sync(&dedup->inner);
+}
+
+static int dedup_flush(struct backend *backend)
+{
+	struct dedup_backend *dedup = backend->priv;
+	struct backend *inner = &dedup->inner;
+
+	return inner->ops->flush ? inner->ops->flush(inner) : 0;
+}
+
+static void dedup_stats(struct backend *backend)
+{
+	struct dedup_backend *dedup = backend->priv;
+
+	pr_info("dedup: %u pages mapped to %u unique pages, %llu hits, %llu hash collisions\n",
+			dedup->mapped, dedup->unique, dedup->hits, dedup->collisions);
+
+	if (dedup->inner.ops->stats)
+		dedup->inner.ops->stats(&dedup->inner);
+}
+
+static void dedup_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	struct dedup_backend *dedup = backend->priv;
+
+	print_metric(out, "dedup_mapped_pages", id, dedup->mapped);
+	print_metric(out, "dedup_unique_pages", id, dedup->unique);
+	print_metric(out, "dedup_hits_total", id, dedup->hits);
+	print_metric(out, "dedup_collisions_total", id, dedup->collisions);
+
+	inner_metrics(&dedup->inner, out, id, 0);
+}
+
+const struct backend_ops dedup_backend_ops = {
+	.name = "dedup",
+	.init = dedup_init,
+	.attach = dedup_attach,
+	.alloc = dedup_alloc,
+	.alloc_buffer = dedup_alloc_buffer,
+	.read = dedup_read,
+	.write = dedup_write,
+	.query = dedup_query,
+	.wait = dedup_wait,
+	.zero = dedup_zero,
+	.discard = dedup_zero,
+	.sync = dedup_sync,
+	.flush = dedup_flush,
+	.stats = dedup_stats,
+	.metrics = dedup_metrics,
+};
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * File backend.
+ *
+ * The spec is file:path[:force], the storage is a file at path read and
+ * written with pread() and pwrite(). Meant as the last tier of capacity
+ * behind faster backends, the page cache keeps as much of it in memory as it
+ * can. The space is reserved up front so that a full filesystem can't fail
+ * the writes later, and I/O errors fail the transfers. An existing non-empty
+ * file is only overwritten with force. The copies are done right away so the
+ * transfers are always done by the time they are queried.
+ */
+
+#define _GNU_SOURCE /* for fallocate */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/falloc.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define ZERO_SIZE (64 * 1024)
+
+struct file_backend {
+	char *path;
+	int force;
+	int fd;
+	unsigned long long size;
+};
+
+static const char zeros[ZERO_SIZE];
+
+static int file_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct file_backend *file;
+	char *force;
+
+	if (!arg || !*arg) {
+		pr_err("The file backend needs a path, file:path[:force]\n");
+		return -1;
+	}
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -1;
+
+	file->path = strdup(arg);
+	if (!file->path) {
+		free(file);
+		return -1;
+	}
+
+	force = strrchr(file->path, ':');
+	if (force && !strcmp(force, ":force")) {
+		*force = '\0';
+		file->force = 1;
+	}
+
+	file->fd = -1;
+	backend->priv = file;
+
+	return 0;
+}
+
+/* The file is truncated and reserved again, which zeroes it */
+static int file_alloc(struct backend *backend, unsigned long long size)
+{
+	struct file_backend *file = backend->priv;
+	struct stat st;
+	int err;
+
+	file->fd = open(file->path, O_RDWR | O_CREAT, 0600);
+	if (file->fd < 0) {
+		pr_err("Opening '%s' failed (%s)\n", file->path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(file->fd, &st)) {
+		pr_err("Accessing '%s' failed (%s)\n", file->path, strerror(errno));
+		goto err_close;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		pr_err("'%s' is not a regular file\n", file->path);
+		goto err_close;
+	}
+
+	if (st.st_size && !file->force) {
+		pr_err("'%s' exists and is not empty, use file:%s:force to overwrite it\n", file->path, file->path);
+		goto err_close;
+	}
+
+	file->size = size;
+	if (ftruncate(file->fd, 0)) {
+		pr_err("Truncating '%s' failed (%s)\n", file->path, strerror(errno));
+		goto err_close;
+	}
+
+	err = posix_fallocate(file->fd, 0, size);
+	if (err) {
+		pr_err("Reserving %llu bytes for '%s' failed (%s)\n", size, file->path, strerror(err));
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(file->fd);
+	file->fd = -1;
+
+	return -1;
+}
+
+static void *file_alloc_buffer(struct backend *backend, size_t size)
+{
+	void *mem;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_err("Mapping %zu bytes of host memory failed (%s)\n", size, strerror(errno));
+		return NULL;
+	}
+
+	return mem;
+}
+
+static int file_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	struct file_backend *file = backend->priv;
+
+	while (len) {
+		ssize_t done = pread(file->fd, buf, len, offset);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0) {
+			pr_err("Reading from '%s' failed (%s)\n", file->path, done ? strerror(errno) : "end of file");
+			return -EIO;
+		}
+		buf += done;
+		len -= done;
+		offset += done;
+	}
+
+	return 0;
+}
+
+static int file_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	struct file_backend *file = backend->priv;
+
+	while (len) {
+		ssize_t done = pwrite(file->fd, buf, len, offset);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0) {
+			pr_err("Writing to '%s' failed (%s)\n", file->path, strerror(errno));
+			return -EIO;
+		}
+		buf += done;
+		len -= done;
+		offset += done;
+	}
+
+	return 0;
+}
+
+static int file_query(struct backend *backend, unsigned int slot)
+{
+	return 0;
+}
+
+/* Zero the range in place, keeping its space reserved */
+static int file_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct file_backend *file = backend->priv;
+
+	if (!fallocate(file->fd, FALLOC_FL_ZERO_RANGE, offset, len))
+		return 0;
+
+	while (len) {
+		size_t part = len < ZERO_SIZE ? len : ZERO_SIZE;
+		int err = file_write(backend, 0, zeros, offset, part);
+
+		if (err)
+			return err;
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+/*
+ * Holes aren't punched, writing to them again could fail on a full
+ * filesystem. Zeroing the range in place still drops it from the page cache.
+ */
+static int file_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	return file_zero(backend, offset, len);
+}
+
+static int file_sync(struct backend *backend)
+{
+	return 0;
+}
+
+const struct backend_ops file_backend_ops = {
+	.name = "file",
+	.init = file_init,
+	.alloc = file_alloc,
+	.alloc_buffer = file_alloc_buffer,
+	.read = file_read,
+	.write = file_write,
+	.query = file_query,
+	.wait = file_query,
+	.zero = file_zero,
+	.discard = file_discard,
+	.sync = file_sync,
+};
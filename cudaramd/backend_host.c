@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Host memory backend.
+ *
+ * The spec is host[:page_size[:node]], page_size is 4K (default), 2M or 1G
+ * with the latter two using hugepages, node binds the memory to a NUMA node.
+ * The copies are done right away so the transfers are always done by the
+ * time they are queried.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/mempolicy.h>
+
+#include "backend.h"
+#include "print.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+struct host_backend {
+	void *data;
+	unsigned long long size;
+	unsigned long page_size;
+	int page_shift; /* 0 for regular pages */
+	int node; /* -1 for no binding */
+};
+
+static int parse_page_size(struct host_backend *host, const char *arg)
+{
+	if (!*arg || *arg == ':' || !strncmp(arg, "4K", 2)) {
+		host->page_size = sysconf(_SC_PAGESIZE);
+		host->page_shift = 0;
+	} else if (!strncmp(arg, "2M", 2)) {
+		host->page_size = 1UL << 21;
+		host->page_shift = 21;
+	} else if (!strncmp(arg, "1G", 2)) {
+		host->page_size = 1UL << 30;
+		host->page_shift = 30;
+	} else {
+		pr_err("Invalid host page size '%s', should be 4K, 2M or 1G\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int host_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct host_backend *host;
+	const char *node;
+
+	host = calloc(1, sizeof(*host));
+	if (!host)
+		return -1;
+
+	if (parse_page_size(host, arg ? arg : ""))
+		goto err_free;
+
+	host->node = -1;
+	node = arg ? strchr(arg, ':') : NULL;
+	if (node && node[1]) {
+		host->node = atoi(node + 1);
+		if (host->node < 0 || host->node >= sizeof(unsigned long) * 8) {
+			pr_err("Invalid NUMA node %d\n", host->node);
+			goto err_free;
+		}
+	}
+
+	backend->priv = host;
+
+	return 0;
+
+err_free:
+	free(host);
+
+	return -1;
+}
+
+/* Map memory with the backend's page size and NUMA binding */
+static void *host_map(struct host_backend *host, size_t size)
+{
+	void *mem;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+	if (host->page_shift)
+		flags |= MAP_HUGETLB | (host->page_shift << MAP_HUGE_SHIFT);
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_err("Mapping %zu bytes of host memory failed (%s)\n", size, strerror(errno));
+		return NULL;
+	}
+
+	if (host->node >= 0) {
+		unsigned long nodemask = 1UL << host->node;
+
+		if (syscall(SYS_mbind, mem, size, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0)) {
+			pr_err("Binding host memory to node %d failed (%s)\n", host->node, strerror(errno));
+			munmap(mem, size);
+			return NULL;
+		}
+	}
+
+	return mem;
+}
+
+static int host_alloc(struct backend *backend, unsigned long long size)
+{
+	struct host_backend *host = backend->priv;
+
+	host->size = (size + host->page_size - 1) & ~(unsigned long long)(host->page_size - 1);
+	host->data = host_map(host, host->size);
+	if (!host->data)
+		return -1;
+
+	return 0;
+}
+
+static void *host_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct host_backend *host = backend->priv;
+
+	return host_map(host, (size + host->page_size - 1) & ~(host->page_size - 1));
+}
+
+static int host_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	struct host_backend *host = backend->priv;
+
+	memcpy(buf, host->data + offset, len);
+
+	return 0;
+}
+
+static int host_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	struct host_backend *host = backend->priv;
+
+	memcpy(host->data + offset, buf, len);
+
+	return 0;
+}
+
+static int host_query(struct backend *backend, unsigned int slot)
+{
+	return 0;
+}
+
+static int host_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct host_backend *host = backend->priv;
+
+	memset(host->data + offset, 0, len);
+
+	return 0;
+}
+
+/* Give back the whole pages in the range, zero the rest */
+static int host_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct host_backend *host = backend->priv;
+	unsigned long long mask = host->page_size - 1;
+	unsigned long long start = (offset + mask) & ~mask;
+	unsigned long long end = (offset + len) & ~mask;
+
+	if (start >= end || madvise(host->data + start, end - start, MADV_DONTNEED))
+		return host_zero(backend, offset, len);
+
+	host_zero(backend, offset, start - offset);
+	host_zero(backend, end, offset + len - end);
+
+	return 0;
+}
+
+static int host_sync(struct backend *backend)
+{
+	return 0;
+}
+
+const struct backend_ops host_backend_ops = {
+	.name = "host",
+	.init = host_init,
+	.alloc = host_alloc,
+	.alloc_buffer = host_alloc_buffer,
+	.read = host_read,
+	.write = host_write,
+	.query = host_query,
+	.wait = host_query,
+	.zero = host_zero,
+	.discard = host_discard,
+	.sync = host_sync,
+};
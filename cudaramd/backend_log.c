@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Write log backend.
+ *
+ * The spec is log:sizeMB:backend[:arg], e.g. log:64:cuda:0. Written pages are
+ * appended to a log of sizeMB in the inner backend's transfer buffers, pinned
+ * host memory with cuda, and the writes are done as soon as they are copied.
+ * A drain thread writes the log to the inner backend in order in the
+ * background and flushes wait for everything logged so far to be drained.
+ *
+ * A table maps each page to its latest write in the log so that reads find
+ * it, pages written again before being drained are only written to the inner
+ * backend once.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define BATCH_PAGES 256 /* pages drained at once */
+
+struct log_record {
+	unsigned int page;
+	int ready; /* the data is copied in */
+};
+
+struct log_backend {
+	struct backend inner;
+	unsigned long page_size;
+	unsigned long long size;
+
+	unsigned long long *map; /* log position + 1 of the latest write of each page, 0 if not logged */
+	unsigned int nr_pages;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond; /* wake up the drain thread */
+	pthread_cond_t drained_cond; /* drain progress */
+
+	void *data;
+	struct log_record *records;
+	unsigned int nr_records;
+	/* Free running log positions */
+	unsigned long long head; /* oldest record not drained */
+	unsigned long long draining; /* end of the records being drained */
+	unsigned long long tail; /* next record to use */
+	int err; /* drain error reported by the next flush */
+
+	pthread_t thread;
+	unsigned int slot; /* inner slot of the drain thread */
+	unsigned long long *batch; /* positions being drained */
+
+	/* Counters, updated with the lock held */
+	unsigned long long written;
+	unsigned long long drained;
+	unsigned long long superseded; /* written again before being drained */
+	unsigned long long read_hits;
+	unsigned long long full; /* writes waiting for room in the log */
+};
+
+static void *record_data(struct log_backend *log, unsigned long long pos)
+{
+	return log->data + (size_t)(pos % log->nr_records) * log->page_size;
+}
+
+static struct log_record *record_of(struct log_backend *log, unsigned long long pos)
+{
+	return &log->records[pos % log->nr_records];
+}
+
+/*
+ * Wait for the records up to end to be drained, or for a drain to fail as it
+ * may keep failing, returns the pending drain error. Must be called with the
+ * lock held.
+ */
+static int wait_drained(struct log_backend *log, unsigned long long end)
+{
+	while (log->head < end && !log->err)
+		pthread_cond_wait(&log->drained_cond, &log->lock);
+
+	return log->head < end ? log->err : 0;
+}
+
+/* Write the records of a batch that are still the latest, a transfer for each run of consecutive pages */
+static int drain_batch(struct log_backend *log, unsigned int nr)
+{
+	struct backend *inner = &log->inner;
+	unsigned long long *batch = log->batch;
+	unsigned int i, start, issued = 0;
+	int err = 0;
+
+	for (i = 0, start = 0; i < nr && !err; ++i) {
+		unsigned long long pos = batch[i];
+
+		/* Runs don't wrap around the end of the log */
+		if (i + 1 < nr && batch[i + 1] == pos + 1 && (pos + 1) % log->nr_records &&
+		    record_of(log, pos + 1)->page == record_of(log, pos)->page + 1)
+			continue;
+
+		err = inner->ops->write(inner, log->slot, record_data(log, batch[start]),
+				(unsigned long long)record_of(log, batch[start])->page * log->page_size,
+				(i + 1 - start) * log->page_size);
+		if (!err)
+			++issued;
+		start = i + 1;
+	}
+
+	if (issued) {
+		int wait_err = inner->ops->wait(inner, log->slot);
+
+		if (!err)
+			err = wait_err;
+	}
+
+	return err;
+}
+
+static void *drain_thread(void *arg)
+{
+	struct log_backend *log = arg;
+	struct backend *inner = &log->inner;
+
+	if (inner->ops->attach && inner->ops->attach(inner))
+		exit(EXIT_FAILURE);
+
+	pthread_mutex_lock(&log->lock);
+	while (1) {
+		unsigned long long pos, end;
+		unsigned int nr = 0;
+		int err;
+
+		if (log->head == log->tail || !record_of(log, log->head)->ready) {
+			pthread_cond_wait(&log->ready_cond, &log->lock);
+			continue;
+		}
+
+		/* Take the ready records from the head, skipping the ones written again since */
+		for (end = log->head; end < log->tail && end - log->head < BATCH_PAGES && record_of(log, end)->ready; ++end) {
+			if (log->map[record_of(log, end)->page] == end + 1)
+				log->batch[nr++] = end;
+			else
+				++log->superseded;
+		}
+		log->draining = end;
+		pthread_mutex_unlock(&log->lock);
+
+		err = drain_batch(log, nr);
+
+		pthread_mutex_lock(&log->lock);
+		if (err) {
+			pr_err("Draining %u pages of the log failed (%d)\n", nr, err);
+			log->err = err;
+			log->draining = log->head;
+			pthread_cond_broadcast(&log->drained_cond);
+			pthread_mutex_unlock(&log->lock);
+			/* Retry after a while */
+			sleep(1);
+			pthread_mutex_lock(&log->lock);
+			continue;
+		}
+
+		/* Reads of the drained pages go to the inner backend from now on */
+		for (pos = log->head; pos < end; ++pos) {
+			struct log_record *record = record_of(log, pos);
+
+			if (log->map[record->page] == pos + 1)
+				log->map[record->page] = 0;
+			record->ready = 0;
+		}
+		log->drained += nr;
+		log->head = end;
+		pthread_cond_broadcast(&log->drained_cond);
+	}
+
+	return NULL;
+}
+
+static int log_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct log_backend *log;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	char *end;
+
+	if (!spec) {
+		pr_err("The log backend needs a size and an inner backend, log:sizeMB:backend[:arg]\n");
+		return -1;
+	}
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return -1;
+
+	log->size = strtoull(arg, &end, 10) << 20;
+	if (end != spec || !log->size) {
+		pr_err("Invalid log size '%.*s'\n", (int)(spec - arg), arg);
+		goto err_free;
+	}
+
+	log->page_size = sysconf(_SC_PAGESIZE);
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->ready_cond, NULL);
+	pthread_cond_init(&log->drained_cond, NULL);
+
+	/* An extra inner slot for draining */
+	log->slot = slots;
+	if (setup_backend(&log->inner, spec + 1, slots + 1))
+		goto err_free;
+
+	backend->priv = log;
+
+	return 0;
+
+err_free:
+	free(log);
+
+	return -1;
+}
+
+static int log_alloc(struct backend *backend, unsigned long long size)
+{
+	int err;
+	struct log_backend *log = backend->priv;
+	struct backend *inner = &log->inner;
+
+	log->nr_pages = size / log->page_size;
+	log->nr_records = log->size / log->page_size;
+	if (!log->nr_records) {
+		pr_err("The log needs at least a page\n");
+		return -1;
+	}
+
+	log->map = calloc(log->nr_pages, sizeof(*log->map));
+	log->records = calloc(log->nr_records, sizeof(*log->records));
+	log->batch = malloc(BATCH_PAGES * sizeof(*log->batch));
+	if (!log->map || !log->records || !log->batch) {
+		pr_err("Allocating the log tables failed\n");
+		return -1;
+	}
+
+	if (inner->ops->alloc(inner, size))
+		return -1;
+
+	log->data = inner->ops->alloc_buffer(inner, (size_t)log->nr_records * log->page_size);
+	if (!log->data) {
+		pr_err("Allocating %u log pages failed\n", log->nr_records);
+		return -1;
+	}
+
+	err = pthread_create(&log->thread, NULL, drain_thread, log);
+	if (err) {
+		pr_err("Creating the drain thread failed (%s)\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int log_attach(struct backend *backend)
+{
+	struct log_backend *log = backend->priv;
+	struct backend *inner = &log->inner;
+
+	return inner->ops->attach ? inner->ops->attach(inner) : 0;
+}
+
+static void *log_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct log_backend *log = backend->priv;
+
+	return log->inner.ops->alloc_buffer(&log->inner, size);
+}
+
+/* Copy the logged pages and read the rest, a transfer for each run of pages not in the log */
+static int log_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	int err = 0;
+	struct log_backend *log = backend->priv;
+	struct backend *inner = &log->inner;
+	unsigned int page = offset / log->page_size;
+	unsigned int pages = len / log->page_size;
+	unsigned int i, start;
+
+	pthread_mutex_lock(&log->lock);
+	for (i = 0, start = 0; i <= pages && !err; ++i) {
+		unsigned long long pos = i < pages ? log->map[page + i] : 0;
+
+		if (i < pages && !pos)
+			continue;
+
+		if (start < i)
+			err = inner->ops->read(inner, slot, buf + start * log->page_size,
+					(unsigned long long)(page + start) * log->page_size,
+					(i - start) * log->page_size);
+
+		/* The record isn't reused while mapped */
+		if (pos) {
+			memcpy(buf + i * log->page_size, record_data(log, pos - 1), log->page_size);
+			++log->read_hits;
+		}
+		start = i + 1;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	return err;
+}
+
+/* A write larger than the log goes straight to the inner backend once the log is drained */
+static int write_through(struct log_backend *log, unsigned int slot, const void *buf,
+		unsigned long long offset, size_t len)
+{
+	struct backend *inner = &log->inner;
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	err = wait_drained(log, log->tail);
+	pthread_mutex_unlock(&log->lock);
+
+	/* The older writes in the log would overwrite it */
+	if (err)
+		return err;
+
+	return inner->ops->write(inner, slot, buf, offset, len);
+}
+
+/* Append the pages to the log, the write is done once they are copied */
+static int log_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	struct log_backend *log = backend->priv;
+	unsigned int page = offset / log->page_size;
+	unsigned int pages = len / log->page_size;
+	unsigned long long pos;
+	unsigned int i;
+	int err;
+
+	if (pages > log->nr_records)
+		return write_through(log, slot, buf, offset, len);
+
+	pthread_mutex_lock(&log->lock);
+	if (log->tail + pages - log->head > log->nr_records)
+		++log->full;
+	while (log->tail + pages - log->head > log->nr_records) {
+		/* Don't wait for room a failing drain may never make */
+		if (log->err) {
+			err = log->err;
+			pthread_mutex_unlock(&log->lock);
+			return err;
+		}
+		pthread_cond_wait(&log->drained_cond, &log->lock);
+	}
+	pos = log->tail;
+	log->tail += pages;
+	pthread_mutex_unlock(&log->lock);
+
+	/* The records are not drained before they are ready */
+	for (i = 0; i < pages; ++i)
+		memcpy(record_data(log, pos + i), buf + i * log->page_size, log->page_size);
+
+	pthread_mutex_lock(&log->lock);
+	for (i = 0; i < pages; ++i) {
+		struct log_record *record = record_of(log, pos + i);
+
+		record->page = page + i;
+		record->ready = 1;
+
+		/* Concurrent writes of a page keep the one logged last */
+		if (log->map[page + i] < pos + i + 1)
+			log->map[page + i] = pos + i + 1;
+	}
+	log->written += pages;
+	pthread_cond_signal(&log->ready_cond);
+	pthread_mutex_unlock(&log->lock);
+
+	return 0;
+}
+
+/* The writes never use the slots, only the reads need checking */
+static int log_query(struct backend *backend, unsigned int slot)
+{
+	struct log_backend *log = backend->priv;
+
+	return log->inner.ops->query(&log->inner, slot);
+}
+
+static int log_wait(struct backend *backend, unsigned int slot)
+{
+	struct log_backend *log = backend->priv;
+
+	return log->inner.ops->wait(&log->inner, slot);
+}
+
+/* Drop the logged writes of a range, waiting for the ones being drained */
+static void forget_range(struct log_backend *log, unsigned long long offset, size_t len)
+{
+	unsigned int page = offset / log->page_size;
+	unsigned int end = (offset + len) / log->page_size;
+
+	pthread_mutex_lock(&log->lock);
+	for (; page < end; ++page)
+		log->map[page] = 0;
+	/* Even with a drain error pending, a retry may be in flight */
+	while (log->head < log->draining)
+		pthread_cond_wait(&log->drained_cond, &log->lock);
+	pthread_mutex_unlock(&log->lock);
+}
+
+static int log_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct log_backend *log = backend->priv;
+
+	forget_range(log, offset, len);
+
+	return log->inner.ops->zero(&log->inner, offset, len);
+}
+
+static int log_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct log_backend *log = backend->priv;
+
+	forget_range(log, offset, len);
+
+	return log->inner.ops->discard(&log->inner, offset, len);
+}
+
+static int log_sync(struct backend *backend)
+{
+	struct log_backend *log = backend->priv;
+
+	return log->inner.ops->sync(&log->inner);
+}
+
+/* Wait for everything logged by now to be drained */
+static int log_flush(struct backend *backend)
+{
+	int err;
+	struct log_backend *log = backend->priv;
+	struct backend *inner = &log->inner;
+
+	/* A failed drain is retried, the error is reported to a single flush */
+	pthread_mutex_lock(&log->lock);
+	wait_drained(log, log->tail);
+	err = log->err;
+	log->err = 0;
+	pthread_mutex_unlock(&log->lock);
+
+	if (!err && inner->ops->flush)
+		err = inner->ops->flush(inner);
+
+	return err;
+}
+
+static void log_stats(struct backend *backend)
+{
+	struct log_backend *log = backend->priv;
+
+	pthread_mutex_lock(&log->lock);
+	pr_info("log: %llu of %u pages used, %llu written, %llu drained, %llu superseded, "
+			"%llu read from the log, %llu writes waited for room\n",
+			log->tail - log->head, log->nr_records, log->written, log->drained,
+			log->superseded, log->read_hits, log->full);
+	pthread_mutex_unlock(&log->lock);
+
+	if (log->inner.ops->stats)
+		log->inner.ops->stats(&log->inner);
+}
+
+static void log_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	struct log_backend *log = backend->priv;
+
+	pthread_mutex_lock(&log->lock);
+	print_metric(out, "log_used_pages", id, log->tail - log->head);
+	print_metric(out, "log_pages", id, log->nr_records);
+	print_metric(out, "log_written_total", id, log->written);
+	print_metric(out, "log_drained_total", id, log->drained);
+	print_metric(out, "log_superseded_total", id, log->superseded);
+	print_metric(out, "log_read_hits_total", id, log->read_hits);
+	print_metric(out, "log_full_total", id, log->full);
+	pthread_mutex_unlock(&log->lock);
+
+	inner_metrics(&log->inner, out, id, 0);
+}
+
+const struct backend_ops log_backend_ops = {
+	.name = "log",
+	.init = log_init,
+	.attach = log_attach,
+	.alloc = log_alloc,
+	.alloc_buffer = log_alloc_buffer,
+	.read = log_read,
+	.write = log_write,
+	.query = log_query,
+	.wait = log_wait,
+	.zero = log_zero,
+	.discard = log_discard,
+	.sync = log_sync,
+	.flush = log_flush,
+	.stats = log_stats,
+	.metrics = log_metrics,
+};
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Mock backend keeping the data in plain host memory.
+ *
+ * The copies are done right away, but each transfer is only reported as done
+ * after a configurable latency (mock:usecs) so that the pipelining in the
+ * daemon can be exercised without a GPU.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "backend.h"
+#include "print.h"
+
+struct mock_backend {
+	void *data;
+	unsigned int slots;
+	long latency; /* in ns */
+	struct timespec *done_at; /* per slot */
+};
+
+static long timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+static int mock_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct mock_backend *mock;
+
+	mock = calloc(1, sizeof(*mock));
+	if (!mock)
+		return -1;
+
+	if (arg)
+		mock->latency = atol(arg) * 1000;
+
+	mock->slots = slots;
+	mock->done_at = calloc(slots, sizeof(*mock->done_at));
+	if (!mock->done_at) {
+		free(mock);
+		return -1;
+	}
+
+	backend->priv = mock;
+
+	return 0;
+}
+
+static int mock_alloc(struct backend *backend, unsigned long long size)
+{
+	struct mock_backend *mock = backend->priv;
+
+	mock->data = calloc(1, size);
+	if (!mock->data) {
+		pr_err("Allocating mock data failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *mock_alloc_buffer(struct backend *backend, size_t size)
+{
+	return malloc(size);
+}
+
+static void mock_start(struct mock_backend *mock, unsigned int slot)
+{
+	struct timespec *done_at = &mock->done_at[slot];
+
+	clock_gettime(CLOCK_MONOTONIC, done_at);
+	done_at->tv_nsec += mock->latency;
+	done_at->tv_sec += done_at->tv_nsec / 1000000000L;
+	done_at->tv_nsec %= 1000000000L;
+}
+
+static int mock_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	struct mock_backend *mock = backend->priv;
+
+	memcpy(buf, mock->data + offset, len);
+	mock_start(mock, slot);
+
+	return 0;
+}
+
+static int mock_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	struct mock_backend *mock = backend->priv;
+
+	memcpy(mock->data + offset, buf, len);
+	mock_start(mock, slot);
+
+	return 0;
+}
+
+static int mock_query(struct backend *backend, unsigned int slot)
+{
+	struct mock_backend *mock = backend->priv;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return timespec_diff(&mock->done_at[slot], &now) > 0 ? -EAGAIN : 0;
+}
+
+static int mock_wait(struct backend *backend, unsigned int slot)
+{
+	struct mock_backend *mock = backend->priv;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mock->done_at[slot], NULL) == EINTR)
+		;
+
+	return 0;
+}
+
+static int mock_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	struct mock_backend *mock = backend->priv;
+
+	memset(mock->data + offset, 0, len);
+
+	return 0;
+}
+
+static int mock_sync(struct backend *backend)
+{
+	struct mock_backend *mock = backend->priv;
+	unsigned int slot;
+
+	for (slot = 0; slot < mock->slots; ++slot)
+		mock_wait(backend, slot);
+
+	return 0;
+}
+
+const struct backend_ops mock_backend_ops = {
+	.name = "mock",
+	.init = mock_init,
+	.alloc = mock_alloc,
+	.alloc_buffer = mock_alloc_buffer,
+	.read = mock_read,
+	.write = mock_write,
+	.query = mock_query,
+	.wait = mock_wait,
+	.zero = mock_zero,
+	.discard = mock_zero,
+	.sync = mock_sync,
+};
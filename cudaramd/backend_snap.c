@@ -0,0 +1,825 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Snapshot backend.
+ *
+ * The spec is snap:path[@interval_s]:backend[:arg], e.g.
+ * snap:/var/lib/cudaram0.img@60:cuda. The contents of the inner backend are
+ * saved to an image file at path so that they survive restarts of the daemon.
+ *
+ * The written chunks are tracked in a bitmap and a checkpoint thread writes
+ * the dirty ones to the image every interval_s seconds (default 30, 0 for
+ * only on flushes) and on flushes, in runs of consecutive chunks in order.
+ * Chunks that are all zeros are punched out of the image instead.
+ *
+ * If the image exists the device is restored lazily: the chunks holding data
+ * are loaded in the background in order and the ones accessed before that are
+ * loaded right away, the device is usable immediately.
+ */
+
+#define _GNU_SOURCE /* for SEEK_DATA and fallocate */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <linux/falloc.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define CHUNK_SHIFT 16 /* 64K chunks */
+#define BATCH_CHUNKS 64 /* chunks loaded or saved at once */
+#define DEFAULT_INTERVAL 30
+#define HEADER_SIZE 4096 /* the chunks follow the header in the image */
+#define SNAP_MAGIC "CUDARAMS"
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* Chunk restore states */
+#define CHUNK_LOADED    0
+#define CHUNK_UNLOADED  1 /* still only in the image */
+#define CHUNK_LOADING   2
+
+struct snap_header {
+	char magic[8];
+	uint64_t size; /* of the device */
+	uint64_t chunk_size;
+};
+
+/* Range of the chunks written on a slot, first > last if none */
+struct snap_slot {
+	unsigned int first;
+	unsigned int last;
+};
+
+struct snap_backend {
+	struct backend inner;
+	char *path;
+	int fd;
+	unsigned long long size;
+	unsigned long long chunk_size;
+	unsigned int nr_chunks;
+	unsigned int interval; /* in seconds */
+
+	unsigned long *dirty; /* bitmap of chunks written since they were last saved, set without the lock */
+	struct snap_slot *slots; /* chunks written on each slot, marked dirty again once the writes are done */
+
+	pthread_mutex_t lock;
+	pthread_cond_t checkpoint_cond; /* wake up the checkpoint thread */
+	pthread_cond_t saved_cond; /* checkpoint done */
+	pthread_cond_t loaded_cond; /* chunks loaded */
+
+	unsigned long long requested; /* checkpoints requested by flushes */
+	unsigned long long saved; /* checkpoints done of the requested ones */
+	int err; /* checkpoint error reported by the next flush */
+
+	unsigned char *state; /* CHUNK_* restore state of each chunk */
+	unsigned int unloaded; /* chunks not loaded yet, read without the lock */
+
+	/* Loads are done one at a time on their own inner slot */
+	pthread_mutex_t load_lock;
+	unsigned int load_slot;
+	void *load_buf;
+
+	pthread_t checkpoint_thread;
+	pthread_t restore_thread;
+	unsigned int checkpoint_slot;
+	void *checkpoint_buf;
+
+	/* Counters, updated with the lock held */
+	unsigned long long checkpoints;
+	unsigned long long chunks_saved;
+	unsigned long long chunks_punched;
+	unsigned long long chunks_restored;
+	unsigned long long chunks_faulted; /* loaded on access */
+};
+
+static void mark_dirty(struct snap_backend *snap, unsigned long long offset, size_t len)
+{
+	unsigned int c = offset >> CHUNK_SHIFT;
+	unsigned int last = (offset + len - 1) >> CHUNK_SHIFT;
+
+	for (; c <= last; ++c) {
+		unsigned long bit = 1UL << (c % BITS_PER_WORD);
+
+		if (!(ACCESS_ONCE(snap->dirty[c / BITS_PER_WORD]) & bit))
+			__sync_fetch_and_or(&snap->dirty[c / BITS_PER_WORD], bit);
+	}
+}
+
+/* Load consecutive chunks from the image to the inner backend */
+static int load_chunks(struct snap_backend *snap, unsigned int first, unsigned int nr)
+{
+	struct backend *inner = &snap->inner;
+	size_t len = (size_t)nr << CHUNK_SHIFT, done = 0;
+	off_t offset = HEADER_SIZE + ((off_t)first << CHUNK_SHIFT);
+	int err;
+
+	pthread_mutex_lock(&snap->load_lock);
+
+	while (done < len) {
+		ssize_t got = pread(snap->fd, snap->load_buf + done, len - done, offset + done);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			pr_err("Reading chunks %u-%u from '%s' failed (%s)\n", first, first + nr - 1, snap->path, strerror(errno));
+			err = -EIO;
+			goto out;
+		}
+		/* Past the end of the image reads as zeros */
+		if (!got) {
+			memset(snap->load_buf + done, 0, len - done);
+			break;
+		}
+		done += got;
+	}
+
+	err = inner->ops->write(inner, snap->load_slot, snap->load_buf, (unsigned long long)first << CHUNK_SHIFT, len);
+	if (!err)
+		err = inner->ops->wait(inner, snap->load_slot);
+
+out:
+	pthread_mutex_unlock(&snap->load_lock);
+
+	return err;
+}
+
+/*
+ * Load the chunks of a range that are still only in the image before it's
+ * accessed, waiting for the ones being loaded already. Chunks that are
+ * overwritten as a whole, if whole is set, are not loaded.
+ */
+static int fault_range(struct snap_backend *snap, unsigned long long offset, size_t len, int whole)
+{
+	unsigned int c = offset >> CHUNK_SHIFT;
+	unsigned int last = (offset + len - 1) >> CHUNK_SHIFT;
+	int err = 0;
+
+	/* Never set again once everything is loaded */
+	if (!ACCESS_ONCE(snap->unloaded))
+		return 0;
+
+	pthread_mutex_lock(&snap->lock);
+	for (; c <= last && !err; ++c) {
+		unsigned long long start = (unsigned long long)c << CHUNK_SHIFT;
+
+		while (snap->state[c] == CHUNK_LOADING)
+			pthread_cond_wait(&snap->loaded_cond, &snap->lock);
+
+		if (snap->state[c] != CHUNK_UNLOADED)
+			continue;
+
+		if (!whole || start < offset || start + snap->chunk_size > offset + len) {
+			snap->state[c] = CHUNK_LOADING;
+			pthread_mutex_unlock(&snap->lock);
+
+			err = load_chunks(snap, c, 1);
+
+			pthread_mutex_lock(&snap->lock);
+			pthread_cond_broadcast(&snap->loaded_cond);
+			if (err) {
+				snap->state[c] = CHUNK_UNLOADED;
+				break;
+			}
+			++snap->chunks_faulted;
+		}
+
+		snap->state[c] = CHUNK_LOADED;
+		--snap->unloaded;
+	}
+	pthread_mutex_unlock(&snap->lock);
+
+	return err;
+}
+
+/* Load the chunks not accessed yet in order, a batch of consecutive ones at a time */
+static void *restore_thread(void *arg)
+{
+	struct snap_backend *snap = arg;
+	struct backend *inner = &snap->inner;
+	unsigned int c = 0, nr, i;
+	int err;
+
+	if (inner->ops->attach && inner->ops->attach(inner))
+		exit(EXIT_FAILURE);
+
+	pthread_mutex_lock(&snap->lock);
+	while (snap->unloaded) {
+		while (c < snap->nr_chunks && snap->state[c] != CHUNK_UNLOADED)
+			++c;
+
+		/* Only the chunks being faulted in are left */
+		if (c == snap->nr_chunks) {
+			pthread_cond_wait(&snap->loaded_cond, &snap->lock);
+			c = 0;
+			continue;
+		}
+
+		for (nr = 0; nr < BATCH_CHUNKS && c + nr < snap->nr_chunks && snap->state[c + nr] == CHUNK_UNLOADED; ++nr)
+			snap->state[c + nr] = CHUNK_LOADING;
+		pthread_mutex_unlock(&snap->lock);
+
+		err = load_chunks(snap, c, nr);
+
+		pthread_mutex_lock(&snap->lock);
+		for (i = 0; i < nr; ++i)
+			snap->state[c + i] = err ? CHUNK_UNLOADED : CHUNK_LOADED;
+		pthread_cond_broadcast(&snap->loaded_cond);
+
+		if (err) {
+			/* Retry after a while */
+			pthread_mutex_unlock(&snap->lock);
+			sleep(1);
+			pthread_mutex_lock(&snap->lock);
+			continue;
+		}
+
+		snap->unloaded -= nr;
+		snap->chunks_restored += nr;
+		c += nr;
+	}
+	pr_info("Restored '%s'\n", snap->path);
+	pthread_mutex_unlock(&snap->lock);
+
+	return NULL;
+}
+
+static int write_image(struct snap_backend *snap, const void *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t done = pwrite(snap->fd, buf, len, offset);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0) {
+			pr_err("Writing to '%s' failed (%s)\n", snap->path, strerror(errno));
+			return -EIO;
+		}
+		buf += done;
+		len -= done;
+		offset += done;
+	}
+
+	return 0;
+}
+
+static int chunk_zero(const void *data, size_t len)
+{
+	const unsigned long *word = data;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*word); ++i) {
+		if (word[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Save a run of dirty chunks, the chunks that are all zeros are punched out of the image */
+static int save_chunks(struct snap_backend *snap, unsigned int first, unsigned int nr)
+{
+	struct backend *inner = &snap->inner;
+	void *buf = snap->checkpoint_buf;
+	unsigned int i, start, punched = 0;
+	int err;
+
+	err = inner->ops->read(inner, snap->checkpoint_slot, buf, (unsigned long long)first << CHUNK_SHIFT,
+			(size_t)nr << CHUNK_SHIFT);
+	if (!err)
+		err = inner->ops->wait(inner, snap->checkpoint_slot);
+	if (err)
+		return err;
+
+	for (i = 0, start = 0; i <= nr && !err; ++i) {
+		off_t offset = HEADER_SIZE + ((off_t)(first + start) << CHUNK_SHIFT);
+
+		if (i < nr && !chunk_zero(buf + ((size_t)i << CHUNK_SHIFT), snap->chunk_size))
+			continue;
+
+		if (start < i)
+			err = write_image(snap, buf + ((size_t)start << CHUNK_SHIFT), (size_t)(i - start) << CHUNK_SHIFT, offset);
+
+		if (!err && i < nr) {
+			if (fallocate(snap->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					HEADER_SIZE + ((off_t)(first + i) << CHUNK_SHIFT), snap->chunk_size))
+				err = write_image(snap, buf + ((size_t)i << CHUNK_SHIFT), snap->chunk_size,
+						HEADER_SIZE + ((off_t)(first + i) << CHUNK_SHIFT));
+			else
+				++punched;
+		}
+		start = i + 1;
+	}
+
+	pthread_mutex_lock(&snap->lock);
+	snap->chunks_saved += nr - punched;
+	snap->chunks_punched += punched;
+	pthread_mutex_unlock(&snap->lock);
+
+	return err;
+}
+
+/*
+ * Save all the dirty chunks in order and sync the image.
+ *
+ * The dirty bits are cleared before the chunks are read so that writes done
+ * meanwhile set them again and are saved by the next checkpoint. A write still
+ * in flight when its chunk is read sets them again once it's done.
+ */
+static int checkpoint(struct snap_backend *snap)
+{
+	unsigned int c, first = 0, nr = 0;
+	unsigned long bits = 0;
+	int err = 0;
+
+	for (c = 0; c <= snap->nr_chunks; ++c) {
+		int dirty = 0;
+
+		if (c < snap->nr_chunks) {
+			if (c % BITS_PER_WORD == 0) {
+				unsigned long *word = &snap->dirty[c / BITS_PER_WORD];
+
+				bits = *word ? __sync_fetch_and_and(word, 0) : 0;
+
+				/* Skip the clean words */
+				if (!bits && !nr) {
+					c += BITS_PER_WORD - 1;
+					continue;
+				}
+			}
+			dirty = !!(bits & (1UL << (c % BITS_PER_WORD)));
+		}
+
+		if (dirty && nr && nr < BATCH_CHUNKS) {
+			++nr;
+			continue;
+		}
+
+		if (nr) {
+			int run_err = save_chunks(snap, first, nr);
+
+			if (run_err) {
+				mark_dirty(snap, (unsigned long long)first << CHUNK_SHIFT, (size_t)nr << CHUNK_SHIFT);
+				if (!err)
+					err = run_err;
+			}
+			nr = 0;
+		}
+
+		if (dirty) {
+			first = c;
+			nr = 1;
+		}
+	}
+
+	if (fdatasync(snap->fd)) {
+		pr_err("Syncing '%s' failed (%s)\n", snap->path, strerror(errno));
+		if (!err)
+			err = -EIO;
+	}
+
+	return err;
+}
+
+static void *checkpoint_thread(void *arg)
+{
+	struct snap_backend *snap = arg;
+	struct backend *inner = &snap->inner;
+
+	if (inner->ops->attach && inner->ops->attach(inner))
+		exit(EXIT_FAILURE);
+
+	pthread_mutex_lock(&snap->lock);
+	while (1) {
+		unsigned long long target = snap->requested;
+		int err;
+
+		if (snap->saved == target) {
+			if (snap->interval) {
+				struct timespec deadline;
+
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += snap->interval;
+				if (pthread_cond_timedwait(&snap->checkpoint_cond, &snap->lock, &deadline) != ETIMEDOUT)
+					continue;
+			} else {
+				pthread_cond_wait(&snap->checkpoint_cond, &snap->lock);
+				continue;
+			}
+		}
+		pthread_mutex_unlock(&snap->lock);
+
+		err = checkpoint(snap);
+
+		pthread_mutex_lock(&snap->lock);
+		if (err) {
+			pr_err("Checkpointing to '%s' failed (%d)\n", snap->path, err);
+			snap->err = err;
+		}
+		++snap->checkpoints;
+		snap->saved = target;
+		pthread_cond_broadcast(&snap->saved_cond);
+	}
+
+	return NULL;
+}
+
+static int snap_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct snap_backend *snap;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	char *interval;
+	unsigned int i;
+
+	if (!spec || spec == arg) {
+		pr_err("The snap backend needs an image path and an inner backend, snap:path[@interval_s]:backend[:arg]\n");
+		return -1;
+	}
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return -1;
+
+	snap->path = strndup(arg, spec - arg);
+	if (!snap->path)
+		goto err_free;
+
+	snap->interval = DEFAULT_INTERVAL;
+	interval = strrchr(snap->path, '@');
+	if (interval) {
+		*interval++ = '\0';
+		snap->interval = atoi(interval);
+	}
+
+	snap->chunk_size = 1ULL << CHUNK_SHIFT;
+
+	pthread_mutex_init(&snap->lock, NULL);
+	pthread_cond_init(&snap->checkpoint_cond, NULL);
+	pthread_cond_init(&snap->saved_cond, NULL);
+	pthread_cond_init(&snap->loaded_cond, NULL);
+	pthread_mutex_init(&snap->load_lock, NULL);
+
+	snap->slots = malloc(slots * sizeof(*snap->slots));
+	if (!snap->slots)
+		goto err_free_path;
+	for (i = 0; i < slots; ++i) {
+		snap->slots[i].first = 1;
+		snap->slots[i].last = 0;
+	}
+
+	/* Extra inner slots for loading and checkpointing */
+	snap->load_slot = slots;
+	snap->checkpoint_slot = slots + 1;
+	if (setup_backend(&snap->inner, spec + 1, slots + 2))
+		goto err_free_slots;
+
+	backend->priv = snap;
+
+	return 0;
+
+err_free_slots:
+	free(snap->slots);
+err_free_path:
+	free(snap->path);
+err_free:
+	free(snap);
+
+	return -1;
+}
+
+/* Mark the chunks with data in the image for loading, all of them if holes can't be found */
+static void find_data(struct snap_backend *snap)
+{
+	off_t end = HEADER_SIZE + ((off_t)snap->nr_chunks << CHUNK_SHIFT);
+	off_t data = HEADER_SIZE, hole;
+	unsigned int c;
+
+	while (data < end) {
+		data = lseek(snap->fd, data, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+
+		hole = data < 0 ? end : lseek(snap->fd, data, SEEK_HOLE);
+		if (data < 0 || hole < 0) {
+			data = HEADER_SIZE;
+			hole = end;
+		}
+		if (hole > end)
+			hole = end;
+
+		for (c = (data - HEADER_SIZE) >> CHUNK_SHIFT; c < ((hole - HEADER_SIZE + snap->chunk_size - 1) >> CHUNK_SHIFT); ++c) {
+			if (snap->state[c] == CHUNK_UNLOADED)
+				continue;
+			snap->state[c] = CHUNK_UNLOADED;
+			++snap->unloaded;
+		}
+
+		data = hole;
+	}
+}
+
+/* Create the image or check that it matches the device, the chunks with data are restored */
+static int open_image(struct snap_backend *snap)
+{
+	struct snap_header header;
+	struct stat st;
+
+	snap->fd = open(snap->path, O_RDWR | O_CREAT, 0600);
+	if (snap->fd < 0 || fstat(snap->fd, &st)) {
+		pr_err("Opening '%s' failed (%s)\n", snap->path, strerror(errno));
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+		header.size = snap->size;
+		header.chunk_size = snap->chunk_size;
+
+		if (write_image(snap, &header, sizeof(header), 0) ||
+		    ftruncate(snap->fd, HEADER_SIZE + ((off_t)snap->nr_chunks << CHUNK_SHIFT))) {
+			pr_err("Creating '%s' failed\n", snap->path);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (pread(snap->fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic))) {
+		pr_err("'%s' is not a cudaram image\n", snap->path);
+		return -1;
+	}
+
+	if (header.size != snap->size || header.chunk_size != snap->chunk_size) {
+		pr_err("The image '%s' is of a %llu MB device, remove it to start over\n", snap->path,
+				(unsigned long long)header.size >> 20);
+		return -1;
+	}
+
+	find_data(snap);
+	pr_info("Restoring %u chunks from '%s'\n", snap->unloaded, snap->path);
+
+	return 0;
+}
+
+static int snap_alloc(struct backend *backend, unsigned long long size)
+{
+	int err;
+	struct snap_backend *snap = backend->priv;
+	struct backend *inner = &snap->inner;
+
+	snap->size = size;
+	snap->nr_chunks = (size + snap->chunk_size - 1) >> CHUNK_SHIFT;
+
+	snap->dirty = calloc((snap->nr_chunks + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(*snap->dirty));
+	snap->state = calloc(snap->nr_chunks, sizeof(*snap->state));
+	if (!snap->dirty || !snap->state) {
+		pr_err("Allocating the snapshot tables failed\n");
+		return -1;
+	}
+
+	if (inner->ops->alloc(inner, (unsigned long long)snap->nr_chunks << CHUNK_SHIFT))
+		return -1;
+
+	snap->load_buf = inner->ops->alloc_buffer(inner, (size_t)BATCH_CHUNKS << CHUNK_SHIFT);
+	snap->checkpoint_buf = inner->ops->alloc_buffer(inner, (size_t)BATCH_CHUNKS << CHUNK_SHIFT);
+	if (!snap->load_buf || !snap->checkpoint_buf) {
+		pr_err("Allocating the snapshot buffers failed\n");
+		return -1;
+	}
+
+	if (open_image(snap))
+		return -1;
+
+	if (snap->unloaded) {
+		err = pthread_create(&snap->restore_thread, NULL, restore_thread, snap);
+		if (err) {
+			pr_err("Creating the restore thread failed (%s)\n", strerror(err));
+			return -1;
+		}
+	}
+
+	err = pthread_create(&snap->checkpoint_thread, NULL, checkpoint_thread, snap);
+	if (err) {
+		pr_err("Creating the checkpoint thread failed (%s)\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int snap_attach(struct backend *backend)
+{
+	struct snap_backend *snap = backend->priv;
+	struct backend *inner = &snap->inner;
+
+	return inner->ops->attach ? inner->ops->attach(inner) : 0;
+}
+
+static void *snap_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct snap_backend *snap = backend->priv;
+
+	return snap->inner.ops->alloc_buffer(&snap->inner, size);
+}
+
+/* Remember the chunks written on a slot, a single work writes a contiguous range */
+static void record_write(struct snap_backend *snap, unsigned int slot, unsigned long long offset, size_t len)
+{
+	struct snap_slot *s = &snap->slots[slot];
+	unsigned int first = offset >> CHUNK_SHIFT;
+	unsigned int last = (offset + len - 1) >> CHUNK_SHIFT;
+
+	if (s->first > s->last) {
+		s->first = first;
+		s->last = last;
+		return;
+	}
+
+	if (first < s->first)
+		s->first = first;
+	if (last > s->last)
+		s->last = last;
+}
+
+/*
+ * Mark the chunks written on a slot dirty again once the writes are done, a
+ * checkpoint may have cleared the bits and read the chunks before the writes
+ * landed.
+ */
+static int finish_slot(struct snap_backend *snap, unsigned int slot, int wait)
+{
+	struct backend *inner = &snap->inner;
+	struct snap_slot *s = &snap->slots[slot];
+	int err = wait ? inner->ops->wait(inner, slot) : inner->ops->query(inner, slot);
+
+	if (err == -EAGAIN || s->first > s->last)
+		return err;
+
+	mark_dirty(snap, (unsigned long long)s->first << CHUNK_SHIFT, (size_t)(s->last - s->first + 1) << CHUNK_SHIFT);
+	s->first = 1;
+	s->last = 0;
+
+	return err;
+}
+
+static int snap_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	int err;
+	struct snap_backend *snap = backend->priv;
+
+	err = fault_range(snap, offset, len, 0);
+	if (err)
+		return err;
+
+	return snap->inner.ops->read(&snap->inner, slot, buf, offset, len);
+}
+
+static int snap_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	int err;
+	struct snap_backend *snap = backend->priv;
+
+	err = fault_range(snap, offset, len, 0);
+	if (err)
+		return err;
+
+	/* Marked before issuing too so that a checkpoint already under way doesn't have to wait for the next one */
+	mark_dirty(snap, offset, len);
+	record_write(snap, slot, offset, len);
+
+	err = snap->inner.ops->write(&snap->inner, slot, buf, offset, len);
+	if (err)
+		finish_slot(snap, slot, 1);
+
+	return err;
+}
+
+static int snap_query(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 0);
+}
+
+static int snap_wait(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 1);
+}
+
+/* Whole chunks being cleared don't need loading */
+static int snap_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	int err;
+	struct snap_backend *snap = backend->priv;
+
+	err = fault_range(snap, offset, len, 1);
+	if (err)
+		return err;
+
+	mark_dirty(snap, offset, len);
+
+	return snap->inner.ops->zero(&snap->inner, offset, len);
+}
+
+static int snap_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	int err;
+	struct snap_backend *snap = backend->priv;
+
+	err = fault_range(snap, offset, len, 1);
+	if (err)
+		return err;
+
+	mark_dirty(snap, offset, len);
+
+	return snap->inner.ops->discard(&snap->inner, offset, len);
+}
+
+static int snap_sync(struct backend *backend)
+{
+	struct snap_backend *snap = backend->priv;
+
+	return snap->inner.ops->sync(&snap->inner);
+}
+
+/* Checkpoint everything written by now */
+static int snap_flush(struct backend *backend)
+{
+	int err;
+	unsigned long long target;
+	struct snap_backend *snap = backend->priv;
+	struct backend *inner = &snap->inner;
+
+	if (inner->ops->flush && inner->ops->flush(inner))
+		return -1;
+
+	pthread_mutex_lock(&snap->lock);
+	target = ++snap->requested;
+	pthread_cond_signal(&snap->checkpoint_cond);
+	while (snap->saved < target)
+		pthread_cond_wait(&snap->saved_cond, &snap->lock);
+	err = snap->err;
+	snap->err = 0;
+	pthread_mutex_unlock(&snap->lock);
+
+	return err;
+}
+
+static void snap_stats(struct backend *backend)
+{
+	struct snap_backend *snap = backend->priv;
+
+	pthread_mutex_lock(&snap->lock);
+	pr_info("snap: %llu checkpoints, %llu chunks saved, %llu punched, %llu restored, %llu loaded on access, "
+			"%u of %u chunks left to restore\n",
+			snap->checkpoints, snap->chunks_saved, snap->chunks_punched, snap->chunks_restored,
+			snap->chunks_faulted, snap->unloaded, snap->nr_chunks);
+	pthread_mutex_unlock(&snap->lock);
+
+	if (snap->inner.ops->stats)
+		snap->inner.ops->stats(&snap->inner);
+}
+
+static void snap_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	struct snap_backend *snap = backend->priv;
+
+	pthread_mutex_lock(&snap->lock);
+	print_metric(out, "snap_checkpoints_total", id, snap->checkpoints);
+	print_metric(out, "snap_chunks_saved_total", id, snap->chunks_saved);
+	print_metric(out, "snap_chunks_punched_total", id, snap->chunks_punched);
+	print_metric(out, "snap_chunks_restored_total", id, snap->chunks_restored);
+	print_metric(out, "snap_chunks_faulted_total", id, snap->chunks_faulted);
+	print_metric(out, "snap_unloaded_chunks", id, snap->unloaded);
+	pthread_mutex_unlock(&snap->lock);
+
+	inner_metrics(&snap->inner, out, id, 0);
+}
+
+const struct backend_ops snap_backend_ops = {
+	.name = "snap",
+	.init = snap_init,
+	.attach = snap_attach,
+	.alloc = snap_alloc,
+	.alloc_buffer = snap_alloc_buffer,
+	.read = snap_read,
+	.write = snap_write,
+	.query = snap_query,
+	.wait = snap_wait,
+	.zero = snap_zero,
+	.discard = snap_discard,
+	.sync = snap_sync,
+	.flush = snap_flush,
+	.stats = snap_stats,
+	.metrics = snap_metrics,
+};
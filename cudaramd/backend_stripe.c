@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Striping backend.
+ *
+ * The spec is stripe:unitKB:backend[:arg][,backend[:arg]...], e.g.
+ * stripe:64:cuda:0,cuda:1. The page space is split into units of unitKB that
+ * are spread round-robin over the inner backends, a transfer spanning units
+ * is split into a transfer per unit issued on the same slot of each inner
+ * backend so that the pieces on different backends run in parallel.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define MAX_INNERS 64
+
+struct stripe_backend {
+	struct backend *inners;
+	unsigned int nr_inners;
+	unsigned long long unit; /* in bytes */
+	char *specs; /* the inner specs, split at the commas */
+
+	unsigned long long *used; /* per slot, a bit for each inner backend with transfers */
+	int *errs; /* per slot, first error of the inner backends done so far */
+};
+
+/* Map the start of a range to an inner backend, returns the length of the part in the same unit */
+static size_t map_range(struct stripe_backend *stripe, unsigned long long offset, size_t len,
+		unsigned int *inner, unsigned long long *inner_offset)
+{
+	unsigned long long unit = offset / stripe->unit;
+	unsigned long long in_unit = offset % stripe->unit;
+	size_t left = stripe->unit - in_unit;
+
+	*inner = unit % stripe->nr_inners;
+	*inner_offset = unit / stripe->nr_inners * stripe->unit + in_unit;
+
+	return len < left ? len : left;
+}
+
+static int stripe_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct stripe_backend *stripe;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	char *next, *end;
+
+	if (!spec) {
+		pr_err("The stripe backend needs a unit and inner backends, stripe:unitKB:backend[:arg][,backend[:arg]...]\n");
+		return -1;
+	}
+
+	stripe = calloc(1, sizeof(*stripe));
+	if (!stripe)
+		return -1;
+
+	stripe->unit = strtoull(arg, &end, 10) << 10;
+	if (end != spec || !stripe->unit || stripe->unit % sysconf(_SC_PAGESIZE)) {
+		pr_err("Invalid stripe unit '%.*s', has to be a multiple of the page size in KB\n", (int)(spec - arg), arg);
+		goto err_free;
+	}
+
+	stripe->specs = strdup(spec + 1);
+	stripe->inners = calloc(MAX_INNERS, sizeof(*stripe->inners));
+	stripe->used = calloc(slots, sizeof(*stripe->used));
+	stripe->errs = calloc(slots, sizeof(*stripe->errs));
+	if (!stripe->specs || !stripe->inners || !stripe->used || !stripe->errs)
+		goto err_free;
+
+	for (next = stripe->specs; next; ++stripe->nr_inners) {
+		char *inner_spec = next;
+
+		next = strchr(next, ',');
+		if (next)
+			*next++ = '\0';
+
+		if (stripe->nr_inners == MAX_INNERS) {
+			pr_err("The stripe backend supports up to %d inner backends\n", MAX_INNERS);
+			goto err_free;
+		}
+
+		if (setup_backend(&stripe->inners[stripe->nr_inners], inner_spec, slots))
+			goto err_free;
+	}
+
+	backend->priv = stripe;
+
+	return 0;
+
+err_free:
+	free(stripe->errs);
+	free(stripe->used);
+	free(stripe->inners);
+	free(stripe->specs);
+	free(stripe);
+
+	return -1;
+}
+
+/* Each inner backend gets its share of the units rounded up */
+static int stripe_alloc(struct backend *backend, unsigned long long size)
+{
+	unsigned int i;
+	struct stripe_backend *stripe = backend->priv;
+	unsigned long long units = (size + stripe->unit - 1) / stripe->unit;
+	unsigned long long inner_size = (units + stripe->nr_inners - 1) / stripe->nr_inners * stripe->unit;
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+
+		if (inner->ops->alloc(inner, inner_size))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int stripe_attach(struct backend *backend)
+{
+	unsigned int i;
+	struct stripe_backend *stripe = backend->priv;
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+
+		if (inner->ops->attach && inner->ops->attach(inner))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The buffers are used with all the inner backends, e.g. portable pinned memory with cuda */
+static void *stripe_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct stripe_backend *stripe = backend->priv;
+
+	return stripe->inners[0].ops->alloc_buffer(&stripe->inners[0], size);
+}
+
+/* Report the slot done once all the inner backends are, with the first error of any */
+static int finish_slot(struct stripe_backend *stripe, unsigned int slot, int wait)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+
+		if (!(stripe->used[slot] & (1ULL << i)))
+			continue;
+
+		err = wait ? inner->ops->wait(inner, slot) : inner->ops->query(inner, slot);
+		if (err == -EAGAIN)
+			continue;
+
+		stripe->used[slot] &= ~(1ULL << i);
+		if (err && !stripe->errs[slot])
+			stripe->errs[slot] = err;
+	}
+
+	if (stripe->used[slot])
+		return -EAGAIN;
+
+	err = stripe->errs[slot];
+	stripe->errs[slot] = 0;
+
+	return err;
+}
+
+static int transfer(struct stripe_backend *stripe, unsigned int slot, void *buf, unsigned long long offset,
+		size_t len, int write)
+{
+	int err;
+
+	while (len) {
+		unsigned int i;
+		unsigned long long inner_offset;
+		size_t part = map_range(stripe, offset, len, &i, &inner_offset);
+		struct backend *inner = &stripe->inners[i];
+
+		if (write)
+			err = inner->ops->write(inner, slot, buf, inner_offset, part);
+		else
+			err = inner->ops->read(inner, slot, buf, inner_offset, part);
+		if (err)
+			goto err_drain;
+		stripe->used[slot] |= 1ULL << i;
+
+		buf += part;
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+
+err_drain:
+	/* The slot isn't queried after a failed transfer, wait for the pieces issued and reset it */
+	finish_slot(stripe, slot, 1);
+
+	return err;
+}
+
+static int stripe_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	return transfer(backend->priv, slot, buf, offset, len, 0);
+}
+
+static int stripe_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	return transfer(backend->priv, slot, (void *)buf, offset, len, 1);
+}
+
+static int stripe_query(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 0);
+}
+
+static int stripe_wait(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 1);
+}
+
+/*
+ * The units of a range on each inner backend are contiguous there, zero or
+ * discard them with a single call per inner backend so that e.g. whole cuda
+ * chunks can be freed.
+ */
+static int clear_range(struct stripe_backend *stripe, unsigned long long offset, size_t len, int discard)
+{
+	unsigned long long start[MAX_INNERS], end[MAX_INNERS];
+	unsigned int i;
+	int err;
+
+	memset(end, 0, sizeof(end));
+
+	while (len) {
+		unsigned long long inner_offset;
+		size_t part = map_range(stripe, offset, len, &i, &inner_offset);
+
+		if (!end[i])
+			start[i] = inner_offset;
+		end[i] = inner_offset + part;
+
+		offset += part;
+		len -= part;
+	}
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+
+		if (!end[i])
+			continue;
+
+		if (discard)
+			err = inner->ops->discard(inner, start[i], end[i] - start[i]);
+		else
+			err = inner->ops->zero(inner, start[i], end[i] - start[i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int stripe_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	return clear_range(backend->priv, offset, len, 0);
+}
+
+static int stripe_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	return clear_range(backend->priv, offset, len, 1);
+}
+
+static int stripe_sync(struct backend *backend)
+{
+	unsigned int i;
+	int err = 0;
+	struct stripe_backend *stripe = backend->priv;
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+		int inner_err = inner->ops->sync(inner);
+
+		if (!err)
+			err = inner_err;
+	}
+
+	return err;
+}
+
+static int stripe_flush(struct backend *backend)
+{
+	unsigned int i;
+	int err = 0;
+	struct stripe_backend *stripe = backend->priv;
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+		int inner_err = inner->ops->flush ? inner->ops->flush(inner) : 0;
+
+		if (!err)
+			err = inner_err;
+	}
+
+	return err;
+}
+
+static void stripe_stats(struct backend *backend)
+{
+	unsigned int i;
+	struct stripe_backend *stripe = backend->priv;
+
+	pr_info("stripe: %u backends, %llu KB unit\n", stripe->nr_inners, stripe->unit >> 10);
+
+	for (i = 0; i < stripe->nr_inners; ++i) {
+		struct backend *inner = &stripe->inners[i];
+
+		if (inner->ops->stats)
+			inner->ops->stats(inner);
+	}
+}
+
+static void stripe_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	unsigned int i;
+	struct stripe_backend *stripe = backend->priv;
+
+	for (i = 0; i < stripe->nr_inners; ++i)
+		inner_metrics(&stripe->inners[i], out, id, i);
+}
+
+const struct backend_ops stripe_backend_ops = {
+	.name = "stripe",
+	.init = stripe_init,
+	.attach = stripe_attach,
+	.alloc = stripe_alloc,
+	.alloc_buffer = stripe_alloc_buffer,
+	.read = stripe_read,
+	.write = stripe_write,
+	.query = stripe_query,
+	.wait = stripe_wait,
+	.zero = stripe_zero,
+	.discard = stripe_discard,
+	.sync = stripe_sync,
+	.flush = stripe_flush,
+	.stats = stripe_stats,
+	.metrics = stripe_metrics,
+};
@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Tiering backend.
+ *
+ * The spec is tier:hotMB:hot_backend[:arg],cold_backend[:arg], e.g.
+ * tier:512:cuda,host. The pages are tracked in chunks, only hotMB of them
+ * live in the hot backend and the rest in the cold backend, which has room
+ * for all of them so that the capacity can be larger than the hot backend.
+ * Everything after the first comma is the cold spec, tiers can be chained,
+ * e.g. tier:512:cuda,tier:4096:host,file:/var/tmp/cudaram.
+ *
+ * A cold chunk accessed again is promoted by a migration thread, evicting a
+ * hot chunk not accessed since the clock hand last passed it if there is no
+ * free room. Each chunk keeps its place in the cold backend, so that hot
+ * chunks not written since being promoted are demoted without a copy.
+ *
+ * The transfers pin the chunks they use, which keeps them where they are
+ * while the transfers are in flight. The migrations don't block the
+ * transfers: they copy a chunk and only switch it to its new place if it
+ * wasn't written in the meantime.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "backend.h"
+#include "print.h"
+
+#define CHUNK_SHIFT 16 /* 64K chunks */
+#define NO_FRAME (~0U)
+#define NO_CHUNK (~0U)
+#define PROMOTE_QUEUE 64 /* chunks waiting for promotion, more are dropped until accessed again */
+
+#define USED_HOT  (1 << 0)
+#define USED_COLD (1 << 1)
+
+struct tier_chunk {
+	unsigned int frame; /* place in the hot backend, NO_FRAME if cold */
+	unsigned int in_flight; /* transfers using the chunk */
+	unsigned int writes; /* writes among them */
+	unsigned char referenced; /* accessed since the clock hand passed it, or since the last access if cold */
+	unsigned char dirty; /* the hot copy differs from the cold one */
+	unsigned char migrating;
+	unsigned char raced; /* written while migrating, the migration is abandoned */
+	unsigned char queued; /* in the promotion queue */
+};
+
+/* Chunks pinned by a transfer */
+struct tier_pin {
+	unsigned int first;
+	unsigned int last;
+	int write;
+};
+
+struct tier_slot {
+	unsigned int used; /* USED_* of the inner backends with transfers */
+	int err; /* first error of the inner backends done so far */
+	struct tier_pin *pins;
+	unsigned int nr_pins;
+	unsigned int max_pins;
+};
+
+struct tier_backend {
+	struct backend hot;
+	struct backend cold;
+	unsigned long long hot_size;
+	unsigned long long chunk_size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t promote_cond; /* wake up the migration thread */
+
+	struct tier_chunk *chunks;
+	unsigned int nr_chunks;
+	unsigned int *frames; /* chunk in each frame, NO_CHUNK if free */
+	unsigned int nr_frames;
+	unsigned int *free_frames;
+	unsigned int nr_free;
+	unsigned int hand; /* clock hand over the frames */
+
+	unsigned int promote[PROMOTE_QUEUE];
+	unsigned int promote_head;
+	unsigned int promote_tail;
+
+	struct tier_slot *slots;
+
+	pthread_t thread;
+	unsigned int slot; /* inner slot of the migration thread */
+	void *bounce; /* a chunk's worth of transfer buffer */
+
+	/* Counters, updated with the lock held */
+	unsigned long long hot_accesses;
+	unsigned long long cold_accesses;
+	unsigned long long promoted;
+	unsigned long long demoted;
+	unsigned long long copied; /* demoted dirty chunks */
+	unsigned long long raced;
+};
+
+/* Queue a cold chunk for promotion. Must be called with the lock held */
+static void queue_promotion(struct tier_backend *tier, unsigned int c)
+{
+	struct tier_chunk *chunk = &tier->chunks[c];
+
+	if (chunk->queued || chunk->migrating || tier->promote_tail - tier->promote_head == PROMOTE_QUEUE)
+		return;
+
+	chunk->queued = 1;
+	tier->promote[tier->promote_tail++ % PROMOTE_QUEUE] = c;
+	pthread_cond_signal(&tier->promote_cond);
+}
+
+/* Pin the chunks of a range, must be called with the lock held */
+static void pin_range(struct tier_backend *tier, unsigned int first, unsigned int last, int write)
+{
+	unsigned int c;
+
+	for (c = first; c <= last; ++c) {
+		struct tier_chunk *chunk = &tier->chunks[c];
+
+		++chunk->in_flight;
+		if (write) {
+			++chunk->writes;
+			if (chunk->migrating)
+				chunk->raced = 1;
+		}
+	}
+}
+
+/*
+ * Record the accesses of a transfer, must be called with the lock held.
+ *
+ * Cold chunks are promoted once accessed again, or right away while there is
+ * free room in the hot backend.
+ */
+static void access_range(struct tier_backend *tier, unsigned int first, unsigned int last, int write)
+{
+	unsigned int c;
+
+	for (c = first; c <= last; ++c) {
+		struct tier_chunk *chunk = &tier->chunks[c];
+
+		if (chunk->frame != NO_FRAME) {
+			if (write)
+				chunk->dirty = 1;
+			++tier->hot_accesses;
+		} else {
+			if (chunk->referenced || tier->nr_free)
+				queue_promotion(tier, c);
+			++tier->cold_accesses;
+		}
+
+		chunk->referenced = 1;
+	}
+}
+
+static void unpin_range(struct tier_backend *tier, unsigned int first, unsigned int last, int write)
+{
+	unsigned int c;
+
+	for (c = first; c <= last; ++c) {
+		--tier->chunks[c].in_flight;
+		if (write)
+			--tier->chunks[c].writes;
+	}
+}
+
+/* Copy len bytes between the backends through the bounce buffer on the migration slot */
+static int copy_range(struct tier_backend *tier, struct backend *from, unsigned long long from_offset,
+		struct backend *to, unsigned long long to_offset, size_t len)
+{
+	int err;
+
+	err = from->ops->read(from, tier->slot, tier->bounce, from_offset, len);
+	if (!err)
+		err = from->ops->wait(from, tier->slot);
+	if (err)
+		return err;
+
+	err = to->ops->write(to, tier->slot, tier->bounce, to_offset, len);
+	if (!err)
+		err = to->ops->wait(to, tier->slot);
+
+	return err;
+}
+
+/*
+ * Free a frame by demoting a hot chunk that wasn't accessed since the clock
+ * hand last passed it. Must be called with the lock held, which is dropped to
+ * copy the chunk if it's dirty. Returns the frame or NO_FRAME.
+ */
+static unsigned int evict_frame(struct tier_backend *tier)
+{
+	unsigned int i, c = NO_CHUNK, frame = NO_FRAME;
+	struct tier_chunk *chunk = NULL;
+	int err = 0;
+
+	for (i = 0; i < 2 * tier->nr_frames; ++i) {
+		frame = tier->hand;
+		tier->hand = (tier->hand + 1) % tier->nr_frames;
+
+		/* Free frames are all on the free list */
+		c = tier->frames[frame];
+		if (c == NO_CHUNK)
+			continue;
+
+		chunk = &tier->chunks[c];
+		if (chunk->migrating || chunk->in_flight)
+			continue;
+
+		if (chunk->referenced) {
+			chunk->referenced = 0;
+			continue;
+		}
+
+		break;
+	}
+
+	if (i == 2 * tier->nr_frames)
+		return NO_FRAME;
+
+	if (chunk->dirty) {
+		chunk->migrating = 1;
+		chunk->raced = 0;
+		pthread_mutex_unlock(&tier->lock);
+
+		err = copy_range(tier, &tier->hot, (unsigned long long)frame * tier->chunk_size,
+				&tier->cold, (unsigned long long)c * tier->chunk_size, tier->chunk_size);
+
+		pthread_mutex_lock(&tier->lock);
+		chunk->migrating = 0;
+		if (err)
+			pr_err("Demoting chunk %u failed (%d)\n", c, err);
+
+		/* Accessed in the meantime, keep it */
+		if (err || chunk->raced || chunk->in_flight) {
+			tier->raced += !err;
+			return NO_FRAME;
+		}
+		++tier->copied;
+	}
+
+	chunk->frame = NO_FRAME;
+	chunk->dirty = 0;
+	tier->frames[frame] = NO_CHUNK;
+	++tier->demoted;
+
+	return frame;
+}
+
+/* Copy a cold chunk to a hot frame and switch it over unless it was written meanwhile. Must be called with the lock held */
+static void promote_chunk(struct tier_backend *tier, unsigned int c)
+{
+	struct tier_chunk *chunk = &tier->chunks[c];
+	unsigned int frame;
+	int err;
+
+	/* The data of writes in flight might be missed */
+	if (chunk->frame != NO_FRAME || chunk->writes)
+		return;
+
+	if (tier->nr_free)
+		frame = tier->free_frames[--tier->nr_free];
+	else
+		frame = evict_frame(tier);
+
+	if (frame == NO_FRAME)
+		return;
+
+	/* Written to while the lock was dropped for eviction */
+	if (chunk->writes) {
+		tier->free_frames[tier->nr_free++] = frame;
+		return;
+	}
+
+	/* Reserve the frame, the clock skips migrating chunks */
+	tier->frames[frame] = c;
+	chunk->migrating = 1;
+	chunk->raced = 0;
+	pthread_mutex_unlock(&tier->lock);
+
+	err = copy_range(tier, &tier->cold, (unsigned long long)c * tier->chunk_size,
+			&tier->hot, (unsigned long long)frame * tier->chunk_size, tier->chunk_size);
+
+	pthread_mutex_lock(&tier->lock);
+	chunk->migrating = 0;
+	if (err)
+		pr_err("Promoting chunk %u failed (%d)\n", c, err);
+
+	if (err || chunk->raced) {
+		tier->raced += !err;
+		tier->frames[frame] = NO_CHUNK;
+		tier->free_frames[tier->nr_free++] = frame;
+		return;
+	}
+
+	/* Reads in flight keep using the cold copy, which stays valid until the chunk is demoted */
+	chunk->frame = frame;
+	chunk->dirty = 0;
+	chunk->referenced = 1;
+	++tier->promoted;
+}
+
+static void *migrate_thread(void *arg)
+{
+	struct tier_backend *tier = arg;
+
+	if (tier->hot.ops->attach && tier->hot.ops->attach(&tier->hot))
+		exit(EXIT_FAILURE);
+	if (tier->cold.ops->attach && tier->cold.ops->attach(&tier->cold))
+		exit(EXIT_FAILURE);
+
+	pthread_mutex_lock(&tier->lock);
+	while (1) {
+		unsigned int c;
+
+		if (tier->promote_head == tier->promote_tail) {
+			pthread_cond_wait(&tier->promote_cond, &tier->lock);
+			continue;
+		}
+
+		c = tier->promote[tier->promote_head++ % PROMOTE_QUEUE];
+		tier->chunks[c].queued = 0;
+		promote_chunk(tier, c);
+	}
+
+	return NULL;
+}
+
+static int tier_init(struct backend *backend, const char *arg, unsigned int slots)
+{
+	struct tier_backend *tier;
+	const char *spec = arg ? strchr(arg, ':') : NULL;
+	const char *cold_spec = spec ? strchr(spec, ',') : NULL;
+	char *hot_spec, *end;
+
+	if (!cold_spec) {
+		pr_err("The tier backend needs a size and two inner backends, tier:hotMB:hot_backend[:arg],cold_backend[:arg]\n");
+		return -1;
+	}
+
+	tier = calloc(1, sizeof(*tier));
+	if (!tier)
+		return -1;
+
+	tier->hot_size = strtoull(arg, &end, 10) << 20;
+	if (end != spec || !tier->hot_size) {
+		pr_err("Invalid hot tier size '%.*s'\n", (int)(spec - arg), arg);
+		goto err_free;
+	}
+
+	tier->chunk_size = 1ULL << CHUNK_SHIFT;
+
+	tier->slots = calloc(slots, sizeof(*tier->slots));
+	hot_spec = strndup(spec + 1, cold_spec - spec - 1);
+	if (!tier->slots || !hot_spec)
+		goto err_free_spec;
+
+	pthread_mutex_init(&tier->lock, NULL);
+	pthread_cond_init(&tier->promote_cond, NULL);
+
+	/* An extra inner slot for migrating */
+	tier->slot = slots;
+	if (setup_backend(&tier->hot, hot_spec, slots + 1) || setup_backend(&tier->cold, cold_spec + 1, slots + 1))
+		goto err_free_spec;
+	free(hot_spec);
+
+	backend->priv = tier;
+
+	return 0;
+
+err_free_spec:
+	free(hot_spec);
+	free(tier->slots);
+err_free:
+	free(tier);
+
+	return -1;
+}
+
+/* The cold backend holds every chunk, the hot one the chunks that fit in its size */
+static int tier_alloc(struct backend *backend, unsigned long long size)
+{
+	int err;
+	unsigned int i;
+	struct tier_backend *tier = backend->priv;
+
+	tier->nr_chunks = (size + tier->chunk_size - 1) >> CHUNK_SHIFT;
+	tier->nr_frames = tier->hot_size >> CHUNK_SHIFT;
+	if (!tier->nr_frames) {
+		pr_err("The hot tier needs at least a %llu KB chunk\n", tier->chunk_size >> 10);
+		return -1;
+	}
+
+	tier->chunks = calloc(tier->nr_chunks, sizeof(*tier->chunks));
+	tier->frames = malloc(tier->nr_frames * sizeof(*tier->frames));
+	tier->free_frames = malloc(tier->nr_frames * sizeof(*tier->free_frames));
+	if (!tier->chunks || !tier->frames || !tier->free_frames) {
+		pr_err("Allocating the tier tables failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < tier->nr_chunks; ++i)
+		tier->chunks[i].frame = NO_FRAME;
+
+	/* Hand out the low frames first */
+	for (i = 0; i < tier->nr_frames; ++i) {
+		tier->frames[i] = NO_CHUNK;
+		tier->free_frames[i] = tier->nr_frames - 1 - i;
+	}
+	tier->nr_free = tier->nr_frames;
+
+	if (tier->hot.ops->alloc(&tier->hot, (unsigned long long)tier->nr_frames << CHUNK_SHIFT))
+		return -1;
+
+	if (tier->cold.ops->alloc(&tier->cold, (unsigned long long)tier->nr_chunks << CHUNK_SHIFT))
+		return -1;
+
+	tier->bounce = tier->hot.ops->alloc_buffer(&tier->hot, tier->chunk_size);
+	if (!tier->bounce) {
+		pr_err("Allocating the migration buffer failed\n");
+		return -1;
+	}
+
+	err = pthread_create(&tier->thread, NULL, migrate_thread, tier);
+	if (err) {
+		pr_err("Creating the migration thread failed (%s)\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tier_attach(struct backend *backend)
+{
+	struct tier_backend *tier = backend->priv;
+
+	if (tier->hot.ops->attach && tier->hot.ops->attach(&tier->hot))
+		return -1;
+
+	return tier->cold.ops->attach ? tier->cold.ops->attach(&tier->cold) : 0;
+}
+
+/* The buffers are used with both inner backends, e.g. pinned memory of the hot cuda backend */
+static void *tier_alloc_buffer(struct backend *backend, size_t size)
+{
+	struct tier_backend *tier = backend->priv;
+
+	return tier->hot.ops->alloc_buffer(&tier->hot, size);
+}
+
+/* Report the slot done once both inner backends are, unpinning its chunks */
+static int finish_slot(struct tier_backend *tier, unsigned int slot, int wait)
+{
+	struct tier_slot *s = &tier->slots[slot];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < 2; ++i) {
+		struct backend *inner = i ? &tier->cold : &tier->hot;
+
+		if (!(s->used & (1 << i)))
+			continue;
+
+		err = wait ? inner->ops->wait(inner, slot) : inner->ops->query(inner, slot);
+		if (err == -EAGAIN)
+			continue;
+
+		s->used &= ~(1 << i);
+		if (err && !s->err)
+			s->err = err;
+	}
+
+	if (s->used)
+		return -EAGAIN;
+
+	pthread_mutex_lock(&tier->lock);
+	for (i = 0; i < s->nr_pins; ++i)
+		unpin_range(tier, s->pins[i].first, s->pins[i].last, s->pins[i].write);
+	pthread_mutex_unlock(&tier->lock);
+	s->nr_pins = 0;
+
+	err = s->err;
+	s->err = 0;
+
+	return err;
+}
+
+static int record_pin(struct tier_slot *slot, unsigned int first, unsigned int last, int write)
+{
+	if (slot->nr_pins == slot->max_pins) {
+		unsigned int max = slot->max_pins ? 2 * slot->max_pins : 4;
+		struct tier_pin *pins = realloc(slot->pins, max * sizeof(*pins));
+
+		if (!pins)
+			return -ENOMEM;
+		slot->pins = pins;
+		slot->max_pins = max;
+	}
+
+	slot->pins[slot->nr_pins].first = first;
+	slot->pins[slot->nr_pins].last = last;
+	slot->pins[slot->nr_pins].write = write;
+	++slot->nr_pins;
+
+	return 0;
+}
+
+/* Pin the chunks and issue a transfer for each chunk to the backend it's in */
+static int transfer(struct tier_backend *tier, unsigned int slot, void *buf, unsigned long long offset,
+		size_t len, int write)
+{
+	unsigned int first = offset >> CHUNK_SHIFT;
+	unsigned int last = (offset + len - 1) >> CHUNK_SHIFT;
+	int err;
+
+	err = record_pin(&tier->slots[slot], first, last, write);
+	if (err)
+		goto err_drain;
+
+	pthread_mutex_lock(&tier->lock);
+	pin_range(tier, first, last, write);
+	access_range(tier, first, last, write);
+	pthread_mutex_unlock(&tier->lock);
+
+	while (len) {
+		unsigned int frame = ACCESS_ONCE(tier->chunks[offset >> CHUNK_SHIFT].frame);
+		unsigned long long in_chunk = offset & (tier->chunk_size - 1);
+		size_t part = tier->chunk_size - in_chunk;
+		struct backend *inner = &tier->cold;
+		unsigned long long inner_offset = offset;
+
+		if (part > len)
+			part = len;
+
+		if (frame != NO_FRAME) {
+			inner = &tier->hot;
+			inner_offset = ((unsigned long long)frame << CHUNK_SHIFT) + in_chunk;
+		}
+
+		if (write)
+			err = inner->ops->write(inner, slot, buf, inner_offset, part);
+		else
+			err = inner->ops->read(inner, slot, buf, inner_offset, part);
+		if (err)
+			goto err_drain;
+		tier->slots[slot].used |= inner == &tier->hot ? USED_HOT : USED_COLD;
+
+		buf += part;
+		offset += part;
+		len -= part;
+	}
+
+	return 0;
+
+err_drain:
+	/* The slot isn't queried after a failed transfer, wait for the ones issued and unpin */
+	finish_slot(tier, slot, 1);
+
+	return err;
+}
+
+static int tier_read(struct backend *backend, unsigned int slot, void *buf, unsigned long long offset, size_t len)
+{
+	return transfer(backend->priv, slot, buf, offset, len, 0);
+}
+
+static int tier_write(struct backend *backend, unsigned int slot, const void *buf, unsigned long long offset, size_t len)
+{
+	return transfer(backend->priv, slot, (void *)buf, offset, len, 1);
+}
+
+static int tier_query(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 0);
+}
+
+static int tier_wait(struct backend *backend, unsigned int slot)
+{
+	return finish_slot(backend->priv, slot, 1);
+}
+
+/*
+ * Zero or discard a range in the cold backend and the parts of it that are
+ * hot, both copies of clean chunks stay the same. The chunks are pinned as
+ * written so that they aren't migrated meanwhile.
+ */
+static int clear_range(struct tier_backend *tier, unsigned long long offset, size_t len, int discard)
+{
+	unsigned int first = offset >> CHUNK_SHIFT;
+	unsigned int last = (offset + len - 1) >> CHUNK_SHIFT;
+	struct backend *hot = &tier->hot, *cold = &tier->cold;
+	unsigned long long end = offset + len;
+	int err;
+
+	pthread_mutex_lock(&tier->lock);
+	pin_range(tier, first, last, 1);
+	pthread_mutex_unlock(&tier->lock);
+
+	if (discard)
+		err = cold->ops->discard(cold, offset, len);
+	else
+		err = cold->ops->zero(cold, offset, len);
+
+	while (!err && offset < end) {
+		unsigned int frame = ACCESS_ONCE(tier->chunks[offset >> CHUNK_SHIFT].frame);
+		unsigned long long in_chunk = offset & (tier->chunk_size - 1);
+		size_t part = tier->chunk_size - in_chunk;
+		unsigned long long hot_offset = ((unsigned long long)frame << CHUNK_SHIFT) + in_chunk;
+
+		if (part > end - offset)
+			part = end - offset;
+
+		if (frame != NO_FRAME) {
+			if (discard)
+				err = hot->ops->discard(hot, hot_offset, part);
+			else
+				err = hot->ops->zero(hot, hot_offset, part);
+		}
+
+		offset += part;
+	}
+
+	pthread_mutex_lock(&tier->lock);
+	unpin_range(tier, first, last, 1);
+	pthread_mutex_unlock(&tier->lock);
+
+	return err;
+}
+
+static int tier_zero(struct backend *backend, unsigned long long offset, size_t len)
+{
+	return clear_range(backend->priv, offset, len, 0);
+}
+
+static int tier_discard(struct backend *backend, unsigned long long offset, size_t len)
+{
+	return clear_range(backend->priv, offset, len, 1);
+}
+
+static int tier_sync(struct backend *backend)
+{
+	struct tier_backend *tier = backend->priv;
+	int err = tier->hot.ops->sync(&tier->hot);
+	int cold_err = tier->cold.ops->sync(&tier->cold);
+
+	return err ? err : cold_err;
+}
+
+static int tier_flush(struct backend *backend)
+{
+	struct tier_backend *tier = backend->priv;
+	int err = tier->hot.ops->flush ? tier->hot.ops->flush(&tier->hot) : 0;
+	int cold_err = tier->cold.ops->flush ? tier->cold.ops->flush(&tier->cold) : 0;
+
+	return err ? err : cold_err;
+}
+
+static void tier_stats(struct backend *backend)
+{
+	struct tier_backend *tier = backend->priv;
+
+	pthread_mutex_lock(&tier->lock);
+	pr_info("tier: %u of %u chunks hot, %llu hot and %llu cold accesses, %llu promoted, "
+			"%llu demoted (%llu copied), %llu migrations raced with writes\n",
+			tier->nr_frames - tier->nr_free, tier->nr_chunks, tier->hot_accesses, tier->cold_accesses,
+			tier->promoted, tier->demoted, tier->copied, tier->raced);
+	pthread_mutex_unlock(&tier->lock);
+
+	if (tier->hot.ops->stats)
+		tier->hot.ops->stats(&tier->hot);
+	if (tier->cold.ops->stats)
+		tier->cold.ops->stats(&tier->cold);
+}
+
+static void tier_metrics(struct backend *backend, FILE *out, const char *id)
+{
+	struct tier_backend *tier = backend->priv;
+
+	pthread_mutex_lock(&tier->lock);
+	print_metric(out, "tier_hot_chunks", id, tier->nr_frames - tier->nr_free);
+	print_metric(out, "tier_chunks", id, tier->nr_chunks);
+	print_metric(out, "tier_hot_accesses_total", id, tier->hot_accesses);
+	print_metric(out, "tier_cold_accesses_total", id, tier->cold_accesses);
+	print_metric(out, "tier_promoted_total", id, tier->promoted);
+	print_metric(out, "tier_demoted_total", id, tier->demoted);
+	print_metric(out, "tier_copied_total", id, tier->copied);
+	print_metric(out, "tier_raced_total", id, tier->raced);
+	pthread_mutex_unlock(&tier->lock);
+
+	inner_metrics(&tier->hot, out, id, 0);
+	inner_metrics(&tier->cold, out, id, 1);
+}
+
+const struct backend_ops tier_backend_ops = {
+	.name = "tier",
+	.init = tier_init,
+	.attach = tier_attach,
+	.alloc = tier_alloc,
+	.alloc_buffer = tier_alloc_buffer,
+	.read = tier_read,
+	.write = tier_write,
+	.query = tier_query,
+	.wait = tier_wait,
+	.zero = tier_zero,
+	.discard = tier_discard,
+	.sync = tier_sync,
+	.flush = tier_flush,
+	.stats = tier_stats,
+	.metrics = tier_metrics,
+};
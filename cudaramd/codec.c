@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+#ifdef HAVE_LZ4
+static size_t lz4_compress(const void *src, size_t size, void *dst, size_t dst_size)
+{
+	return LZ4_compress_default(src, dst, size, dst_size);
+}
+
+static int lz4_decompress(const void *src, size_t src_size, void *dst, size_t size)
+{
+	return LZ4_decompress_safe(src, dst, src_size, size) == size ? 0 : -1;
+}
+
+static const struct codec lz4_codec = {
+	.name = "lz4",
+	.compress = lz4_compress,
+	.decompress = lz4_decompress,
+};
+#endif
+
+#ifdef HAVE_ZSTD
+/* Negative levels trade ratio for speed */
+#define ZSTD_FAST_LEVEL -1
+
+/* The contexts are reused by each thread */
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+
+static size_t zstd_compress(const void *src, size_t size, void *dst, size_t dst_size)
+{
+	size_t ret;
+
+	if (!zstd_cctx && !(zstd_cctx = ZSTD_createCCtx()))
+		return 0;
+
+	ret = ZSTD_compressCCtx(zstd_cctx, dst, dst_size, src, size, ZSTD_FAST_LEVEL);
+
+	return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static int zstd_decompress(const void *src, size_t src_size, void *dst, size_t size)
+{
+	if (!zstd_dctx && !(zstd_dctx = ZSTD_createDCtx()))
+		return -1;
+
+	return ZSTD_decompressDCtx(zstd_dctx, dst, size, src, src_size) == size ? 0 : -1;
+}
+
+static const struct codec zstd_fast_codec = {
+	.name = "zstd-fast",
+	.compress = zstd_compress,
+	.decompress = zstd_decompress,
+};
+#endif
+
+static const struct codec *codecs[] = {
+#ifdef HAVE_LZ4
+	&lz4_codec,
+#endif
+#ifdef HAVE_ZSTD
+	&zstd_fast_codec,
+#endif
+};
+
+const struct codec *find_codec(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); ++i) {
+		if (strlen(codecs[i]->name) == len && !strncmp(codecs[i]->name, name, len))
+			return codecs[i];
+	}
+
+	return NULL;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#ifndef _CUDARAMD_CODEC_H_
+#define _CUDARAMD_CODEC_H_
+
+#include <stddef.h>
+
+/* Page compression codec, the operations can be called from any thread */
+struct codec {
+	const char *name;
+	/* Returns the compressed size, 0 if it doesn't fit in dst_size */
+	size_t (*compress)(const void *src, size_t size, void *dst, size_t dst_size);
+	/* Returns 0 if src decompressed to exactly size bytes */
+	int (*decompress)(const void *src, size_t src_size, void *dst, size_t size);
+};
+
+/* Find a codec by the first len characters of name */
+extern const struct codec *find_codec(const char *name, size_t len);
+
+#endif /* _CUDARAMD_CODEC_H_ */
@@ -2,11 +2,19 @@
  * Copyright (C) 2011 Piotr Jaroszyński
  */
 
+#define _GNU_SOURCE /* for CPU affinity */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
@@ -15,49 +23,180 @@
 #include <linux/fs.h>
 #include <linux/types.h>
 
-#include <cuda.h>
-
 #include "../kmod/cudaram.h" /* for ioctl */
+#include "backend.h"
+#include "metrics.h"
 #include "print.h"
+#include "samefill.h"
+#include "trace.h"
 
 #define MB_SHIFT 20
 #define DEFAULT_BUFFER_SIZE 1
+#define DEFAULT_QUEUE_DEPTH 16
+#define DEFAULT_CHANNELS 1
+#define MAX_DEVICES 32
+#define IDLE_AVG_SHIFT 3 /* weight of a new idle period in the average, 1/8 */
+#ifdef HAVE_CUDA
+#define DEFAULT_BACKEND "cuda"
+#else
+#define DEFAULT_BACKEND "host"
+#endif
 
 static long PAGE_SIZE;
 
+static struct trace_header *trace_file; /* NULL if not tracing */
+static char *trace_dump_path; /* where SIGUSR2 dumps a snapshot of the trace */
+
+/*
+ * Stopping on SIGINT and SIGTERM. The workers stop taking new work, finish
+ * the works in flight and park before the backend is flushed for the last
+ * time, the works left in the SQs are failed by the kernel once we exit.
+ */
+static volatile int stopping;
+static int stop_pipe[2]; /* readable once stopping, wakes up the sleeping workers */
+static unsigned int total_workers, nr_stopped;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *dir_names[] = {
+	[CUDARAM_READ] = "read",
+	[CUDARAM_WRITE] = "write",
+	[CUDARAM_DISCARD] = "discard",
+	[CUDARAM_FLUSH] = "flush",
+};
+
+/* State of a tag in the daemon */
+struct slot {
+	int busy;
+	int fua; /* flush the backend before completing */
+	unsigned long long seq; /* submission order, the oldest slot is waited for first */
+	unsigned int dir;
+	unsigned long long start; /* submission time in ns */
+};
+
+struct cudaram_dev;
+struct worker;
+
+/* A channel of a device has its own rings, slots and part of the device's buffer */
+struct channel {
+	struct cudaram_dev *cudaram;
+	struct worker *worker; /* thread serving the channel */
+	unsigned int id;
+	int fd; /* channel fd, polled for new work */
+
+	struct cudaram_ring *ring; /* SQ/CQ shared with the kernel */
+	struct cudaram_work *sq;
+	struct cudaram_completion *cq;
+	void *buf; /* the channel's part of the buffer */
+	void *window; /* read-only data window with the written bio pages, if zero-copy */
+
+	struct slot *slots; /* indexed by tag */
+	unsigned int first_slot; /* first backend slot used by the channel */
+	unsigned int busy; /* number of busy slots */
+};
+
+/*
+ * All the devices share the backend, each has its own range of its pages and
+ * slots, and the buffer, each has its own part of it.
+ */
 struct cudaram_dev {
 	int fd;
 	int id;
-	CUdeviceptr data;
+	struct backend *backend;
+	unsigned long long first_page; /* first backend page of the device */
 	void *buf;
+	struct same_table *same; /* same-filled backend pages, NULL if not elided */
+
+	unsigned int queue_depth; /* per channel */
+	unsigned int nr_channels;
+	struct channel *channels;
 };
 
-int init_cuda(struct cudaram_dev *cudaram)
+/*
+ * A thread serving the same channel of all the devices.
+ *
+ * The channels are kicked in turns starting from a different one each round
+ * so that a busy device doesn't starve the others, and polled when none of
+ * them has work in flight. With a spin budget the pending flags of the rings
+ * are busy-polled for a while before falling back to poll.
+ */
+struct worker {
+	unsigned int id;
+	pthread_t thread;
+	int cpu; /* CPU the thread is bound to, -1 if any */
+	struct channel **channels;
+	struct pollfd *fds; /* the channel fds, in the order of channels, and the stop pipe */
+	unsigned int nr_channels;
+	unsigned int next; /* channel kicked first in the next round */
+	unsigned long long seq; /* submission order across the channels */
+
+	unsigned long long spin_budget; /* longest busy-poll in ns, 0 to always sleep */
+	unsigned long long idle_avg; /* moving average of the idle periods in ns */
+
+	struct thread_stats stats;
+	struct trace_ring *trace; /* NULL if not tracing */
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Map the SQ/CQ rings and the data window of a channel of an activated device */
+int map_channel(struct cudaram_dev *cudaram, struct channel *channel)
 {
-	CUdevice cuDevice;
-	int deviceCount;
+	unsigned int size;
+	off_t offset;
+	struct cudaram_ring *ring;
 
-	cuInit(0);
-	cuDeviceGetCount(&deviceCount);
-	if (deviceCount == 0) {
-		pr_err("There is no device supporting CUDA.\n");
+	/* Map the first header to learn the layout */
+	ring = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, cudaram->fd, 0);
+	if (ring == MAP_FAILED) {
+		pr_err("Mapping the ring header failed (%s)\n", strerror(errno));
 		return -1;
 	}
+	size = ring->size;
+	offset = (off_t)channel->id * ring->channel_size;
+	munmap(ring, PAGE_SIZE);
 
-	cuDeviceGet(&cuDevice, 0);
-	CUcontext cuContext;
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cudaram->fd, offset);
+	if (ring == MAP_FAILED) {
+		pr_err("Mapping the rings of channel %u failed (%s)\n", channel->id, strerror(errno));
+		return -1;
+	}
 
-	if (cuCtxCreate(&cuContext, CU_CTX_MAP_HOST, cuDevice) != CUDA_SUCCESS) {
-		pr_err("Failed to created the cuda context\n");
+	channel->fd = ioctl(cudaram->fd, CUDARAM_CHANNEL_FD, channel->id);
+	if (channel->fd < 0) {
+		pr_err("Opening the fd of channel %u failed (%s)\n", channel->id, strerror(errno));
 		return -1;
 	}
 
+	channel->ring = ring;
+	channel->sq = (void *)ring + ring->sq_offset;
+	channel->cq = (void *)ring + ring->cq_offset;
+	channel->buf = cudaram->buf + ring->buffer_offset * PAGE_SIZE;
+
+	if (ring->window_offset) {
+		channel->window = mmap(NULL, ring->window_size, PROT_READ, MAP_SHARED, cudaram->fd, offset + ring->window_offset);
+		if (channel->window == MAP_FAILED) {
+			pr_err("Mapping the data window of channel %u failed (%s)\n", channel->id, strerror(errno));
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
-int init_device(struct cudaram_dev *cudaram, int id, int capacity, int buffer_size)
+/* The backend, its pages, the buffer and the same table are set up by the caller */
+int init_device(struct cudaram_dev *cudaram, int id, int capacity, int buffer_size, unsigned int queue_depth,
+		unsigned int nr_channels, unsigned int flags, unsigned int first_slot)
 {
 	int err;
+	unsigned int i;
 	char path[32];
 	struct cudaram_params params;
 
@@ -73,78 +212,735 @@ int init_device(struct cudaram_dev *cudaram, int id, int capacity, int buffer_si
 		return -1;
 	}
 
-	if (cuMemAlloc(&cudaram->data, capacity << MB_SHIFT) != CUDA_SUCCESS) {
-		pr_err("Allocating cuda data failed\n");
+	cudaram->queue_depth = queue_depth;
+	cudaram->nr_channels = nr_channels;
+	cudaram->channels = calloc(nr_channels, sizeof(*cudaram->channels));
+	if (!cudaram->channels) {
+		pr_err("Allocating channels failed\n");
 		goto err_close;
 	}
-	cuMemsetD32(cudaram->data, 0, capacity << (MB_SHIFT - 2));
 
-	if (cuMemAllocHost(&cudaram->buf, buffer_size << MB_SHIFT) != CUDA_SUCCESS) {
-		pr_err("Allocating cuda buffer failed\n");
-		goto err_free_data;
+	for (i = 0; i < nr_channels; ++i) {
+		struct channel *channel = &cudaram->channels[i];
+
+		channel->cudaram = cudaram;
+		channel->id = i;
+		channel->first_slot = first_slot + i * queue_depth;
+		channel->slots = calloc(queue_depth, sizeof(*channel->slots));
+		if (!channel->slots) {
+			pr_err("Allocating slots failed\n");
+			goto err_free_channels;
+		}
 	}
 
 	params.capacity = capacity;
 	params.buffer = (__u64)cudaram->buf;
 	params.buffer_size = buffer_size;
+	params.queue_depth = queue_depth;
+	params.flags = flags;
+	params.channels = nr_channels;
 
-	err = mlockall(MCL_FUTURE);
+	err = ioctl(cudaram->fd, CUDARAM_ACTIVATE, &params);
 	if (err) {
-		pr_err("Locking the memory failed (%s)\n", strerror(errno));
-		goto err_free_buf;
+		pr_err("Activating the device %d failed (%s)\n", id, strerror(errno));
+		goto err_free_channels;
 	}
 
-	err = ioctl(cudaram->fd, CUDARAM_ACTIVATE, &params);
-	if (err) {
-		pr_err("Activating the device failed (%s)\n", strerror(errno));
-		goto err_free_buf;
+	for (i = 0; i < nr_channels; ++i) {
+		if (map_channel(cudaram, &cudaram->channels[i]))
+			goto err_free_channels;
 	}
 
 	return 0;
 
-err_free_buf:
-	cuMemFreeHost(cudaram->buf);
-err_free_data:
-	cuMemFree(cudaram->data);
+err_free_channels:
+	for (i = 0; i < nr_channels; ++i)
+		free(cudaram->channels[i].slots);
+	free(cudaram->channels);
 err_close:
 	close(cudaram->fd);
 
 	return -1;
 }
 
-int work(struct cudaram_dev *cudaram)
+/* Post a completion for a tag */
+static void complete(struct channel *channel, unsigned int tag, int error)
+{
+	struct cudaram_completion *comp = &channel->cq[channel->ring->cq_tail & (channel->cudaram->queue_depth - 1)];
+
+	if (channel->worker->trace)
+		trace(channel->worker->trace, now_ns(), TRACE_COMPLETE, channel->cudaram->id, tag, 0, 0, 0, error);
+
+	comp->id = tag;
+	comp->error = error;
+
+	/* Make the completion visible before the tail */
+	__sync_synchronize();
+	++channel->ring->cq_tail;
+}
+
+/* Discarded pages read back as zeros, record them as zero-filled if pages are elided */
+static int discard(struct cudaram_dev *cudaram, struct cudaram_work *work)
+{
+	unsigned int i;
+	struct backend *backend = cudaram->backend;
+	unsigned long long first_page = cudaram->first_page + work->first_page;
+
+	if (cudaram->same) {
+		for (i = 0; i < work->len; ++i)
+			same_set(cudaram->same, first_page + i, 0);
+	}
+
+	return backend->ops->discard(backend, first_page * PAGE_SIZE, (size_t)work->len * PAGE_SIZE);
+}
+
+/* Only backends holding written data in a volatile cache need flushing, that of all the devices */
+static int flush(struct cudaram_dev *cudaram)
+{
+	struct backend *backend = cudaram->backend;
+
+	if (!backend->ops->flush)
+		return 0;
+
+	return backend->ops->flush(backend) ? -EIO : 0;
+}
+
+/* Issue a transfer for len pages of a work starting at its page start */
+static int transfer(struct channel *channel, struct cudaram_work *work, void *buf, unsigned int start, unsigned int len)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct backend *backend = cudaram->backend;
+	unsigned int slot = channel->first_slot + work->id;
+	unsigned long long offset = (cudaram->first_page + work->first_page + start) * PAGE_SIZE;
+
+	buf += start * PAGE_SIZE;
+	stats_transfer(&channel->worker->stats, work->dir, (size_t)len * PAGE_SIZE);
+
+	if (work->dir == CUDARAM_READ)
+		return backend->ops->read(backend, slot, buf, offset, len * PAGE_SIZE);
+	else
+		return backend->ops->write(backend, slot, buf, offset, len * PAGE_SIZE);
+}
+
+/*
+ * Whether a page of a work is same-filled and needs no transfer.
+ *
+ * Written pages are scanned and recorded in the table, read pages that are
+ * in the table are filled in right away.
+ */
+static int elide_page(struct cudaram_dev *cudaram, struct cudaram_work *work, void *buf, unsigned int i)
+{
+	struct same_table *same = cudaram->same;
+	unsigned long long page = cudaram->first_page + work->first_page + i;
+	uint32_t value;
+
+	buf += i * PAGE_SIZE;
+
+	if (work->dir == CUDARAM_READ) {
+		if (!same_get(same, page, &value))
+			return 0;
+		same_fill(buf, PAGE_SIZE, value);
+		return 1;
+	}
+
+	if (same_filled(buf, PAGE_SIZE, &value)) {
+		same_set(same, page, value);
+		return 1;
+	}
+
+	same_clear(same, page);
+	return 0;
+}
+
+/*
+ * Issue the transfers of a work, a transfer for each run of pages that are
+ * not same-filled. Returns the number of transfers issued or a negative errno.
+ */
+static int submit_pages(struct channel *channel, struct cudaram_work *work, void *buf)
+{
+	int err, issued = 0;
+	unsigned int i, start;
+	struct cudaram_dev *cudaram = channel->cudaram;
+
+	if (!cudaram->same) {
+		err = transfer(channel, work, buf, 0, work->len);
+		return err ? err : 1;
+	}
+
+	for (i = 0, start = 0; i <= work->len; ++i) {
+		if (i < work->len && !elide_page(cudaram, work, buf, i))
+			continue;
+		if (i < work->len)
+			++channel->worker->stats.elided_pages[work->dir];
+
+		if (start < i) {
+			err = transfer(channel, work, buf, start, i - start);
+			if (err)
+				goto err_wait;
+			++issued;
+		}
+		start = i + 1;
+	}
+
+	return issued;
+
+err_wait:
+	/* The work completes right away, the buffer must not be in use by the transfers issued so far */
+	if (issued)
+		cudaram->backend->ops->wait(cudaram->backend, channel->first_slot + work->id);
+
+	return err;
+}
+
+/* Issue the transfers for all the new work in the SQ, returns the number of entries consumed */
+static unsigned int submit_work(struct channel *channel)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct thread_stats *stats = &channel->worker->stats;
+	struct cudaram_ring *ring = channel->ring;
+	unsigned int head = ring->sq_head;
+	unsigned int tail = ACCESS_ONCE(ring->sq_tail);
+	unsigned int submitted = tail - head;
+
+	/* Read the entries only after reading the tail */
+	__sync_synchronize();
+
+	for (; head != tail; ++head) {
+		struct cudaram_work *work = &channel->sq[head & (cudaram->queue_depth - 1)];
+		unsigned int tag = work->id;
+		void *buf = (work->flags & CUDARAM_WORK_MAPPED ? channel->window : channel->buf) + work->offset * PAGE_SIZE;
+		unsigned long long start = now_ns();
+		int err;
+
+		pr_debug("work %u:%u %s len %u first_page %u\n", channel->id, tag,
+				dir_names[work->dir], work->len, work->first_page);
+
+		if (tag >= cudaram->queue_depth || channel->slots[tag].busy) {
+			pr_err("Bad work id %u\n", tag);
+			continue;
+		}
+
+		trace(channel->worker->trace, start, TRACE_SUBMIT, cudaram->id, tag, work->dir, work->first_page,
+				work->len, 0);
+
+		/* Discards are synchronous and complete right away */
+		if (work->dir == CUDARAM_DISCARD) {
+			complete(channel, tag, discard(cudaram, work) ? -EIO : 0);
+			stats_work(stats, work->dir, now_ns() - start);
+			continue;
+		}
+
+		/* So are flushes */
+		if (work->dir == CUDARAM_FLUSH) {
+			complete(channel, tag, flush(cudaram));
+			stats_work(stats, work->dir, now_ns() - start);
+			continue;
+		}
+
+		/* Complete right away if all the pages were elided */
+		err = submit_pages(channel, work, buf);
+		if (err <= 0) {
+			if (!err && (work->flags & CUDARAM_WORK_FUA))
+				err = flush(cudaram);
+			complete(channel, tag, err);
+			stats_work(stats, work->dir, now_ns() - start);
+			continue;
+		}
+
+		channel->slots[tag].busy = 1;
+		channel->slots[tag].dir = work->dir;
+		channel->slots[tag].start = start;
+		channel->slots[tag].fua = !!(work->flags & CUDARAM_WORK_FUA);
+		channel->slots[tag].seq = channel->worker->seq++;
+		++channel->busy;
+	}
+
+	ring->sq_head = head;
+
+	return submitted;
+}
+
+static void complete_slot(struct channel *channel, unsigned int tag, int err)
+{
+	struct slot *slot = &channel->slots[tag];
+
+	if (!err && slot->fua)
+		err = flush(channel->cudaram);
+
+	slot->busy = 0;
+	--channel->busy;
+	complete(channel, tag, err);
+	stats_work(&channel->worker->stats, slot->dir, now_ns() - slot->start);
+}
+
+/* Post completions for all finished transfers, in any order, returns the number of completions */
+static unsigned int reap_work(struct channel *channel)
+{
+	unsigned int tag, reaped = 0;
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct backend *backend = cudaram->backend;
+
+	for (tag = 0; tag < cudaram->queue_depth && channel->busy; ++tag) {
+		int err;
+
+		if (!channel->slots[tag].busy)
+			continue;
+
+		err = backend->ops->query(backend, channel->first_slot + tag);
+		if (err == -EAGAIN)
+			continue;
+
+		complete_slot(channel, tag, err);
+		++reaped;
+	}
+
+	return reaped;
+}
+
+/* Wait for the oldest transfer of all the channels to finish */
+static void wait_work(struct worker *worker)
+{
+	unsigned int i, tag, oldest_tag = 0;
+	struct channel *oldest = NULL;
+	struct backend *backend;
+	unsigned long long start, end;
+	int err;
+
+	for (i = 0; i < worker->nr_channels; ++i) {
+		struct channel *channel = worker->channels[i];
+
+		for (tag = 0; tag < channel->cudaram->queue_depth; ++tag) {
+			if (channel->slots[tag].busy && (!oldest ||
+			    channel->slots[tag].seq < oldest->slots[oldest_tag].seq)) {
+				oldest = channel;
+				oldest_tag = tag;
+			}
+		}
+	}
+
+	if (!oldest)
+		return;
+
+	backend = oldest->cudaram->backend;
+	start = now_ns();
+	err = backend->ops->wait(backend, oldest->first_slot + oldest_tag);
+	end = now_ns();
+	worker->stats.wait_ns += end - start;
+	trace_span(worker->trace, start, end, TRACE_WAIT);
+	complete_slot(oldest, oldest_tag, err);
+}
+
+/*
+ * Busy-poll the pending flags of the channels, returns whether new work showed up.
+ *
+ * Spins for twice the average idle period, up to the budget. If the average
+ * is over the budget new work is unlikely to show up in time and the worker
+ * goes to sleep right away, until the idle periods get shorter.
+ */
+static int spin_work(struct worker *worker, unsigned long long idle_start)
+{
+	unsigned int i;
+	unsigned long long limit = 2 * worker->idle_avg;
+
+	if (!worker->spin_budget || worker->idle_avg > worker->spin_budget)
+		return 0;
+
+	if (limit > worker->spin_budget)
+		limit = worker->spin_budget;
+
+	do {
+		for (i = 0; i < worker->nr_channels; ++i) {
+			if (ACCESS_ONCE(worker->channels[i]->ring->pending))
+				return 1;
+		}
+		if (ACCESS_ONCE(stopping))
+			return 1;
+	} while (now_ns() - idle_start < limit);
+
+	return 0;
+}
+
+/* Wait for new work, busy-polling first if it's likely to show up soon */
+static int idle_work(struct worker *worker)
 {
 	int err;
-	struct cudaram_work work;
-	work.id = 0;
+	unsigned long long idle_start = now_ns(), idle_end, idle;
+
+	if (!spin_work(worker, idle_start)) {
+		err = poll(worker->fds, worker->nr_channels + 1, -1);
+		if (err < 0 && errno != EINTR) {
+			pr_err("Polling the channels failed (%s)\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	idle_end = now_ns();
+	idle = idle_end - idle_start;
+	worker->stats.idle_ns += idle;
+	trace_span(worker->trace, idle_start, idle_end, TRACE_IDLE);
+
+	/* Long sleeps count as a few budgets so that spinning resumes soon once the load picks up */
+	if (worker->spin_budget) {
+		if (idle > 4 * worker->spin_budget)
+			idle = 4 * worker->spin_budget;
+		worker->idle_avg += ((long long)idle - (long long)worker->idle_avg) >> IDLE_AVG_SHIFT;
+	}
+
+	return 0;
+}
+
+/* Report the worker done with its works in flight and park it until the daemon exits */
+static void stop_worker(struct worker *worker)
+{
+	pthread_mutex_lock(&stop_lock);
+	++nr_stopped;
+	pthread_cond_signal(&stop_cond);
+	pthread_mutex_unlock(&stop_lock);
+
+	while (1)
+		pause();
+}
+
+int work(struct worker *worker)
+{
+	int err;
+
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err) {
+			pr_err("Binding thread %u to CPU %d failed (%s)\n", worker->id, worker->cpu, strerror(err));
+			return 1;
+		}
+	}
 
 	while (1) {
-		err = ioctl(cudaram->fd, CUDARAM_WORK, &work);
+		unsigned int i, submitted = 0, reaped = 0, busy = 0;
+
+		for (i = 0; i < worker->nr_channels; ++i) {
+			struct channel *channel = worker->channels[(worker->next + i) % worker->nr_channels];
+			unsigned long long start, end;
+
+			/* Bios queued from now on set it again, the kick below picks up the ones before */
+			if (worker->spin_budget && channel->ring->pending)
+				channel->ring->pending = 0;
+
+			/* Never blocks on a channel fd */
+			start = now_ns();
+			err = ioctl(channel->fd, CUDARAM_KICK, 0);
+			end = now_ns();
+			worker->stats.kick_ns += end - start;
+			trace_span(worker->trace, start, end, TRACE_KICK);
+			if (err) {
+				pr_err("ioctl(%d, CUDARAM_KICK) of device %d channel %u failed (%s)\n", channel->fd,
+						channel->cudaram->id, channel->id, strerror(errno));
+				return 1;
+			}
+
+			/* The kicks still post the completions while stopping */
+			if (!ACCESS_ONCE(stopping))
+				submitted += submit_work(channel);
+			reaped += reap_work(channel);
+			busy += channel->busy;
+		}
+
+		worker->next = (worker->next + 1) % worker->nr_channels;
+
+		if (submitted || reaped)
+			continue;
+
+		/* Nothing new happened, wait for a transfer or for new work instead of spinning on the kicks */
+		/* The completions posted so far went out with the kicks of this round */
+		if (busy)
+			wait_work(worker);
+		else if (ACCESS_ONCE(stopping))
+			stop_worker(worker);
+		else if (idle_work(worker))
+			return 1;
+	}
+}
+
+/* A failing worker takes the whole daemon down, the kernel fails the outstanding work on release */
+static void *worker_thread(void *arg)
+{
+	struct worker *worker = arg;
+	struct backend *backend = worker->channels[0]->cudaram->backend;
+
+	if (backend->ops->attach && backend->ops->attach(backend))
+		exit(EXIT_FAILURE);
+
+	if (work(worker))
+		exit(EXIT_FAILURE);
+
+	return NULL;
+}
+
+/* Worker i serves channel i of every device, and is bound to the i-th of the CPUs if any, round-robin */
+static int init_workers(struct worker *workers, unsigned int nr_workers, struct cudaram_dev *devices,
+		unsigned int nr_devices, unsigned int spin_us, const int *cpus, unsigned int nr_cpus)
+{
+	unsigned int i, d;
+
+	if (pipe(stop_pipe)) {
+		pr_err("Creating the stop pipe failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	total_workers = nr_workers;
+
+	for (i = 0; i < nr_workers; ++i) {
+		struct worker *worker = &workers[i];
+
+		worker->id = i;
+		worker->cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+		worker->spin_budget = spin_us * 1000ULL;
+		/* Start out spinning for the whole budget */
+		worker->idle_avg = worker->spin_budget / 2;
+		worker->nr_channels = nr_devices;
+		worker->channels = calloc(nr_devices, sizeof(*worker->channels));
+		worker->fds = calloc(nr_devices + 1, sizeof(*worker->fds));
+		if (!worker->channels || !worker->fds) {
+			pr_err("Allocating workers failed\n");
+			return -1;
+		}
+
+		for (d = 0; d < nr_devices; ++d) {
+			struct channel *channel = &devices[d].channels[i];
+
+			channel->worker = worker;
+			worker->channels[d] = channel;
+			worker->fds[d].fd = channel->fd;
+			worker->fds[d].events = POLLIN;
+		}
+		worker->fds[nr_devices].fd = stop_pipe[0];
+		worker->fds[nr_devices].events = POLLIN;
+	}
+
+	return 0;
+}
+
+/* Serve the first worker in the calling thread and the rest in new threads */
+int work_workers(struct worker *workers, unsigned int nr_workers)
+{
+	int err;
+	unsigned int i;
+
+	for (i = 1; i < nr_workers; ++i) {
+		err = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
 		if (err) {
-			pr_err("ioctl(%d, CUDARAM_WORK, ...) failed (%s)\n", cudaram->fd, strerror(errno));
+			pr_err("Creating thread for channel %u failed (%s)\n", i, strerror(err));
 			return 1;
 		}
+	}
+
+	return work(&workers[0]);
+}
+
+static void signal_set(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGUSR1);
+	sigaddset(set, SIGUSR2);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+}
+
+/* Stop the workers and wait for them to finish the works in flight */
+static void stop_workers(void)
+{
+	stopping = 1;
+	__sync_synchronize();
+
+	/* Never read, it stays readable for all the workers */
+	if (write(stop_pipe[1], "", 1) < 0)
+		pr_err("Waking up the workers failed (%s)\n", strerror(errno));
+
+	pthread_mutex_lock(&stop_lock);
+	while (nr_stopped < total_workers)
+		pthread_cond_wait(&stop_cond, &stop_lock);
+	pthread_mutex_unlock(&stop_lock);
+}
 
-		if (!work.id)
+/*
+ * Handle the signals blocked in all the other threads: print the backend's
+ * counters on SIGUSR1, and on SIGINT and SIGTERM stop the workers, flush the
+ * backend and exit so that e.g. a snapshot holds every completed write.
+ */
+static void *signal_thread(void *arg)
+{
+	int sig;
+	sigset_t set;
+	struct backend *backend = arg;
+
+	if (backend->ops->attach && backend->ops->attach(backend))
+		exit(EXIT_FAILURE);
+
+	signal_set(&set);
+
+	while (!sigwait(&set, &sig)) {
+		if (sig == SIGUSR1) {
+			if (backend->ops->stats)
+				backend->ops->stats(backend);
 			continue;
+		}
+
+		if (sig == SIGUSR2) {
+			if (trace_file && !trace_dump(trace_file, trace_dump_path))
+				pr_info("Dumped the trace to '%s'\n", trace_dump_path);
+			continue;
+		}
 
-		pr_debug("work %s len %u first_page %u\n", work.dir == READ ? "read" : "write", work.len, work.first_page);
+		pr_info("Finishing the works in flight before exiting\n");
+		stop_workers();
 
-		CUdeviceptr first = cudaram->data + work.first_page * PAGE_SIZE;
-		if (work.dir == READ)
-			cuMemcpyDtoH(cudaram->buf, first, work.len * PAGE_SIZE);
-		else
-			cuMemcpyHtoD(first, cudaram->buf, work.len * PAGE_SIZE);
+		if (backend->ops->flush) {
+			pr_info("Flushing the backend before exiting\n");
+			if (backend->ops->flush(backend)) {
+				pr_err("Flushing the backend failed\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(EXIT_SUCCESS);
 	}
+
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	pr_err("Usage: %s [-b backend[:arg]] [-q queue_depth] [-t threads] [-p spin_us] [-a cpu[,cpu...]] [-m path] "
+			"[-T path[:records]] [-s] [-z] cudaram_id[,cudaram_id...] capacityMB [buffer_sizeMB]\n", name);
+}
+
+/* Parse a comma separated list of up to max non-negative ids, returns their number or -1 */
+static int parse_ids(const char *arg, int *ids, int max)
+{
+	int nr_ids = 0;
+	char *end;
+
+	do {
+		if (nr_ids == max)
+			return -1;
+
+		ids[nr_ids] = strtol(arg, &end, 10);
+		if (end == arg || ids[nr_ids] < 0 || (*end && *end != ','))
+			return -1;
+		++nr_ids;
+		arg = end + 1;
+	} while (*end);
+
+	return nr_ids;
+}
+
+/* Split the number of records off a path[:records] trace spec */
+static int parse_trace_records(char *spec, unsigned int *records)
+{
+	char *colon = strrchr(spec, ':');
+	char *end;
+	unsigned long value;
+
+	if (!colon)
+		return 0;
+
+	value = strtoul(colon + 1, &end, 10);
+	if (end == colon + 1 || *end)
+		return 0; /* part of the path */
+
+	if (!value || (value & (value - 1)) || value > (1UL << 30))
+		return -1;
+
+	*colon = '\0';
+	*records = value;
+
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	int id, capacity, buffer_size;
-	struct cudaram_dev cudaram;
+	int opt;
+	int ids[MAX_DEVICES], nr_devices, capacity, buffer_size;
+	int cpus[CUDARAM_MAX_CHANNELS], nr_cpus = 0;
+	unsigned int spin_us = 0;
+	unsigned int i, queue_depth = DEFAULT_QUEUE_DEPTH;
+	unsigned int nr_channels = DEFAULT_CHANNELS;
+	unsigned int flags = 0;
+	int elide_same = 0;
+	const char *backend = DEFAULT_BACKEND;
+	const char *metrics_path = NULL;
+	char *trace_path = NULL;
+	unsigned int trace_records = TRACE_DEFAULT_RECORDS;
+	struct backend storage;
+	struct cudaram_dev *devices;
+	struct worker *workers;
+	struct thread_stats **stats;
+	struct same_table same, *same_ptr = NULL;
+	unsigned long long pages;
+	void *buf;
+	pthread_t signals;
+	sigset_t set;
 
-	if (argc != 3 && argc != 4) {
-		pr_err("Usage: %s cudaram_id capacityMB [buffer_sizeMB]\n", argv[0]);
+	while ((opt = getopt(argc, argv, "b:q:t:p:a:m:T:sz")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth == 0 || (queue_depth & (queue_depth - 1)) ||
+			    queue_depth > CUDARAM_MAX_QUEUE_DEPTH) {
+				pr_err("Invalid queue_depth, has to be a power of 2 up to %d\n", CUDARAM_MAX_QUEUE_DEPTH);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			nr_channels = atoi(optarg);
+			if (nr_channels == 0 || nr_channels > CUDARAM_MAX_CHANNELS) {
+				pr_err("Invalid number of threads, has to be between 1 and %d\n", CUDARAM_MAX_CHANNELS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			spin_us = atoi(optarg);
+			break;
+		case 'a':
+			nr_cpus = parse_ids(optarg, cpus, CUDARAM_MAX_CHANNELS);
+			if (nr_cpus < 0) {
+				pr_err("Invalid CPU list, up to %d CPUs\n", CUDARAM_MAX_CHANNELS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			if (parse_trace_records(trace_path, &trace_records)) {
+				pr_err("Invalid number of trace records, has to be a power of 2\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			elide_same = 1;
+			break;
+		case 'z':
+			flags |= CUDARAM_FLAG_ZERO_COPY;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* The same-filled pages are only kept in the daemon and would be missing from the snapshots */
+	if (elide_same && spec_uses(backend, "snap")) {
+		pr_err("-s can't be used with the snap backend\n");
+		return EXIT_FAILURE;
+	}
+
+	if (argc - optind != 2 && argc - optind != 3) {
+		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
@@ -154,33 +950,108 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	id = atoi(argv[1]);
-	if (id < 0) {
-		pr_err("Invalid cudaram device id\n");
+	nr_devices = parse_ids(argv[optind], ids, MAX_DEVICES);
+	if (nr_devices < 0) {
+		pr_err("Invalid cudaram device ids, up to %d are supported\n", MAX_DEVICES);
 		return EXIT_FAILURE;
 	}
 
-	capacity = atoi(argv[2]);
+	capacity = atoi(argv[optind + 1]);
 	if (capacity < 0) {
 		pr_err("Invalid capacity\n");
 		return EXIT_FAILURE;
 	}
 
 	buffer_size = DEFAULT_BUFFER_SIZE;
-	if (argc == 4) {
-		buffer_size = atoi(argv[3]);
+	if (argc - optind == 3) {
+		buffer_size = atoi(argv[optind + 2]);
 		if (buffer_size < 0) {
 			pr_err("Invalid buffer_size\n");
 			return EXIT_FAILURE;
 		}
 	}
-	if (init_cuda(&cudaram))
+
+	/* Each device gets the capacity, the buffer size and the queues, all share the backend */
+	pages = (unsigned long long)capacity << MB_SHIFT >> __builtin_ctzl(PAGE_SIZE);
+	devices = calloc(nr_devices, sizeof(*devices));
+	workers = calloc(nr_channels, sizeof(*workers));
+	if (!devices || !workers) {
+		pr_err("Allocating devices failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Block the signals before any threads are created, they are handled by the signal thread */
+	signal_set(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (elide_same) {
+		if (same_init(&same, pages * nr_devices)) {
+			pr_err("Allocating the same-filled page table failed\n");
+			return EXIT_FAILURE;
+		}
+		same_ptr = &same;
+	}
+
+	if (init_backend(&storage, backend, pages * nr_devices * PAGE_SIZE, queue_depth * nr_channels * nr_devices))
+		return EXIT_FAILURE;
+
+	buf = storage.ops->alloc_buffer(&storage, (size_t)buffer_size * nr_devices << MB_SHIFT);
+	if (!buf) {
+		pr_err("Allocating the buffer failed\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mlockall(MCL_FUTURE)) {
+		pr_err("Locking the memory failed (%s)\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nr_devices; ++i) {
+		struct cudaram_dev *cudaram = &devices[i];
+
+		cudaram->backend = &storage;
+		cudaram->first_page = pages * i;
+		cudaram->buf = buf + ((size_t)buffer_size * i << MB_SHIFT);
+		cudaram->same = same_ptr;
+
+		if (init_device(cudaram, ids[i], capacity, buffer_size, queue_depth, nr_channels, flags,
+				queue_depth * nr_channels * i))
+			return EXIT_FAILURE;
+	}
+
+	if (init_workers(workers, nr_channels, devices, nr_devices, spin_us, cpus, nr_cpus))
 		return EXIT_FAILURE;
 
-	if (init_device(&cudaram, id, capacity, buffer_size))
+	if (trace_path) {
+		trace_dump_path = malloc(strlen(trace_path) + sizeof(".dump"));
+		trace_file = trace_open(trace_path, nr_channels, trace_records);
+		if (!trace_dump_path || !trace_file)
+			return EXIT_FAILURE;
+		sprintf(trace_dump_path, "%s.dump", trace_path);
+
+		for (i = 0; i < nr_channels; ++i)
+			workers[i].trace = trace_ring(trace_file, i);
+	}
+
+	if (metrics_path) {
+		stats = calloc(nr_channels, sizeof(*stats));
+		if (!stats) {
+			pr_err("Allocating the metrics failed\n");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < nr_channels; ++i)
+			stats[i] = &workers[i].stats;
+
+		if (metrics_start(metrics_path, stats, nr_channels, &storage))
+			return EXIT_FAILURE;
+	}
+
+	if (pthread_create(&signals, NULL, signal_thread, &storage)) {
+		pr_err("Creating the signal thread failed\n");
 		return EXIT_FAILURE;
+	}
 
-	if (work(&cudaram))
+	if (work_workers(workers, nr_channels))
 		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
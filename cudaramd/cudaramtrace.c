@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Decoder of the cudaramd trace files.
+ *
+ * Pairs up the submissions and completions of each thread into requests and
+ * prints them as timelines, oldest first, or with -j as Chrome trace JSON,
+ * loadable in chrome://tracing or Perfetto, together with the kick, wait and
+ * idle spans of the threads.
+ *
+ * The daemon keeps writing to the trace file, a snapshot dumped with SIGUSR2
+ * leaves out the records overwritten while dumping it, while decoding the live
+ * file may mix in newer records.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../kmod/cudaram.h" /* for the dirs and limits */
+#include "trace.h"
+
+#define MAX_DEVICE_ID 32
+
+struct request {
+	uint64_t submit;
+	uint64_t complete;
+	unsigned int thread;
+	unsigned int device;
+	unsigned int tag;
+	unsigned int dir;
+	unsigned int first_page;
+	unsigned int len;
+	int error;
+};
+
+static const char *dir_names[] = {
+	[CUDARAM_READ] = "read",
+	[CUDARAM_WRITE] = "write",
+	[CUDARAM_DISCARD] = "discard",
+	[CUDARAM_FLUSH] = "flush",
+};
+
+static const char *span_names[] = {
+	[TRACE_KICK] = "kick",
+	[TRACE_WAIT] = "wait",
+	[TRACE_IDLE] = "idle",
+};
+
+static struct request *requests;
+static size_t nr_requests, max_requests;
+static unsigned long unmatched;
+
+static const char *dir_name(unsigned int dir)
+{
+	return dir < sizeof(dir_names) / sizeof(dir_names[0]) ? dir_names[dir] : "unknown";
+}
+
+static struct request *add_request(void)
+{
+	if (nr_requests == max_requests) {
+		max_requests = max_requests ? 2 * max_requests : 4096;
+		requests = realloc(requests, max_requests * sizeof(*requests));
+		if (!requests) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return &requests[nr_requests++];
+}
+
+/* Index of the first record still in a ring and the number of them */
+static void ring_range(struct trace_ring *ring, uint64_t *first, uint64_t *count)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	*count = head < ring->nr_records ? head : ring->nr_records;
+	*first = head - *count;
+
+	/* The oldest records of a dump may have been overwritten while dumping it */
+	if (ring->dropped) {
+		uint64_t dropped = ring->dropped < *count ? ring->dropped : *count;
+
+		*first += dropped;
+		*count -= dropped;
+	}
+}
+
+/* Pair up the records of a thread, a tag has a single request in flight at a time */
+static int decode_ring(struct trace_ring *ring, unsigned int thread, long *open)
+{
+	uint64_t first, count, i;
+
+	ring_range(ring, &first, &count);
+
+	for (i = 0; i < MAX_DEVICE_ID * CUDARAM_MAX_QUEUE_DEPTH; ++i)
+		open[i] = -1;
+
+	for (i = first; i < first + count; ++i) {
+		struct trace_record *rec = &ring->records[i & (ring->nr_records - 1)];
+		struct request *req;
+		long *slot;
+
+		if (rec->phase != TRACE_SUBMIT && rec->phase != TRACE_COMPLETE)
+			continue;
+
+		if (rec->device >= MAX_DEVICE_ID || rec->tag >= CUDARAM_MAX_QUEUE_DEPTH) {
+			fprintf(stderr, "Bad record of thread %u, device %u tag %u\n", thread, rec->device, rec->tag);
+			return -1;
+		}
+		slot = &open[rec->device * CUDARAM_MAX_QUEUE_DEPTH + rec->tag];
+
+		if (rec->phase == TRACE_SUBMIT) {
+			if (*slot >= 0)
+				++unmatched;
+
+			req = add_request();
+			req->submit = rec->time;
+			req->complete = 0;
+			req->thread = thread;
+			req->device = rec->device;
+			req->tag = rec->tag;
+			req->dir = rec->dir;
+			req->first_page = rec->first_page;
+			req->len = rec->len;
+			req->error = 0;
+			*slot = req - requests;
+			continue;
+		}
+
+		/* The submission may have been overwritten already */
+		if (*slot < 0) {
+			++unmatched;
+			continue;
+		}
+
+		requests[*slot].complete = rec->time;
+		requests[*slot].error = rec->error;
+		*slot = -1;
+	}
+
+	return 0;
+}
+
+static int compare_requests(const void *a, const void *b)
+{
+	const struct request *x = a, *y = b;
+
+	return x->submit < y->submit ? -1 : x->submit > y->submit;
+}
+
+/* Earliest time of all the records, the times are printed relative to it */
+static uint64_t trace_start(struct trace_header *header)
+{
+	uint64_t start = UINT64_MAX, first, count, j;
+	unsigned int i;
+
+	for (i = 0; i < header->nr_rings; ++i) {
+		struct trace_ring *ring = trace_ring(header, i);
+
+		ring_range(ring, &first, &count);
+		for (j = first; j < first + count; ++j) {
+			if (ring->records[j & (ring->nr_records - 1)].time < start)
+				start = ring->records[j & (ring->nr_records - 1)].time;
+		}
+	}
+
+	return start;
+}
+
+static void print_timelines(uint64_t start)
+{
+	size_t i;
+
+	for (i = 0; i < nr_requests; ++i) {
+		struct request *req = &requests[i];
+
+		printf("%12.3f us thread %u device %u tag %u %s first_page %u len %u",
+				(req->submit - start) / 1e3, req->thread, req->device, req->tag,
+				dir_name(req->dir), req->first_page, req->len);
+		if (req->complete)
+			printf(": done in %.3f us%s\n", (req->complete - req->submit) / 1e3, req->error ? ", failed" : "");
+		else
+			printf(": in flight\n");
+	}
+}
+
+/*
+ * Each device is a process with its requests as async events, so that the
+ * overlapping requests of a thread get their own rows, and the threads are
+ * the threads of one more process with their spans.
+ */
+static void print_json(struct trace_header *header, uint64_t start)
+{
+	const char *sep = ",\n";
+	int named[MAX_DEVICE_ID] = { 0 };
+	uint64_t first, count, j;
+	unsigned int i;
+	size_t r;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	printf("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"cudaramd threads\"}}",
+			MAX_DEVICE_ID);
+
+	for (i = 0; i < header->nr_rings; ++i) {
+		struct trace_ring *ring = trace_ring(header, i);
+
+		printf("%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+				sep, MAX_DEVICE_ID, i, i);
+
+		ring_range(ring, &first, &count);
+		for (j = first; j < first + count; ++j) {
+			struct trace_record *rec = &ring->records[j & (ring->nr_records - 1)];
+
+			if (rec->phase < TRACE_KICK || rec->phase > TRACE_IDLE)
+				continue;
+
+			printf("%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+					sep, span_names[rec->phase], MAX_DEVICE_ID, i,
+					(rec->time - start) / 1e3, rec->len / 1e3);
+		}
+	}
+
+	for (r = 0; r < nr_requests; ++r) {
+		struct request *req = &requests[r];
+
+		if (!req->complete)
+			continue;
+
+		if (!named[req->device]) {
+			printf("%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,\"args\":{\"name\":\"cudaram%u\"}}",
+					sep, req->device, req->device);
+			named[req->device] = 1;
+		}
+
+		printf("%s{\"ph\":\"b\",\"cat\":\"work\",\"name\":\"%s\",\"id\":%zu,\"pid\":%u,\"tid\":%u,\"ts\":%.3f,"
+				"\"args\":{\"tag\":%u,\"first_page\":%u,\"len\":%u}}",
+				sep, dir_name(req->dir), r, req->device, req->thread, (req->submit - start) / 1e3,
+				req->tag, req->first_page, req->len);
+		printf("%s{\"ph\":\"e\",\"cat\":\"work\",\"name\":\"%s\",\"id\":%zu,\"pid\":%u,\"tid\":%u,\"ts\":%.3f,"
+				"\"args\":{\"error\":%d}}",
+				sep, dir_name(req->dir), r, req->device, req->thread, (req->complete - start) / 1e3,
+				req->error);
+	}
+
+	printf("\n]}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j] trace_file\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, fd, json = 0;
+	struct trace_header *header;
+	struct stat st;
+	unsigned int i;
+	uint64_t start;
+	long *open_tags;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Opening '%s' failed (%s)\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (st.st_size < TRACE_HEADER_SIZE) {
+		fprintf(stderr, "'%s' is not a trace file\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		fprintf(stderr, "Mapping '%s' failed (%s)\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) || header->version != TRACE_VERSION ||
+	    header->record_size != sizeof(struct trace_record) || !header->nr_records ||
+	    (header->nr_records & (header->nr_records - 1)) ||
+	    st.st_size < trace_file_size(header->nr_rings, header->nr_records)) {
+		fprintf(stderr, "'%s' is not a trace file of this version\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	open_tags = malloc(MAX_DEVICE_ID * CUDARAM_MAX_QUEUE_DEPTH * sizeof(*open_tags));
+	if (!open_tags) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < header->nr_rings; ++i) {
+		if (decode_ring(trace_ring(header, i), i, open_tags))
+			return EXIT_FAILURE;
+	}
+
+	qsort(requests, nr_requests, sizeof(*requests), compare_requests);
+	start = trace_start(header);
+
+	if (json)
+		print_json(header, start);
+	else
+		print_timelines(start);
+
+	if (unmatched)
+		fprintf(stderr, "%lu records without their pair, overwritten in the ring\n", unmatched);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+/*
+ * Metrics endpoint.
+ *
+ * Each scrape is a connection to the unix socket, the request is read and
+ * ignored and the response is an HTTP/1.0 reply with the metrics in the
+ * Prometheus text format, e.g.
+ * curl --unix-socket /run/cudaramd.sock http://localhost/metrics
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "print.h"
+
+#define MIN_TRANSFER 4096 /* bound of the first transfer size bucket */
+#define REQUEST_TIMEOUT_MS 100
+
+static const char *dir_names[METRICS_DIRS] = { "read", "write", "discard", "flush" };
+
+struct metrics {
+	int fd;
+	struct thread_stats **threads;
+	unsigned int nr_threads;
+	struct backend *backend;
+};
+
+/* Bucket i counts times up to 2^i us */
+void stats_work(struct thread_stats *stats, unsigned int dir, unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket > METRICS_TIME_BUCKETS)
+		bucket = METRICS_TIME_BUCKETS;
+
+	++stats->works[dir];
+	stats->work_ns[dir] += ns;
+	++stats->work_hist[dir][bucket];
+}
+
+/* Bucket i counts transfers up to MIN_TRANSFER << i bytes */
+void stats_transfer(struct thread_stats *stats, unsigned int dir, size_t len)
+{
+	unsigned long long units = (len + MIN_TRANSFER - 1) / MIN_TRANSFER;
+	unsigned int bucket = units > 1 ? 64 - __builtin_clzll(units - 1) : 0;
+
+	if (bucket > METRICS_SIZE_BUCKETS)
+		bucket = METRICS_SIZE_BUCKETS;
+
+	++stats->transfers[dir];
+	stats->transfer_bytes[dir] += len;
+	++stats->transfer_hist[dir][bucket];
+}
+
+static void print_header(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP cudaramd_%s %s\n# TYPE cudaramd_%s %s\n", name, help, name, type);
+}
+
+/* Print a cumulative histogram out of the bucket counts summed up over the threads */
+static void print_histogram(FILE *out, const char *name, const char *dir, const unsigned long long *counts,
+		unsigned int nr_buckets, unsigned long long sum, int seconds)
+{
+	unsigned int i;
+	unsigned long long total = 0;
+
+	for (i = 0; i < nr_buckets; ++i) {
+		total += counts[i];
+		if (seconds)
+			fprintf(out, "cudaramd_%s_bucket{dir=\"%s\",le=\"%.6f\"} %llu\n", name, dir, (1ULL << i) / 1e6, total);
+		else
+			fprintf(out, "cudaramd_%s_bucket{dir=\"%s\",le=\"%llu\"} %llu\n", name, dir,
+					(unsigned long long)MIN_TRANSFER << i, total);
+	}
+	total += counts[nr_buckets];
+
+	fprintf(out, "cudaramd_%s_bucket{dir=\"%s\",le=\"+Inf\"} %llu\n", name, dir, total);
+	if (seconds)
+		fprintf(out, "cudaramd_%s_sum{dir=\"%s\"} %.9f\n", name, dir, sum / 1e9);
+	else
+		fprintf(out, "cudaramd_%s_sum{dir=\"%s\"} %llu\n", name, dir, sum);
+	fprintf(out, "cudaramd_%s_count{dir=\"%s\"} %llu\n", name, dir, total);
+}
+
+static void print_thread_seconds(FILE *out, struct metrics *metrics, const char *name, const char *help,
+		size_t offset)
+{
+	unsigned int i;
+
+	print_header(out, name, "counter", help);
+	for (i = 0; i < metrics->nr_threads; ++i) {
+		unsigned long long ns = ACCESS_ONCE(*(unsigned long long *)((void *)metrics->threads[i] + offset));
+
+		fprintf(out, "cudaramd_%s{thread=\"%u\"} %.9f\n", name, i, ns / 1e9);
+	}
+}
+
+static void print_metrics(FILE *out, struct metrics *metrics)
+{
+	unsigned int i, t, dir;
+	struct thread_stats total;
+
+	/* Sum up the threads, a scrape racing with updates only misses the latest ones */
+	memset(&total, 0, sizeof(total));
+	for (t = 0; t < metrics->nr_threads; ++t) {
+		struct thread_stats *stats = metrics->threads[t];
+
+		for (dir = 0; dir < METRICS_DIRS; ++dir) {
+			total.works[dir] += ACCESS_ONCE(stats->works[dir]);
+			total.work_ns[dir] += ACCESS_ONCE(stats->work_ns[dir]);
+			for (i = 0; i <= METRICS_TIME_BUCKETS; ++i)
+				total.work_hist[dir][i] += ACCESS_ONCE(stats->work_hist[dir][i]);
+		}
+
+		for (dir = 0; dir < 2; ++dir) {
+			total.transfers[dir] += ACCESS_ONCE(stats->transfers[dir]);
+			total.transfer_bytes[dir] += ACCESS_ONCE(stats->transfer_bytes[dir]);
+			total.elided_pages[dir] += ACCESS_ONCE(stats->elided_pages[dir]);
+			for (i = 0; i <= METRICS_SIZE_BUCKETS; ++i)
+				total.transfer_hist[dir][i] += ACCESS_ONCE(stats->transfer_hist[dir][i]);
+		}
+	}
+
+	print_header(out, "work_seconds", "histogram",
+			"Time from submitting a work to the backend until its completion.");
+	for (dir = 0; dir < METRICS_DIRS; ++dir)
+		print_histogram(out, "work_seconds", dir_names[dir], total.work_hist[dir], METRICS_TIME_BUCKETS,
+				total.work_ns[dir], 1);
+
+	print_header(out, "transfer_bytes", "histogram", "Sizes of the backend transfers.");
+	for (dir = 0; dir < 2; ++dir)
+		print_histogram(out, "transfer_bytes", dir_names[dir], total.transfer_hist[dir], METRICS_SIZE_BUCKETS,
+				total.transfer_bytes[dir], 0);
+
+	print_header(out, "elided_pages_total", "counter", "Same-filled pages that needed no transfer.");
+	for (dir = 0; dir < 2; ++dir)
+		fprintf(out, "cudaramd_elided_pages_total{dir=\"%s\"} %llu\n", dir_names[dir], total.elided_pages[dir]);
+
+	print_thread_seconds(out, metrics, "kick_seconds_total", "Time spent in the kick ioctl.",
+			offsetof(struct thread_stats, kick_ns));
+	print_thread_seconds(out, metrics, "wait_seconds_total", "Time spent blocked waiting for a transfer.",
+			offsetof(struct thread_stats, wait_ns));
+	print_thread_seconds(out, metrics, "idle_seconds_total", "Time spent waiting for new work.",
+			offsetof(struct thread_stats, idle_ns));
+
+	if (metrics->backend->ops->metrics)
+		metrics->backend->ops->metrics(metrics->backend, out, "0");
+}
+
+/* Answer a single scrape, the request is only read so that closing doesn't reset the connection */
+static void serve(struct metrics *metrics, int fd)
+{
+	char request[4096], header[128];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char *body = NULL;
+	size_t len = 0;
+	FILE *out;
+	int header_len;
+
+	if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) > 0 && read(fd, request, sizeof(request)) < 0)
+		return;
+
+	out = open_memstream(&body, &len);
+	if (!out) {
+		pr_err("Allocating the metrics failed\n");
+		return;
+	}
+	print_metrics(out, metrics);
+	if (fclose(out)) {
+		pr_err("Printing the metrics failed\n");
+		free(body);
+		return;
+	}
+
+	header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+
+	/* The scraper may be gone already, don't get killed by SIGPIPE */
+	if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len)
+		send(fd, body, len, MSG_NOSIGNAL);
+
+	free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct metrics *metrics = arg;
+
+	while (1) {
+		int fd = accept(metrics->fd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				pr_err("Accepting a metrics connection failed (%s)\n", strerror(errno));
+			continue;
+		}
+
+		serve(metrics, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int metrics_start(const char *path, struct thread_stats **threads, unsigned int nr_threads,
+		struct backend *backend)
+{
+	struct sockaddr_un addr;
+	struct metrics *metrics;
+	pthread_t thread;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		pr_err("The metrics socket path '%s' is too long\n", path);
+		return -1;
+	}
+
+	metrics = calloc(1, sizeof(*metrics));
+	if (!metrics)
+		return -1;
+
+	metrics->threads = threads;
+	metrics->nr_threads = nr_threads;
+	metrics->backend = backend;
+
+	metrics->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics->fd < 0) {
+		pr_err("Creating the metrics socket failed (%s)\n", strerror(errno));
+		goto err_free;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Replace the socket of a previous daemon, but nothing else that may be there by mistake */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			pr_err("'%s' exists and is not a socket\n", path);
+			goto err_close;
+		}
+		unlink(path);
+	}
+
+	if (bind(metrics->fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(metrics->fd, 16)) {
+		pr_err("Listening on '%s' failed (%s)\n", path, strerror(errno));
+		goto err_close;
+	}
+
+	if (pthread_create(&thread, NULL, metrics_thread, metrics)) {
+		pr_err("Creating the metrics thread failed\n");
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(metrics->fd);
+err_free:
+	free(metrics);
+
+	return -1;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#ifndef _CUDARAMD_METRICS_H_
+#define _CUDARAMD_METRICS_H_
+
+#include <stddef.h>
+
+#include "backend.h"
+
+#define METRICS_DIRS 4 /* indexed by CUDARAM_READ through CUDARAM_FLUSH */
+#define METRICS_TIME_BUCKETS 23 /* up to 1us, 2us, ... 4s */
+#define METRICS_SIZE_BUCKETS 11 /* up to 4K, 8K, ... 4M */
+
+/*
+ * Counters of a daemon thread. Only the thread itself updates them, without
+ * any locking, the metrics thread reads them as they are and sums them up.
+ * The histograms have an extra bucket for anything above the last bound.
+ */
+struct thread_stats {
+	unsigned long long works[METRICS_DIRS]; /* completed works */
+	unsigned long long work_ns[METRICS_DIRS];
+	unsigned long long work_hist[METRICS_DIRS][METRICS_TIME_BUCKETS + 1]; /* from submit to completion */
+
+	unsigned long long transfers[2]; /* backend reads and writes */
+	unsigned long long transfer_bytes[2];
+	unsigned long long transfer_hist[2][METRICS_SIZE_BUCKETS + 1];
+	unsigned long long elided_pages[2]; /* same-filled pages needing no transfer */
+
+	unsigned long long kick_ns; /* in the kick ioctl */
+	unsigned long long wait_ns; /* blocked waiting for a transfer */
+	unsigned long long idle_ns; /* spinning or sleeping with no work in flight */
+};
+
+extern void stats_work(struct thread_stats *stats, unsigned int dir, unsigned long long ns);
+extern void stats_transfer(struct thread_stats *stats, unsigned int dir, size_t len);
+
+/*
+ * Serve the metrics of the threads and the backend in the Prometheus text
+ * format over HTTP on a unix socket at path, from a new thread.
+ */
+extern int metrics_start(const char *path, struct thread_stats **threads, unsigned int nr_threads,
+		struct backend *backend);
+
+#endif /* _CUDARAMD_METRICS_H_ */
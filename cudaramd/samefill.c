@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "samefill.h"
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
+/* Whether the whole page is equal to value, size is a multiple of 128 bytes */
+static int same_generic(const void *page, size_t size, uint32_t value)
+{
+	const unsigned long *p = page, *end = page + size;
+	unsigned long v = value;
+
+	v |= v << 16 << 16;
+
+	for (; p < end; p += 4) {
+		if ((p[0] ^ v) | (p[1] ^ v) | (p[2] ^ v) | (p[3] ^ v))
+			return 0;
+	}
+
+	return 1;
+}
+
+#ifdef __x86_64__
+/* SSE2 is always there on x86-64 */
+static int same_sse2(const void *page, size_t size, uint32_t value)
+{
+	const __m128i *p = page, *end = page + size;
+	__m128i v = _mm_set1_epi32(value);
+
+	for (; p < end; p += 8) {
+		__m128i x = _mm_or_si128(
+			_mm_or_si128(_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), v),
+						  _mm_xor_si128(_mm_loadu_si128(p + 1), v)),
+				     _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), v),
+						  _mm_xor_si128(_mm_loadu_si128(p + 3), v))),
+			_mm_or_si128(_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 4), v),
+						  _mm_xor_si128(_mm_loadu_si128(p + 5), v)),
+				     _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 6), v),
+						  _mm_xor_si128(_mm_loadu_si128(p + 7), v))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+
+	return 1;
+}
+
+__attribute__ ((target("avx2")))
+static int same_avx2(const void *page, size_t size, uint32_t value)
+{
+	const __m256i *p = page, *end = page + size;
+	__m256i v = _mm256_set1_epi32(value);
+
+	for (; p < end; p += 4) {
+		__m256i x = _mm256_or_si256(
+			_mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p), v),
+					_mm256_xor_si256(_mm256_loadu_si256(p + 1), v)),
+			_mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p + 2), v),
+					_mm256_xor_si256(_mm256_loadu_si256(p + 3), v)));
+
+		if (!_mm256_testz_si256(x, x))
+			return 0;
+	}
+
+	return 1;
+}
+#endif
+
+static int (*same_scan)(const void *page, size_t size, uint32_t value) = same_generic;
+
+int same_init(struct same_table *table, unsigned long long pages)
+{
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	same_scan = __builtin_cpu_supports("avx2") ? same_avx2 : same_sse2;
+#endif
+
+	table->pages = pages;
+	table->same = calloc((pages + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(*table->same));
+	table->values = calloc(pages, sizeof(*table->values));
+	if (!table->same || !table->values) {
+		free(table->same);
+		free(table->values);
+		return -1;
+	}
+
+	return 0;
+}
+
+int same_filled(const void *page, size_t size, uint32_t *value)
+{
+	*value = *(const uint32_t *)page;
+
+	return same_scan(page, size, *value);
+}
+
+void same_fill(void *page, size_t size, uint32_t value)
+{
+	uint32_t *p = page, *end = page + size;
+
+	if (value == 0) {
+		memset(page, 0, size);
+		return;
+	}
+
+	for (; p < end; ++p)
+		*p = value;
+}
+
+void same_set(struct same_table *table, unsigned long long page, uint32_t value)
+{
+	table->values[page] = value;
+
+	/* A full barrier, the value is visible before the bit */
+	__sync_fetch_and_or(&table->same[page / BITS_PER_LONG], 1UL << (page % BITS_PER_LONG));
+}
+
+void same_clear(struct same_table *table, unsigned long long page)
+{
+	unsigned long bit = 1UL << (page % BITS_PER_LONG);
+
+	if (table->same[page / BITS_PER_LONG] & bit)
+		__sync_fetch_and_and(&table->same[page / BITS_PER_LONG], ~bit);
+}
+
+int same_get(struct same_table *table, unsigned long long page, uint32_t *value)
+{
+	if (!(table->same[page / BITS_PER_LONG] & (1UL << (page % BITS_PER_LONG))))
+		return 0;
+
+	/* Read the value only after the bit */
+	__sync_synchronize();
+	*value = table->values[page];
+
+	return 1;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#ifndef _CUDARAMD_SAMEFILL_H_
+#define _CUDARAMD_SAMEFILL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Table of the pages filled with a single repeated 32-bit word.
+ *
+ * Such pages are not stored in the backend, their reads are filled in on the
+ * host. Pages are only set and cleared by the thread handling a request for
+ * them, but different threads may update pages sharing a bitmap word.
+ */
+struct same_table {
+	unsigned long *same; /* bitmap of the same-filled pages */
+	uint32_t *values; /* the fill of each same-filled page */
+	unsigned long long pages;
+};
+
+extern int same_init(struct same_table *table, unsigned long long pages);
+
+/* Check whether a page is filled with a single word and get the word */
+extern int same_filled(const void *page, size_t size, uint32_t *value);
+
+/* Fill a page with a single word */
+extern void same_fill(void *page, size_t size, uint32_t value);
+
+extern void same_set(struct same_table *table, unsigned long long page, uint32_t value);
+extern void same_clear(struct same_table *table, unsigned long long page);
+
+/* Whether the page is same-filled, with the fill in value */
+extern int same_get(struct same_table *table, unsigned long long page, uint32_t *value);
+
+#endif /* _CUDARAMD_SAMEFILL_H_ */
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "print.h"
+#include "trace.h"
+
+struct trace_header *trace_open(const char *path, unsigned int nr_rings, unsigned int nr_records)
+{
+	struct trace_header *header;
+	size_t size = trace_file_size(nr_rings, nr_records);
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_err("Opening the trace file '%s' failed (%s)\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size)) {
+		pr_err("Resizing the trace file '%s' failed (%s)\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		pr_err("Mapping the trace file '%s' failed (%s)\n", path, strerror(errno));
+		return NULL;
+	}
+
+	memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+	header->version = TRACE_VERSION;
+	header->nr_rings = nr_rings;
+	header->nr_records = nr_records;
+	header->record_size = sizeof(struct trace_record);
+
+	for (i = 0; i < nr_rings; ++i)
+		trace_ring(header, i)->nr_records = nr_records;
+
+	return header;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = write(fd, buf + done, len - done);
+
+		if (ret < 0)
+			return -1;
+		done += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy a ring appended to concurrently. The records up to the head read
+ * before the copy are complete, but the ones appended until the head read
+ * after it, and the one that may be in the middle of being appended, have
+ * overwritten the oldest records at any point of the copy, so these are
+ * marked as dropped.
+ */
+static void copy_ring(struct trace_ring *copy, struct trace_ring *ring, size_t size)
+{
+	uint64_t before, after, first, overwritten;
+
+	before = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	memcpy(copy, ring, size);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	/* The first record in the ring at the head before and at the head after, plus the one being appended */
+	first = before > ring->nr_records ? before - ring->nr_records : 0;
+	overwritten = after + 1 > ring->nr_records ? after + 1 - ring->nr_records : 0;
+
+	copy->head = before;
+	copy->dropped = overwritten <= first ? 0 : overwritten - first < before - first ? overwritten - first : before - first;
+}
+
+/* Copy the rings to a temporary file renamed over path so that path always holds a whole snapshot */
+int trace_dump(struct trace_header *header, const char *path)
+{
+	size_t ring_size = trace_ring_size(header->nr_records);
+	struct trace_ring *copy;
+	char tmp[4096];
+	unsigned int i;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+		pr_err("The trace dump path '%s' is too long\n", path);
+		return -1;
+	}
+
+	copy = malloc(ring_size);
+	if (!copy) {
+		pr_err("Allocating the trace dump failed\n");
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_err("Opening the trace dump '%s' failed (%s)\n", tmp, strerror(errno));
+		goto err_free;
+	}
+
+	if (write_all(fd, header, TRACE_HEADER_SIZE))
+		goto err_write;
+
+	for (i = 0; i < header->nr_rings; ++i) {
+		copy_ring(copy, trace_ring(header, i), ring_size);
+		if (write_all(fd, copy, ring_size))
+			goto err_write;
+	}
+
+	if (close(fd)) {
+		fd = -1;
+		goto err_write;
+	}
+	fd = -1;
+
+	if (rename(tmp, path)) {
+		pr_err("Renaming the trace dump to '%s' failed (%s)\n", path, strerror(errno));
+		goto err_unlink;
+	}
+
+	free(copy);
+
+	return 0;
+
+err_write:
+	pr_err("Writing the trace dump '%s' failed (%s)\n", tmp, strerror(errno));
+err_unlink:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+err_free:
+	free(copy);
+
+	return -1;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2011 Piotr Jaroszyński
+ */
+
+#ifndef _CUDARAMD_TRACE_H_
+#define _CUDARAMD_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace file.
+ *
+ * A header followed by a ring of fixed-size records for each daemon thread.
+ * The file is mapped shared and each thread appends to its own ring without
+ * any locking, overwriting the oldest records, so that the file always holds
+ * the latest records of every thread. The records of a ring are in the order
+ * they were appended, a span is appended when it ends with its start time.
+ */
+
+#define TRACE_MAGIC "CUDARAMT"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 4096
+#define TRACE_DEFAULT_RECORDS 65536
+
+/* Record phases */
+#define TRACE_SUBMIT   0 /* work taken from the SQ and issued to the backend */
+#define TRACE_COMPLETE 1 /* completion of the work posted, only device, tag and error are set */
+#define TRACE_KICK     2 /* the kick ioctl, len is its duration in ns */
+#define TRACE_WAIT     3 /* blocked waiting for a transfer, len is the duration in ns */
+#define TRACE_IDLE     4 /* spinning or sleeping with no work in flight, len is the duration in ns */
+
+struct trace_record {
+	uint64_t time; /* CLOCK_MONOTONIC in ns, the start of the span for the spans */
+	uint32_t first_page;
+	uint32_t len; /* pages of a work or duration of a span */
+	uint16_t device; /* cudaram id */
+	uint16_t tag;
+	uint8_t dir; /* CUDARAM_* dir of a work */
+	uint8_t phase; /* TRACE_* */
+	int16_t error; /* of a completion */
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_rings; /* one for each thread */
+	uint32_t nr_records; /* per ring, a power of 2 */
+	uint32_t record_size;
+};
+
+struct trace_ring {
+	uint64_t head; /* records appended so far, the last nr_records of them are in the ring */
+	uint32_t nr_records;
+	uint32_t dropped; /* oldest records of the ring that are not valid, only set in a dump */
+	uint32_t reserved[12]; /* keep the records off the line of another ring's head */
+	struct trace_record records[];
+};
+
+static inline size_t trace_ring_size(unsigned int nr_records)
+{
+	return sizeof(struct trace_ring) + (size_t)nr_records * sizeof(struct trace_record);
+}
+
+static inline size_t trace_file_size(unsigned int nr_rings, unsigned int nr_records)
+{
+	return TRACE_HEADER_SIZE + nr_rings * trace_ring_size(nr_records);
+}
+
+static inline struct trace_ring *trace_ring(struct trace_header *header, unsigned int i)
+{
+	return (void *)header + TRACE_HEADER_SIZE + i * trace_ring_size(header->nr_records);
+}
+
+/* Append a record, ring is NULL if not tracing */
+static inline void trace(struct trace_ring *ring, uint64_t time, unsigned int phase, unsigned int device,
+		unsigned int tag, unsigned int dir, unsigned int first_page, unsigned int len, int error)
+{
+	struct trace_record *rec;
+	uint64_t head;
+
+	if (!ring)
+		return;
+
+	head = ring->head;
+	rec = &ring->records[head & (ring->nr_records - 1)];
+	rec->time = time;
+	rec->first_page = first_page;
+	rec->len = len;
+	rec->device = device;
+	rec->tag = tag;
+	rec->dir = dir;
+	rec->phase = phase;
+	rec->error = error;
+
+	/* A reader of a live file sees the record before the head moving past it */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Append a span that started at start and ends now */
+static inline void trace_span(struct trace_ring *ring, uint64_t start, uint64_t now, unsigned int phase)
+{
+	uint64_t len = now - start;
+
+	trace(ring, start, phase, 0, 0, 0, 0, len > UINT32_MAX ? UINT32_MAX : len, 0);
+}
+
+/*
+ * Create the trace file at path with a ring of nr_records, a power of 2, for
+ * each of nr_rings threads and map it, returns NULL on failure.
+ */
+extern struct trace_header *trace_open(const char *path, unsigned int nr_rings, unsigned int nr_records);
+
+/*
+ * Write a snapshot of the trace to path, the records the threads may have
+ * overwritten while it was being copied are dropped.
+ */
+extern int trace_dump(struct trace_header *header, const char *path);
+
+#endif /* _CUDARAMD_TRACE_H_ */
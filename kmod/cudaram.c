@@ -5,16 +5,26 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/module.h>
+#include <linux/anon_inodes.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/file.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
 
 #include "cudaram.h"
 
@@ -22,6 +32,10 @@ static unsigned int num_devices;
 #define MAX_DEVICES 32
 #define DEFAULT_NUM_DEVICES 2
 
+static unsigned int read_expire_ms = 10;
+static unsigned int write_expire_ms = 100;
+static unsigned int read_ratio = 4;
+
 static int cudaram_major;
 static dev_t cudaram_ctl_number;
 static struct class *cudaram_ctl_class;
@@ -29,35 +43,250 @@ static struct class *cudaram_ctl_class;
 static LIST_HEAD(cudaram_devices);
 static DEFINE_MUTEX(cudaram_devices_mutex); /* protect cudaram_devices */
 
+static struct dentry *cudaram_debugfs; /* debugfs directory of the module */
+
 static const struct file_operations cudaram_ctl_fops;
+static const struct file_operations cudaram_channel_fops;
 static const struct block_device_operations cudaram_bops;
 
-/* Add bio to the queue */
-static void cudaram_push_bio(struct cudaram_dev *cudaram, struct bio *bio)
+/*
+ * Can be called without the queue lock by the daemon deciding whether to
+ * sleep. The waiter is on new_work before checking and cudaram_make_request()
+ * wakes it up after unlocking whenever it makes the queue non-empty, both
+ * under the lock of new_work, so a check racing with a push either sees the
+ * bio or is followed by the wake-up. A stale non-empty result only means a
+ * kick that finds no work, the bios are always popped under the lock.
+ */
+static int cudaram_queue_empty(struct cudaram_queue *queue)
+{
+	return ACCESS_ONCE(queue->fifos[READ].bio_first) == NULL && ACCESS_ONCE(queue->fifos[WRITE].bio_first) == NULL;
+}
+
+/* Number of bios queued, each is either timed or untimed */
+static unsigned int cudaram_queue_len(struct cudaram_queue *queue)
+{
+	return queue->fifos[READ].nr_times + queue->fifos[READ].nr_untimed +
+		queue->fifos[WRITE].nr_times + queue->fifos[WRITE].nr_untimed;
+}
+
+static s64 cudaram_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Histogram bucket of a latency in ns */
+static unsigned int cudaram_hist_bucket(s64 ns)
 {
+	u64 us = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+
+	return us ? min_t(unsigned int, ilog2(us) + 1, CUDARAM_HIST_BUCKETS - 1) : 0;
+}
+
+/* Account a latency of a stage, safe to call with preemption enabled */
+static void cudaram_account_lat(struct cudaram_dev *cudaram, unsigned int stage, unsigned int dir, s64 ns)
+{
+	this_cpu_inc(cudaram->stats->hist[stage][dir][cudaram_hist_bucket(ns)]);
+}
+
+/* Add bio to the FIFO, stamping it with its arrival time */
+static void cudaram_fifo_push(struct cudaram_fifo *fifo, struct bio *bio, unsigned long expire)
+{
+	unsigned long now = jiffies;
+	unsigned int last = (fifo->first_stamp + fifo->nr_stamps - 1) % CUDARAM_FIFO_STAMPS;
+
 	bio->bi_next = NULL;
 
-	if (cudaram->bio_last != NULL) {
-		cudaram->bio_last->bi_next = bio;
-		cudaram->bio_last = bio;
+	if (fifo->bio_last != NULL) {
+		fifo->bio_last->bi_next = bio;
+		fifo->bio_last = bio;
 	} else {
-		cudaram->bio_first = bio;
-		cudaram->bio_last = bio;
+		fifo->bio_first = bio;
+		fifo->bio_last = bio;
+	}
+
+	/*
+	 * Share the newest stamp if it's recent enough or there is no room for
+	 * another one, the bio only looks older than it is then
+	 */
+	if (fifo->nr_stamps && (fifo->nr_stamps == CUDARAM_FIFO_STAMPS ||
+	    time_before(now, fifo->stamps[last].time + max(expire / CUDARAM_FIFO_STAMPS, 1UL)))) {
+		++fifo->stamps[last].count;
+		return;
 	}
+
+	last = (fifo->first_stamp + fifo->nr_stamps) % CUDARAM_FIFO_STAMPS;
+	fifo->stamps[last].time = now;
+	fifo->stamps[last].count = 1;
+	++fifo->nr_stamps;
+}
+
+/* Record the exact arrival time of a bio just pushed */
+static void cudaram_fifo_time(struct cudaram_fifo *fifo)
+{
+	if (fifo->nr_untimed || fifo->nr_times == CUDARAM_FIFO_TIMES) {
+		++fifo->nr_untimed;
+		return;
+	}
+
+	fifo->times[(fifo->first_time + fifo->nr_times) % CUDARAM_FIFO_TIMES] = cudaram_now();
+	++fifo->nr_times;
 }
 
-/* Get the first bio in the queue */
-static struct bio *cudaram_pop_bio(struct cudaram_dev *cudaram) {
-	struct bio *bio = cudaram->bio_first;
+/* Get the first bio in the FIFO with its exact arrival time, 0 if it wasn't timed */
+static struct bio *cudaram_fifo_pop(struct cudaram_fifo *fifo, s64 *arrival) {
+	struct bio *bio = fifo->bio_first;
+
+	*arrival = 0;
 
 	if (bio != NULL) {
-		cudaram->bio_first = bio->bi_next;
-		if (cudaram->bio_last == bio)
-			cudaram->bio_last = NULL;
+		fifo->bio_first = bio->bi_next;
+		if (fifo->bio_last == bio)
+			fifo->bio_last = NULL;
+
+		if (--fifo->stamps[fifo->first_stamp].count == 0) {
+			fifo->first_stamp = (fifo->first_stamp + 1) % CUDARAM_FIFO_STAMPS;
+			--fifo->nr_stamps;
+		}
+
+		if (fifo->nr_times) {
+			*arrival = fifo->times[fifo->first_time];
+			fifo->first_time = (fifo->first_time + 1) % CUDARAM_FIFO_TIMES;
+			--fifo->nr_times;
+		} else {
+			--fifo->nr_untimed;
+		}
 	}
 	return bio;
 }
 
+/* Whether the oldest bio in the FIFO has been waiting for expire jiffies */
+static int cudaram_fifo_expired(struct cudaram_fifo *fifo, unsigned long expire)
+{
+	return fifo->bio_first != NULL &&
+		time_after_eq(jiffies, fifo->stamps[fifo->first_stamp].time + expire);
+}
+
+/* Take all the bios of the FIFO */
+static struct bio *cudaram_fifo_splice(struct cudaram_fifo *fifo)
+{
+	struct bio *bio = fifo->bio_first;
+
+	fifo->bio_first = NULL;
+	fifo->bio_last = NULL;
+	fifo->first_stamp = 0;
+	fifo->nr_stamps = 0;
+	fifo->first_time = 0;
+	fifo->nr_times = 0;
+	fifo->nr_untimed = 0;
+
+	return bio;
+}
+
+/* Add bio to the queue, returns whether the queue was empty */
+static int cudaram_push_bio(struct cudaram_queue *queue, struct bio *bio)
+{
+	int was_empty = cudaram_queue_empty(queue);
+	int dir = bio_data_dir(bio);
+
+	cudaram_fifo_push(&queue->fifos[dir], bio,
+			msecs_to_jiffies(dir == READ ? read_expire_ms : write_expire_ms));
+	cudaram_fifo_time(&queue->fifos[dir]);
+
+	return was_empty;
+}
+
+/* Size of a bio in pages, discards carry no data */
+static unsigned int cudaram_bio_pages(struct bio *bio)
+{
+	return bio->bi_size >> PAGE_SHIFT;
+}
+
+/* One of CUDARAM_READ, CUDARAM_WRITE, CUDARAM_DISCARD and CUDARAM_FLUSH */
+static unsigned int cudaram_bio_dir(struct bio *bio)
+{
+	if (bio->bi_rw & REQ_DISCARD)
+		return CUDARAM_DISCARD;
+	if ((bio->bi_rw & REQ_FLUSH) && !bio->bi_size)
+		return CUDARAM_FLUSH;
+
+	return bio_data_dir(bio) == READ ? CUDARAM_READ : CUDARAM_WRITE;
+}
+
+/*
+ * Whether any of the chained bios needs its data to be durable on completion.
+ * A flush before the data is covered by the same flush after it, the daemon
+ * writes the data out first.
+ */
+static int cudaram_bios_fua(struct bio *bio)
+{
+	for (; bio; bio = bio->bi_next) {
+		if (bio->bi_rw & (REQ_FLUSH | REQ_FUA))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Pick the FIFO to dispatch from next */
+static struct cudaram_fifo *cudaram_pick_fifo(struct cudaram_queue *queue)
+{
+	struct cudaram_fifo *reads = &queue->fifos[READ];
+	struct cudaram_fifo *writes = &queue->fifos[WRITE];
+
+	if (reads->bio_first && (!writes->bio_first ||
+	    cudaram_fifo_expired(reads, msecs_to_jiffies(read_expire_ms)) ||
+	    (!cudaram_fifo_expired(writes, msecs_to_jiffies(write_expire_ms)) &&
+	     queue->reads_dispatched < read_ratio))) {
+		if (writes->bio_first)
+			++queue->reads_dispatched;
+		return reads;
+	}
+
+	queue->reads_dispatched = 0;
+
+	return writes->bio_first ? writes : NULL;
+}
+
+/*
+ * Get the next bio to dispatch together with the bios directly following it
+ * on the device in the same direction, up to max_pages in total for bios with
+ * data. The bios are returned chained through bi_next and are handed to the
+ * daemon as a single work. The time each spent queued is accounted at now.
+ */
+static struct bio *cudaram_pop_bios(struct cudaram_dev *cudaram, struct cudaram_queue *queue,
+		unsigned int max_pages, s64 now)
+{
+	struct cudaram_fifo *fifo = cudaram_pick_fifo(queue);
+	struct bio *first, *last, *next;
+	unsigned int pages, dir;
+	s64 arrival;
+
+	if (!fifo)
+		return NULL;
+
+	first = cudaram_fifo_pop(fifo, &arrival);
+	last = first;
+	pages = cudaram_bio_pages(first);
+	dir = cudaram_bio_dir(first);
+	if (dir == CUDARAM_DISCARD)
+		max_pages = UINT_MAX;
+	if (arrival)
+		cudaram_account_lat(cudaram, CUDARAM_LAT_QUEUE, dir, now - arrival);
+
+	while ((next = fifo->bio_first) != NULL && cudaram_bio_dir(next) == dir &&
+	       next->bi_sector == last->bi_sector + (last->bi_size >> SECTOR_SHIFT) &&
+	       cudaram_bio_pages(next) <= max_pages - pages) {
+		last->bi_next = cudaram_fifo_pop(fifo, &arrival);
+		last = next;
+		pages += cudaram_bio_pages(next);
+		if (arrival)
+			cudaram_account_lat(cudaram, CUDARAM_LAT_QUEUE, dir, now - arrival);
+	}
+	last->bi_next = NULL;
+
+	return first;
+}
+
 /* Flush all the pending bios */
 static void cudaram_flush_bio(struct bio *bio)
 {
@@ -71,12 +300,14 @@ static void cudaram_flush_bio(struct bio *bio)
 	}
 }
 
-static int cudaram_make_request(struct request_queue *queue, struct bio *bio)
+static int cudaram_make_request(struct request_queue *rq, struct bio *bio)
 {
 	int i;
-	int ready;
+	int ready = 0, wake = 0;
+	unsigned int nr_queues, len;
 	struct bio_vec *bvec;
-	struct cudaram_dev *cudaram = queue->queuedata;
+	struct cudaram_dev *cudaram = rq->queuedata;
+	struct cudaram_queue *queue;
 
 	pr_debug("%s sec %zd size %u\n", bio_data_dir(bio) == READ ? "read" : "write", bio->bi_sector, bio->bi_size);
 
@@ -84,24 +315,139 @@ static int cudaram_make_request(struct request_queue *queue, struct bio *bio)
 		pr_debug(" bvec len %u off %u\n", bvec->bv_len, bvec->bv_offset);
 	}
 
-	/* TODO: should spin_lock_irq be used here? */
-	spin_lock(&cudaram->lock);
-	ready = cudaram->state == CUDARAM_STATE_READY;
-	if (ready)
-		cudaram_push_bio(cudaram, bio);
-	spin_unlock(&cudaram->lock);
+	/*
+	 * Queue the bio on the channel mapped to the submitting CPU, being
+	 * migrated in the meantime only costs some locality.
+	 */
+	nr_queues = ACCESS_ONCE(cudaram->nr_queues);
+	if (nr_queues) {
+		queue = &cudaram->queues[raw_smp_processor_id() % nr_queues];
+
+		/* TODO: should spin_lock_irq be used here? */
+		spin_lock(&queue->lock);
+		ready = queue->ready;
+		if (ready) {
+			wake = cudaram_push_bio(queue, bio);
+
+			/* Preemption is disabled under the lock */
+			len = cudaram_queue_len(queue);
+			if (len > __this_cpu_read(cudaram->stats->max_queued))
+				__this_cpu_write(cudaram->stats->max_queued, len);
+
+			/* Only written when clear to keep the line shared while the daemon busy-polls */
+			if (!queue->ring->pending)
+				queue->ring->pending = 1;
+		}
+		spin_unlock(&queue->lock);
+	}
 
-	if (ready)
-		wake_up(&cudaram->new_work);
-	else
+	/* The daemon only sleeps on an empty queue */
+	if (wake)
+		wake_up(&queue->new_work);
+	else if (!ready)
 		bio_io_error(bio);
 
 	return 0;
 }
 
+static const char *const cudaram_dir_names[CUDARAM_NR_DIRS] = { "read", "write", "discard", "flush" };
+static const char *const cudaram_lat_names[CUDARAM_NR_LATS] = { "queue", "copy", "service" };
+
+/* Completed bios and their bytes per direction and the queue depth watermark */
+static int cudaram_stats_show(struct seq_file *m, void *v)
+{
+	struct cudaram_dev *cudaram = m->private;
+	u64 ios[CUDARAM_NR_DIRS] = { 0 }, bytes[CUDARAM_NR_DIRS] = { 0 };
+	unsigned int max_queued = 0;
+	int cpu, dir;
+
+	for_each_possible_cpu(cpu) {
+		struct cudaram_stats *stats = per_cpu_ptr(cudaram->stats, cpu);
+
+		for (dir = 0; dir < CUDARAM_NR_DIRS; ++dir) {
+			ios[dir] += stats->ios[dir];
+			bytes[dir] += stats->bytes[dir];
+		}
+		max_queued = max(max_queued, stats->max_queued);
+	}
+
+	for (dir = 0; dir < CUDARAM_NR_DIRS; ++dir)
+		seq_printf(m, "%s_ios %llu\n%s_bytes %llu\n", cudaram_dir_names[dir], ios[dir],
+				cudaram_dir_names[dir], bytes[dir]);
+	seq_printf(m, "max_queued %u\n", max_queued);
+
+	return 0;
+}
+
+/* A line per stage and direction with the counts of the histogram buckets */
+static int cudaram_latency_show(struct seq_file *m, void *v)
+{
+	struct cudaram_dev *cudaram = m->private;
+	int cpu, lat, dir, i;
+
+	for (lat = 0; lat < CUDARAM_NR_LATS; ++lat) {
+		for (dir = 0; dir < CUDARAM_NR_DIRS; ++dir) {
+			seq_printf(m, "%s_%s", cudaram_lat_names[lat], cudaram_dir_names[dir]);
+
+			for (i = 0; i < CUDARAM_HIST_BUCKETS; ++i) {
+				u64 count = 0;
+
+				for_each_possible_cpu(cpu)
+					count += per_cpu_ptr(cudaram->stats, cpu)->hist[lat][dir][i];
+				seq_printf(m, " %llu", count);
+			}
+			seq_putc(m, '\n');
+		}
+	}
+
+	return 0;
+}
+
+static int cudaram_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, cudaram_stats_show, inode->i_private);
+}
+
+static int cudaram_latency_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, cudaram_latency_show, inode->i_private);
+}
+
+static const struct file_operations cudaram_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = cudaram_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations cudaram_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = cudaram_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* The stats are only informational, the device works without them in debugfs */
+static void cudaram_debugfs_add(struct cudaram_dev *cudaram)
+{
+	if (IS_ERR_OR_NULL(cudaram_debugfs))
+		return;
+
+	cudaram->debugfs = debugfs_create_dir(cudaram->disk->disk_name, cudaram_debugfs);
+	if (!cudaram->debugfs) {
+		pr_err("Error creating the debugfs directory for device %d\n", cudaram->id);
+		return;
+	}
+
+	debugfs_create_file("stats", 0444, cudaram->debugfs, cudaram, &cudaram_stats_fops);
+	debugfs_create_file("latency", 0444, cudaram->debugfs, cudaram, &cudaram_latency_fops);
+}
+
 static struct cudaram_dev *cudaram_alloc(int id)
 {
-	int err;
+	int err, i;
 	struct cudaram_dev *cudaram;
 
 	cudaram = kzalloc(sizeof(*cudaram), GFP_KERNEL);
@@ -112,12 +458,22 @@ static struct cudaram_dev *cudaram_alloc(int id)
 	cudaram->state = CUDARAM_STATE_FREE;
 	spin_lock_init(&cudaram->lock);
 	mutex_init(&cudaram->ctl_lock);
-	init_waitqueue_head(&cudaram->new_work);
+
+	for (i = 0; i < CUDARAM_MAX_CHANNELS; ++i) {
+		spin_lock_init(&cudaram->queues[i].lock);
+		init_waitqueue_head(&cudaram->queues[i].new_work);
+	}
+
+	cudaram->stats = alloc_percpu(struct cudaram_stats);
+	if (!cudaram->stats) {
+		pr_err("Error allocating stats for device %d\n", id);
+		goto err_free_cudaram;
+	}
 
 	cudaram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!cudaram->queue) {
 		pr_err("Error allocating disk queue for device %d\n", id);
-		goto err_free_cudaram;
+		goto err_free_stats;
 	}
 
 	blk_queue_make_request(cudaram->queue, &cudaram_make_request);
@@ -130,6 +486,15 @@ static struct cudaram_dev *cudaram_alloc(int id)
 	blk_queue_io_opt(cudaram->queue, PAGE_SIZE);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, cudaram->queue);
 
+	/* Discards are passed to the daemon, which releases the memory backing them */
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, cudaram->queue);
+	cudaram->queue->limits.discard_granularity = PAGE_SIZE;
+	cudaram->queue->limits.discard_zeroes_data = 1;
+	blk_queue_max_discard_sectors(cudaram->queue, (UINT_MAX >> SECTOR_SHIFT) & ~(SECTORS_PER_PAGE - 1));
+
+	/* The daemon may hold written data in a volatile cache */
+	blk_queue_flush(cudaram->queue, REQ_FLUSH | REQ_FUA);
+
 	cdev_init(&cudaram->ctl, &cudaram_ctl_fops);
 
 	cudaram->disk = alloc_disk(1);
@@ -153,6 +518,8 @@ static struct cudaram_dev *cudaram_alloc(int id)
 	}
 	device_create(cudaram_ctl_class, NULL, MKDEV(MAJOR(cudaram_ctl_number), id), NULL, "cudaramctl%d", id);
 
+	cudaram_debugfs_add(cudaram);
+
 	pr_info("cudaram_alloc() end\n");
 	return cudaram;
 
@@ -160,6 +527,8 @@ err_put_disk:
 	put_disk(cudaram->disk);
 err_cleanup_queue:
 	blk_cleanup_queue(cudaram->queue);
+err_free_stats:
+	free_percpu(cudaram->stats);
 err_free_cudaram:
 	kfree(cudaram);
 
@@ -168,10 +537,12 @@ err_free_cudaram:
 
 static void cudaram_free(struct cudaram_dev *cudaram)
 {
+	debugfs_remove_recursive(cudaram->debugfs);
 	device_destroy(cudaram_ctl_class, MKDEV(MAJOR(cudaram_ctl_number), cudaram->id));
 	cdev_del(&cudaram->ctl);
 	put_disk(cudaram->disk);
 	blk_cleanup_queue(cudaram->queue);
+	free_percpu(cudaram->stats);
 	kfree(cudaram);
 }
 
@@ -196,6 +567,210 @@ static struct cudaram_dev *cudaram_get(int id) {
 	return cudaram;
 }
 
+static struct cudaram_work *cudaram_sq_entry(struct cudaram_channel *channel, unsigned int index)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct cudaram_work *sq = (void *)channel->ring + cudaram->sq_offset;
+
+	return &sq[index & (cudaram->queue_depth - 1)];
+}
+
+static struct cudaram_completion *cudaram_cq_entry(struct cudaram_channel *channel, unsigned int index)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct cudaram_completion *cq = (void *)channel->ring + cudaram->cq_offset;
+
+	return &cq[index & (cudaram->queue_depth - 1)];
+}
+
+/* Allocate the tags and the SQ/CQ rings with an entry for each tag */
+static int cudaram_alloc_channel(struct cudaram_channel *channel, unsigned int ring_size)
+{
+	int i;
+	struct cudaram_dev *cudaram = channel->cudaram;
+	unsigned int queue_depth = cudaram->queue_depth;
+
+	mutex_init(&channel->lock);
+
+	channel->tags = kcalloc(queue_depth, sizeof(*channel->tags), GFP_KERNEL);
+	if (!channel->tags)
+		goto err;
+
+	channel->free_tags = kcalloc(queue_depth, sizeof(*channel->free_tags), GFP_KERNEL);
+	if (!channel->free_tags)
+		goto err_free_tags;
+
+	channel->ring = vmalloc_user(ring_size);
+	if (!channel->ring)
+		goto err_free_free_tags;
+
+	channel->ring->entries = queue_depth;
+	channel->ring->sq_offset = cudaram->sq_offset;
+	channel->ring->cq_offset = cudaram->cq_offset;
+	channel->ring->size = ring_size;
+	channel->ring->window_offset = cudaram->window_offset;
+	if (cudaram->window_offset)
+		channel->ring->window_size = cudaram->channel_size - cudaram->window_offset;
+	channel->ring->channel_size = cudaram->channel_size;
+	channel->ring->buffer_offset = channel->id * queue_depth * cudaram->tag_pages;
+
+	/* Hand out the low tags first */
+	for (i = 0; i < queue_depth; ++i)
+		channel->free_tags[i] = queue_depth - 1 - i;
+	channel->nr_free_tags = queue_depth;
+
+	return 0;
+
+err_free_free_tags:
+	kfree(channel->free_tags);
+err_free_tags:
+	kfree(channel->tags);
+err:
+	return -ENOMEM;
+}
+
+/* Fail all the outstanding work and free the tags and rings */
+static void cudaram_free_channel(struct cudaram_channel *channel)
+{
+	int i;
+
+	for (i = 0; i < channel->cudaram->queue_depth; ++i)
+		cudaram_flush_bio(channel->tags[i].bio);
+
+	kfree(channel->free_tags);
+	kfree(channel->tags);
+	vfree(channel->ring);
+}
+
+/*
+ * Allocate the channels, each gets an equal part of the userspace buffer.
+ *
+ * The mapping of each channel has the rings first followed by the data
+ * window if zero-copy is enabled.
+ */
+static int cudaram_alloc_channels(struct cudaram_dev *cudaram, void __user *buffer, unsigned int nr_channels)
+{
+	int i, err;
+	unsigned int ring_size;
+	unsigned int queue_depth = cudaram->queue_depth;
+	struct cudaram_channel *channels;
+
+	cudaram->sq_offset = L1_CACHE_ALIGN(sizeof(struct cudaram_ring));
+	cudaram->cq_offset = L1_CACHE_ALIGN(cudaram->sq_offset + queue_depth * sizeof(struct cudaram_work));
+	ring_size = PAGE_ALIGN(cudaram->cq_offset + queue_depth * sizeof(struct cudaram_completion));
+
+	cudaram->window_offset = 0;
+	cudaram->channel_size = ring_size;
+	if (cudaram->flags & CUDARAM_FLAG_ZERO_COPY) {
+		cudaram->window_offset = ring_size;
+		cudaram->channel_size += queue_depth * cudaram->tag_pages * PAGE_SIZE;
+	}
+
+	channels = kcalloc(nr_channels, sizeof(*channels), GFP_KERNEL);
+	if (!channels)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_channels; ++i) {
+		channels[i].cudaram = cudaram;
+		channels[i].id = i;
+		channels[i].queue = &cudaram->queues[i];
+
+		err = cudaram_alloc_channel(&channels[i], ring_size);
+		if (err)
+			goto err_free_channels;
+
+		channels[i].user_buffer = buffer + ((unsigned long)channels[i].ring->buffer_offset << PAGE_SHIFT);
+		if (cudaram->buffer)
+			channels[i].buffer = cudaram->buffer + ((unsigned long)channels[i].ring->buffer_offset << PAGE_SHIFT);
+	}
+
+	cudaram->channels = channels;
+	/* Kicks check nr_channels without the ctl_lock */
+	smp_wmb();
+	cudaram->nr_channels = nr_channels;
+
+	return 0;
+
+err_free_channels:
+	while (i-- > 0)
+		cudaram_free_channel(&channels[i]);
+	kfree(channels);
+
+	return err;
+}
+
+static void cudaram_free_channels(struct cudaram_dev *cudaram)
+{
+	int i;
+
+	for (i = 0; i < cudaram->nr_channels; ++i)
+		cudaram_free_channel(&cudaram->channels[i]);
+
+	cudaram->nr_channels = 0;
+	kfree(cudaram->channels);
+	cudaram->channels = NULL;
+}
+
+/*
+ * Pin the pages of the userspace buffer and map them in the kernel so that
+ * the data is copied with plain memcpy instead of copy_{to,from}_user.
+ *
+ * Memory that can't be pinned, e.g. mapped by a driver, keeps going through
+ * the user copies.
+ */
+static void cudaram_pin_buffer(struct cudaram_dev *cudaram, unsigned long buffer, unsigned int nr_pages)
+{
+	int pinned;
+	struct page **pages;
+
+	if (buffer & ~PAGE_MASK)
+		return;
+
+	pages = vmalloc(nr_pages * sizeof(*pages));
+	if (!pages)
+		return;
+
+	down_read(&current->mm->mmap_sem);
+	pinned = get_user_pages(current, current->mm, buffer, nr_pages, 1, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+
+	if (pinned == nr_pages) {
+		cudaram->buffer = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+		if (cudaram->buffer) {
+			cudaram->buffer_pages = pages;
+			cudaram->nr_buffer_pages = nr_pages;
+			return;
+		}
+	}
+
+	pr_info("Couldn't pin the buffer of device %d, copying through the user mapping\n", cudaram->id);
+
+	while (pinned-- > 0)
+		page_cache_release(pages[pinned]);
+	vfree(pages);
+}
+
+/* The kernel wrote to the pages through its own mapping, mark them dirty for the daemon */
+static void cudaram_unpin_buffer(struct cudaram_dev *cudaram)
+{
+	unsigned int i;
+
+	if (!cudaram->buffer)
+		return;
+
+	vunmap(cudaram->buffer);
+	cudaram->buffer = NULL;
+
+	for (i = 0; i < cudaram->nr_buffer_pages; ++i) {
+		set_page_dirty_lock(cudaram->buffer_pages[i]);
+		page_cache_release(cudaram->buffer_pages[i]);
+	}
+
+	vfree(cudaram->buffer_pages);
+	cudaram->buffer_pages = NULL;
+	cudaram->nr_buffer_pages = 0;
+}
+
 /**
  * Take the device.
  *
@@ -224,6 +799,7 @@ static int cudaram_take(struct cudaram_dev *cudaram)
  */
 static int cudaram_activate(struct cudaram_dev *cudaram, struct cudaram_params __user *uparams)
 {
+	int err, i;
 	unsigned int state;
 	struct cudaram_params params;
 	struct block_device *bdev;
@@ -240,9 +816,39 @@ static int cudaram_activate(struct cudaram_dev *cudaram, struct cudaram_params _
 	if (copy_from_user(&params, uparams, sizeof(params)))
 		return -EFAULT;
 
-	cudaram->user_buffer = (void *)params.buffer;
+	if (!is_power_of_2(params.queue_depth) || params.queue_depth > CUDARAM_MAX_QUEUE_DEPTH)
+		return -EINVAL;
+
+	if (params.channels == 0 || params.channels > CUDARAM_MAX_CHANNELS)
+		return -EINVAL;
+
+	/* Each tag needs to fit at least a single page */
+	cudaram->tag_pages = (params.buffer_size << (MB_SHIFT - PAGE_SHIFT)) / (params.queue_depth * params.channels);
+	if (cudaram->tag_pages == 0)
+		return -EINVAL;
+
+	cudaram->queue_depth = params.queue_depth;
+	cudaram->flags = params.flags;
+
+	cudaram_pin_buffer(cudaram, params.buffer, params.buffer_size << (MB_SHIFT - PAGE_SHIFT));
+
+	err = cudaram_alloc_channels(cudaram, (void __user *)params.buffer, params.channels);
+	if (err) {
+		cudaram_unpin_buffer(cudaram);
+		return err;
+	}
 
-	blk_queue_max_hw_sectors(cudaram->queue, params.buffer_size << (MB_SHIFT - SECTOR_SHIFT));
+	/* A hardware queue per channel, the CPUs are spread over them */
+	for (i = 0; i < params.channels; ++i) {
+		spin_lock(&cudaram->queues[i].lock);
+		cudaram->queues[i].ring = cudaram->channels[i].ring;
+		cudaram->queues[i].ready = 1;
+		spin_unlock(&cudaram->queues[i].lock);
+	}
+	cudaram->nr_queues = params.channels;
+
+	/* Any bio has to fit in a single tag's slice of the buffer */
+	blk_queue_max_hw_sectors(cudaram->queue, cudaram->tag_pages << SECTORS_PER_PAGE_SHIFT);
 	set_capacity(cudaram->disk, params.capacity << (MB_SHIFT - SECTOR_SHIFT));
 
 	spin_lock(&cudaram->lock);
@@ -254,6 +860,7 @@ static int cudaram_activate(struct cudaram_dev *cudaram, struct cudaram_params _
 
 static void cudaram_deactivate(struct cudaram_dev *cudaram)
 {
+	int i;
 	struct bio *bio;
 	struct block_device *bdev;
 	unsigned int state;
@@ -261,12 +868,31 @@ static void cudaram_deactivate(struct cudaram_dev *cudaram)
 	spin_lock(&cudaram->lock);
 	state = cudaram->state;
 	cudaram->state = CUDARAM_STATE_FREE;
-	bio = cudaram->bio_first;
-	cudaram->bio_first = NULL;
-	cudaram->bio_last = NULL;
 	spin_unlock(&cudaram->lock);
 
-	cudaram_flush_bio(bio);
+	cudaram->nr_queues = 0;
+
+	/* make_request may still have picked any of the queues */
+	for (i = 0; i < CUDARAM_MAX_CHANNELS; ++i) {
+		struct cudaram_queue *queue = &cudaram->queues[i];
+		struct bio *writes;
+
+		spin_lock(&queue->lock);
+		queue->ready = 0;
+		queue->ring = NULL;
+		queue->reads_dispatched = 0;
+		bio = cudaram_fifo_splice(&queue->fifos[READ]);
+		writes = cudaram_fifo_splice(&queue->fifos[WRITE]);
+		spin_unlock(&queue->lock);
+
+		cudaram_flush_bio(bio);
+		cudaram_flush_bio(writes);
+	}
+
+	mutex_lock(&cudaram->ctl_lock);
+	cudaram_free_channels(cudaram);
+	cudaram_unpin_buffer(cudaram);
+	mutex_unlock(&cudaram->ctl_lock);
 
 	/* TODO: Could be nice to remove the disk here */
 	bdev = bdget_disk(cudaram->disk, 0);
@@ -288,6 +914,7 @@ static int cudaram_ctl_open(struct inode *inode, struct file *filp)
 		return -EBUSY;
 
 	filp->private_data = cudaram;
+	cudaram->ctl_file = filp;
 
 	return 0;
 }
@@ -304,124 +931,406 @@ static int cudaram_ctl_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
-/* Process work done - acknowledge the writes, get data for reads */
-static int cudaram_process_work(struct cudaram_dev *cudaram, struct cudaram_work *work)
+/* Copy the bio data from the userspace buffer - done for completed reads */
+static int cudaram_copy_from_buffer(struct cudaram_channel *channel, struct bio *bio, unsigned int offset)
 {
 	int err, i;
-	struct bio *bio = cudaram->current_work;
+	struct bio_vec *bvec;
 
-	if (work->id == 0)
-		return 0;
-	
-	if (!bio)
-		return 0;
+	bio_for_each_segment(bvec, bio, i) {
+		void *kdata;
+		void __user *udata;
+
+		if (channel->buffer) {
+			kdata = kmap_atomic(bvec->bv_page, KM_USER0);
+			memcpy(kdata + bvec->bv_offset, channel->buffer + PAGE_SIZE * (offset + i) + bvec->bv_offset,
+					bvec->bv_len);
+			kunmap_atomic(kdata, KM_USER0);
+			flush_dcache_page(bvec->bv_page);
+			continue;
+		}
 
-	if ((__u64)bio != work->id) {
-		pr_err("Bad work id %llu != %llu", (__u64)cudaram->current_work, work->id);
-		return -1;
-	}
-
-	pr_debug("process work %s len %u first_page %u\n",
-			work->dir == READ ? "read" : "write", work->len, work->first_page);
-	
-	/* We only need to copy the data if a read request was completed */
-	if (bio_data_dir(bio) == READ) {
-		struct bio_vec *bvec;
-		bio_for_each_segment(bvec, bio, i) {
-			void *kdata = kmap(bvec->bv_page);
-			void __user *udata = cudaram->user_buffer + PAGE_SIZE * i;
-			err = copy_from_user(kdata + bvec->bv_offset, udata + bvec->bv_offset, bvec->bv_len);
-			kunmap(kdata);
-			if (err) {
-				pr_err("Bad copy_from_user for %d", i);
-				return err;
-			}
+		kdata = kmap(bvec->bv_page);
+		udata = channel->user_buffer + PAGE_SIZE * (offset + i);
+		err = copy_from_user(kdata + bvec->bv_offset, udata + bvec->bv_offset, bvec->bv_len);
+		kunmap(kdata);
+		if (err) {
+			pr_err("Bad copy_from_user for %d", i);
+			return -EFAULT;
 		}
 	}
 
-	/* Reset the id so that it won't be resubmitted */
-	work->id = 0;
+	return 0;
+}
+
+/* Copy the bio data to the userspace buffer - done for new writes */
+static int cudaram_copy_to_buffer(struct cudaram_channel *channel, struct bio *bio, unsigned int offset)
+{
+	int err, i;
+	struct bio_vec *bvec;
 
-	/* current_work completed */
-	cudaram->current_work = NULL;
-	bio_endio(bio, 0);
+	bio_for_each_segment(bvec, bio, i) {
+		void *kdata;
+		void __user *udata;
+
+		if (channel->buffer) {
+			kdata = kmap_atomic(bvec->bv_page, KM_USER0);
+			memcpy(channel->buffer + PAGE_SIZE * (offset + i), kdata, PAGE_SIZE);
+			kunmap_atomic(kdata, KM_USER0);
+			continue;
+		}
+
+		kdata = kmap(bvec->bv_page);
+		udata = channel->user_buffer + PAGE_SIZE * (offset + i);
+		err = copy_to_user(udata, kdata, PAGE_SIZE);
+		kunmap(kdata);
+		if (err) {
+			pr_err("copy_to_user failed");
+			return -EFAULT;
+		}
+	}
 
 	return 0;
 }
 
-static int cudaram_get_work(struct cudaram_dev *cudaram, struct cudaram_work *work)
+/* Whether the page can be inserted in the data window */
+static int cudaram_page_mappable(struct page *page)
 {
-	int i, err;
-	struct bio *bio;
+	/* vm_insert_page() accounts the page as a file page */
+	return !PageSlab(page) && !PageAnon(page) && page->mapping;
+}
 
-	if (cudaram->current_work) {
-		/* Already have work to do - shouldn't really happen */
-		bio = cudaram->current_work;
-	} else {
-		/* Get first bio from the pending list */
-		spin_lock(&cudaram->lock);
-		bio = cudaram_pop_bio(cudaram);
-		cudaram->current_work = bio;
-		spin_unlock(&cudaram->lock);
+/* Get the data window VMA of the channel, must be called with mmap_sem held */
+static struct vm_area_struct *cudaram_window_vma(struct cudaram_channel *channel)
+{
+	struct vm_area_struct *vma;
+
+	if (!channel->window_start)
+		return NULL;
+
+	vma = find_vma(current->mm, channel->window_start);
+	if (!vma || vma->vm_start != channel->window_start || vma->vm_private_data != channel)
+		return NULL;
+
+	return vma;
+}
+
+/* Unmap pages from the channel's data window, offset and len in pages */
+static void cudaram_unmap_window(struct cudaram_channel *channel, unsigned int offset, unsigned int len)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+	loff_t start = (loff_t)channel->id * cudaram->channel_size + cudaram->window_offset +
+		((loff_t)offset << PAGE_SHIFT);
+
+	unmap_mapping_range(cudaram->window_mapping, start, (loff_t)len << PAGE_SHIFT, 1);
+}
+
+/* Map the bio pages read-only into the data window at the given offset */
+static int cudaram_map_bio(struct cudaram_channel *channel, struct bio *bio, unsigned int offset)
+{
+	int i, err = 0;
+	struct bio_vec *bvec;
+	struct vm_area_struct *vma;
+	unsigned long addr;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvec->bv_offset || bvec->bv_len != PAGE_SIZE || !cudaram_page_mappable(bvec->bv_page))
+			return -EINVAL;
 	}
 
-	/* Shouldn't really happen either, but check to be safe */
-	if (unlikely(!bio)) {
-		work->id = 0;
-		work->len = 0;
-		return 0;
+	down_read(&current->mm->mmap_sem);
+
+	vma = cudaram_window_vma(channel);
+	if (!vma) {
+		err = -ENXIO;
+		goto out;
 	}
 
-	work->id = (__u64)bio;
+	addr = vma->vm_start + ((unsigned long)offset << PAGE_SHIFT);
+	bio_for_each_segment(bvec, bio, i) {
+		err = vm_insert_page(vma, addr + ((unsigned long)i << PAGE_SHIFT), bvec->bv_page);
+		if (err) {
+			cudaram_unmap_window(channel, offset, i);
+			break;
+		}
+	}
+
+out:
+	up_read(&current->mm->mmap_sem);
+
+	return err;
+}
+
+/* Map the pages of chained written bios into the data window one after another, all or none */
+static int cudaram_map_bios(struct cudaram_channel *channel, struct bio *bio, unsigned int offset)
+{
+	int err;
+	unsigned int pages = 0;
+
+	for (; bio; bio = bio->bi_next) {
+		err = cudaram_map_bio(channel, bio, offset + pages);
+		if (err) {
+			if (pages)
+				cudaram_unmap_window(channel, offset, pages);
+			return err;
+		}
+		pages += bio_segments(bio);
+	}
+
+	return 0;
+}
+
+/* Copy chained written bios to the userspace buffer one after another */
+static int cudaram_copy_bios_to_buffer(struct cudaram_channel *channel, struct bio *bio, unsigned int offset)
+{
+	for (; bio; bio = bio->bi_next) {
+		if (cudaram_copy_to_buffer(channel, bio, offset))
+			return -EFAULT;
+		offset += bio_segments(bio);
+	}
+
+	return 0;
+}
+
+/* Process the completions posted by the daemon - acknowledge the writes, get data for reads */
+static int cudaram_reap_completions(struct cudaram_channel *channel)
+{
+	int err;
+	struct cudaram_dev *cudaram = channel->cudaram;
+	unsigned int head = channel->cq_head;
+	unsigned int tail = ACCESS_ONCE(channel->ring->cq_tail);
+	s64 now = cudaram_now();
+
+	if (tail - head > cudaram->queue_depth) {
+		pr_err("Bad CQ tail %u head %u\n", tail, head);
+		return -EINVAL;
+	}
 
-	work->dir = bio_data_dir(bio);
-	work->len = bio_segments(bio);
-	work->first_page = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	/* Read the entries only after reading the tail */
+	smp_rmb();
 
-	if (work->dir == WRITE) {
-		struct bio_vec *bvec;
-		bio_for_each_segment(bvec, bio, i) {
-			void *kdata = kmap(bvec->bv_page);
-			void __user *udata = cudaram->user_buffer + PAGE_SIZE * i;
-			err = copy_to_user(udata, kdata, PAGE_SIZE);
-			kunmap(kdata);
-			if (err) {
-				pr_err("copy_to_user failed");
-				return -EFAULT;
+	for (; head != tail; ++head) {
+		struct cudaram_completion *comp = cudaram_cq_entry(channel, head);
+		__u64 id = ACCESS_ONCE(comp->id);
+		struct cudaram_tag *tag;
+		struct bio *bio;
+		unsigned int offset, dir;
+		s64 copy = 0;
+
+		if (id >= cudaram->queue_depth || !channel->tags[id].bio) {
+			pr_err("Bad work id %llu\n", id);
+			return -EINVAL;
+		}
+
+		tag = &channel->tags[id];
+		bio = tag->bio;
+		dir = tag->dir;
+
+		offset = id * cudaram->tag_pages;
+		cudaram_account_lat(cudaram, CUDARAM_LAT_SERVICE, dir, now - tag->published);
+
+		if (tag->mapped) {
+			cudaram_unmap_window(channel, offset, tag->len);
+			tag->mapped = 0;
+		}
+
+		pr_debug("process work %s len %u first_page %u\n",
+				bio_data_dir(bio) == READ ? "read" : "write", tag->len,
+				(unsigned int)(bio->bi_sector >> SECTORS_PER_PAGE_SHIFT));
+
+		tag->bio = NULL;
+		channel->free_tags[channel->nr_free_tags++] = id;
+
+		/* All the merged bios complete together */
+		while (bio) {
+			struct bio *next = bio->bi_next;
+
+			bio->bi_next = NULL;
+			err = ACCESS_ONCE(comp->error) ? -EIO : 0;
+
+			this_cpu_inc(cudaram->stats->ios[dir]);
+			this_cpu_add(cudaram->stats->bytes[dir], bio->bi_size);
+
+			/* We only need to copy the data if a read request was completed */
+			if (!err && bio_data_dir(bio) == READ) {
+				s64 start = cudaram_now();
+
+				err = cudaram_copy_from_buffer(channel, bio, offset);
+				copy += cudaram_now() - start;
 			}
+
+			offset += bio_segments(bio);
+			bio_endio(bio, err);
+			bio = next;
 		}
+
+		if (dir == CUDARAM_READ && !ACCESS_ONCE(comp->error))
+			cudaram_account_lat(cudaram, CUDARAM_LAT_COPY, dir, copy);
+
+		channel->cq_head = head + 1;
+		channel->ring->cq_head = head + 1;
 	}
 
 	return 0;
 }
 
-/* Process completed work and return new work */
-static int cudaram_work(struct cudaram_dev *cudaram, struct cudaram_work __user *user_work)
+/* Publish pending work in the SQ while there are free tags, returns the number of entries published */
+static unsigned int cudaram_publish_work(struct cudaram_channel *channel)
 {
-	struct cudaram_work work;
-	int err = 0;
+	struct cudaram_dev *cudaram = channel->cudaram;
+	struct cudaram_queue *queue = channel->queue;
+	unsigned int published = 0;
+	unsigned int tail = channel->sq_tail;
+
+	/* The SQ has an entry for each tag so it can only be full if the daemon misbehaves */
+	while (channel->nr_free_tags && tail - ACCESS_ONCE(channel->ring->sq_head) < cudaram->queue_depth) {
+		struct cudaram_work *work;
+		struct cudaram_tag *tag;
+		struct bio *bio, *next;
+		unsigned int id, offset, dir, len = 0;
+		s64 start = cudaram_now();
+
+		spin_lock(&queue->lock);
+		bio = cudaram_pop_bios(cudaram, queue, cudaram->tag_pages, start);
+		spin_unlock(&queue->lock);
+
+		if (!bio)
+			break;
 
-	if (copy_from_user(&work, user_work, sizeof(work)))
-		return -EFAULT;
+		id = channel->free_tags[channel->nr_free_tags - 1];
+		tag = &channel->tags[id];
+		offset = id * cudaram->tag_pages;
+		dir = cudaram_bio_dir(bio);
 
-	err = cudaram_process_work(cudaram, &work);
+		tag->mapped = dir == CUDARAM_WRITE &&
+			(cudaram->flags & CUDARAM_FLAG_ZERO_COPY) &&
+			cudaram_map_bios(channel, bio, offset) == 0;
+
+		if (dir == CUDARAM_WRITE && !tag->mapped &&
+		    cudaram_copy_bios_to_buffer(channel, bio, offset)) {
+			cudaram_flush_bio(bio);
+			continue;
+		}
+
+		for (next = bio; next; next = next->bi_next)
+			len += cudaram_bio_pages(next);
+
+		--channel->nr_free_tags;
+		tag->bio = bio;
+		tag->len = len;
+		tag->dir = dir;
+		tag->published = cudaram_now();
+		if (dir == CUDARAM_WRITE)
+			cudaram_account_lat(cudaram, CUDARAM_LAT_COPY, dir, tag->published - start);
+
+		work = cudaram_sq_entry(channel, tail);
+		work->id = id;
+		work->dir = dir;
+		work->len = len;
+		work->first_page = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+		work->offset = offset;
+		work->flags = tag->mapped ? CUDARAM_WORK_MAPPED : 0;
+		if (dir == CUDARAM_WRITE && cudaram_bios_fua(bio))
+			work->flags |= CUDARAM_WORK_FUA;
+
+		++tail;
+		++published;
+	}
+
+	if (published) {
+		/* Make the entries visible before the tail */
+		smp_wmb();
+		channel->sq_tail = tail;
+		channel->ring->sq_tail = tail;
+	}
+
+	return published;
+}
+
+/*
+ * Process completed work and publish new work.
+ *
+ * Only waits for new work if the channel has nothing outstanding and the kick
+ * may block, otherwise it returns right away so the daemon can keep completing
+ * its work or poll for more.
+ */
+static int cudaram_kick(struct cudaram_channel *channel, int nonblock)
+{
+	int err;
+	struct cudaram_dev *cudaram = channel->cudaram;
+
+	err = cudaram_reap_completions(channel);
 	if (err)
 		return err;
 
-	/* Reset the id so that it won't be returned to the daemon again if we get interrupted */
-	work.id = 0;
+	if (cudaram_publish_work(channel) || channel->nr_free_tags != cudaram->queue_depth || nonblock)
+		return 0;
 
-	/* TODO: Is the != NULL check safe w/o locking? */
-	if (wait_event_interruptible(cudaram->new_work, cudaram->bio_first != NULL)) {
-		err = -ERESTARTSYS;
-		goto out;
-	}
+	/* The lockless check can't miss a wake-up, see cudaram_queue_empty() */
+	if (wait_event_interruptible(channel->queue->new_work, !cudaram_queue_empty(channel->queue)))
+		return -ERESTARTSYS;
 
-	cudaram_get_work(cudaram, &work);
+	cudaram_publish_work(channel);
 
-out:
-	if (copy_to_user(user_work, &work, sizeof(work)))
-		return -EFAULT;
+	return 0;
+}
+
+static void cudaram_window_close(struct vm_area_struct *vma)
+{
+	struct cudaram_channel *channel = vma->vm_private_data;
+
+	channel->window_start = 0;
+}
+
+static const struct vm_operations_struct cudaram_window_vm_ops = {
+	.close = &cudaram_window_close,
+};
+
+/* Set up a channel's data window, bio pages are inserted into it as needed */
+static int cudaram_mmap_window(struct cudaram_channel *channel, struct file *filp, struct vm_area_struct *vma)
+{
+	struct cudaram_dev *cudaram = channel->cudaram;
+
+	if (channel->window_start)
+		return -EBUSY;
+
+	if (vma->vm_end - vma->vm_start != cudaram->channel_size - cudaram->window_offset)
+		return -EINVAL;
+
+	/* The daemon must not be able to modify the bio pages */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_RESERVED;
+
+	vma->vm_ops = &cudaram_window_vm_ops;
+	vma->vm_private_data = channel;
+	channel->window_start = vma->vm_start;
+	cudaram->window_mapping = filp->f_mapping;
+
+	return 0;
+}
+
+static int cudaram_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int err = -EINVAL;
+	struct cudaram_dev *cudaram = filp->private_data;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (!cudaram)
+		return -ENODEV;
+
+	mutex_lock(&cudaram->ctl_lock);
+	if (cudaram->nr_channels && offset / cudaram->channel_size < cudaram->nr_channels) {
+		struct cudaram_channel *channel = &cudaram->channels[offset / cudaram->channel_size];
+
+		offset %= cudaram->channel_size;
+		if (offset == 0)
+			err = remap_vmalloc_range(vma, channel->ring, 0);
+		else if (offset == cudaram->window_offset)
+			err = cudaram_mmap_window(channel, filp, vma);
+	}
+	mutex_unlock(&cudaram->ctl_lock);
 
 	return err;
 }
@@ -430,25 +1339,44 @@ static long cudaram_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long
 {
 	int err = 0;
 	struct cudaram_dev *cudaram = filp->private_data;
+	struct cudaram_channel *channel;
 
 	if (!cudaram || !cudaram->disk)
 		return -ENODEV;
 
-	mutex_lock(&cudaram->ctl_lock);
-
 	switch (cmd) {
-		case CUDARAM_WORK:
-			err = cudaram_work(cudaram, (struct cudaram_work __user *)arg);
+		case CUDARAM_KICK:
+			if (arg >= ACCESS_ONCE(cudaram->nr_channels))
+				return -EINVAL;
+			/* Read the channels only after nr_channels */
+			smp_rmb();
+			channel = &cudaram->channels[arg];
+
+			mutex_lock(&channel->lock);
+			err = cudaram_kick(channel, 0);
+			mutex_unlock(&channel->lock);
+			break;
+		case CUDARAM_CHANNEL_FD:
+			if (arg >= ACCESS_ONCE(cudaram->nr_channels))
+				return -EINVAL;
+			smp_rmb();
+			channel = &cudaram->channels[arg];
+
+			/* The channel lives until the control device is released */
+			get_file(filp);
+			err = anon_inode_getfd("[cudaram-channel]", &cudaram_channel_fops, channel, O_RDWR | O_CLOEXEC);
+			if (err < 0)
+				fput(filp);
 			break;
 		case CUDARAM_ACTIVATE:
+			mutex_lock(&cudaram->ctl_lock);
 			err = cudaram_activate(cudaram, (struct cudaram_params __user *)arg);
+			mutex_unlock(&cudaram->ctl_lock);
 			break;
 		default:
 			err = -EINVAL;
 	}
 
-	mutex_unlock(&cudaram->ctl_lock);
-
 	return err;
 }
 
@@ -457,6 +1385,49 @@ static const struct file_operations cudaram_ctl_fops = {
 	.open = &cudaram_ctl_open,
 	.release = &cudaram_ctl_release,
 	.unlocked_ioctl = &cudaram_ctl_ioctl,
+	.mmap = &cudaram_ctl_mmap,
+};
+
+/* Readable when new work is pending, the daemon kicks the channel then */
+static unsigned int cudaram_channel_poll(struct file *filp, poll_table *wait)
+{
+	struct cudaram_channel *channel = filp->private_data;
+
+	poll_wait(filp, &channel->queue->new_work, wait);
+
+	/* Checked after poll_wait() so that a racing push wakes us up, see cudaram_queue_empty() */
+	return cudaram_queue_empty(channel->queue) ? 0 : POLLIN | POLLRDNORM;
+}
+
+static long cudaram_channel_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	int err;
+	struct cudaram_channel *channel = filp->private_data;
+
+	if (cmd != CUDARAM_KICK)
+		return -EINVAL;
+
+	mutex_lock(&channel->lock);
+	err = cudaram_kick(channel, 1);
+	mutex_unlock(&channel->lock);
+
+	return err;
+}
+
+static int cudaram_channel_release(struct inode *inode, struct file *filp)
+{
+	struct cudaram_channel *channel = filp->private_data;
+
+	fput(channel->cudaram->ctl_file);
+
+	return 0;
+}
+
+static const struct file_operations cudaram_channel_fops = {
+	.owner = THIS_MODULE,
+	.release = &cudaram_channel_release,
+	.poll = &cudaram_channel_poll,
+	.unlocked_ioctl = &cudaram_channel_ioctl,
 };
 
 static const struct block_device_operations cudaram_bops = {
@@ -487,6 +1458,8 @@ static int __init cudaram_init(void)
 		goto err_unregister_chrdev;
 	}
 
+	cudaram_debugfs = debugfs_create_dir("cudaram", NULL);
+
 	if (num_devices == 0)
 		num_devices = DEFAULT_NUM_DEVICES;
 	if (num_devices > MAX_DEVICES)
@@ -515,6 +1488,7 @@ err_free_devices:
 		list_del(&cudaram->list);
 		cudaram_free(cudaram);
 	}
+	debugfs_remove_recursive(cudaram_debugfs);
 err_unregister_chrdev:
 	unregister_chrdev_region(cudaram_ctl_number, 1);
 err_class_destroy:
@@ -532,6 +1506,7 @@ static void __exit cudaram_exit(void)
 		del_gendisk(cudaram->disk);
 		cudaram_free(cudaram);
 	}
+	debugfs_remove_recursive(cudaram_debugfs);
 
 	unregister_blkdev(cudaram_major, "cudaram");
 	unregister_chrdev_region(cudaram_ctl_number, 1);
@@ -544,6 +1519,15 @@ module_exit(cudaram_exit);
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of cudaram devices");
 
+module_param(read_expire_ms, uint, 0644);
+MODULE_PARM_DESC(read_expire_ms, "Time after which a pending read is dispatched before any writes");
+
+module_param(write_expire_ms, uint, 0644);
+MODULE_PARM_DESC(write_expire_ms, "Time after which a pending write is dispatched before non-expired reads");
+
+module_param(read_ratio, uint, 0644);
+MODULE_PARM_DESC(read_ratio, "Number of reads dispatched for each write when both are pending");
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Piotr Jaroszyński <p.jaroszynski@gmail.com>");
 MODULE_DESCRIPTION("CUDA RAM Block Device");
@@ -11,18 +11,89 @@ struct cudaram_params {
 	__u64 capacity; /* capacity in MB */
 	__u64 buffer; /* userspace buffer */
 	__u32 buffer_size; /* size of the userspace buffer in MB */
+	__u32 queue_depth; /* number of tags, also the size of the SQ and CQ, a power of 2 */
+	__u32 flags; /* CUDARAM_FLAG_* */
+	__u32 channels; /* number of channels, each with its own SQ/CQ and queue_depth tags */
 };
 
+/*
+ * Map the pages of written bios into the data window of the control device
+ * instead of copying them to the userspace buffer. Only done for page cache
+ * pages, anything else still goes through the buffer.
+ */
+#define CUDARAM_FLAG_ZERO_COPY (1 << 0)
+
+/* Submission queue entry, produced by the kernel */
 struct cudaram_work {
-	__u64 id;
+	__u64 id; /* tag of the work, completions can be posted in any order */
 	__u32 dir;
 	__u32 len;
 	__u32 first_page;
+	__u32 offset; /* offset of the data in the channel's part of the userspace buffer or its data window in pages */
+	__u32 flags; /* CUDARAM_WORK_* */
+	__u32 reserved;
+};
+
+#define CUDARAM_WORK_MAPPED (1 << 0) /* the data is in the data window */
+#define CUDARAM_WORK_FUA    (1 << 1) /* the written data has to be durable when the work completes */
+
+/* cudaram_work dir values, the first two match READ and WRITE in the kernel */
+#define CUDARAM_READ    0
+#define CUDARAM_WRITE   1
+#define CUDARAM_DISCARD 2 /* no data, the pages read back as zeros afterwards */
+#define CUDARAM_FLUSH   3 /* no data, the completed writes have to be durable when the work completes */
+
+/* Completion queue entry, produced by the daemon */
+struct cudaram_completion {
+	__u64 id; /* id of the completed cudaram_work */
+	__s32 error; /* 0 or a negative errno */
+	__u32 reserved;
+};
+
+/*
+ * Header of the SQ/CQ rings of a channel, mmap-ed from the control device at
+ * offset channel * channel_size.
+ *
+ * Heads and tails are free running and masked with (entries - 1). Each index
+ * is written by one side only: the kernel publishes work at sq_tail and
+ * consumes completions at cq_head, the daemon consumes work at sq_head and
+ * publishes completions at cq_tail. The CUDARAM_KICK ioctl, with the channel
+ * as the argument, hands the completions back and refills the SQ. It only
+ * sleeps if the channel has no work outstanding.
+ *
+ * CUDARAM_CHANNEL_FD returns a new fd for the channel given as the argument
+ * so that a daemon can serve many channels, or devices, from a single thread.
+ * CUDARAM_KICK on a channel fd ignores its argument and never sleeps, the fd
+ * polls readable when the channel has new work pending instead. The channel
+ * fds keep the control device open.
+ *
+ * The kernel also sets pending whenever it queues bios for the channel, the
+ * daemon can busy-poll it and clear it before kicking to pick up new work
+ * without sleeping in the kick or poll.
+ */
+struct cudaram_ring {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 entries;
+	__u32 sq_offset; /* offset of the SQ entries from the start of the ring */
+	__u32 cq_offset; /* offset of the CQ entries from the start of the ring */
+	__u32 size; /* size of the ring mapping in bytes */
+	__u32 window_offset; /* offset of the read-only data window from the ring, 0 if not zero-copy */
+	__u32 window_size; /* size of the data window in bytes */
+	__u32 channel_size; /* mmap offset distance between consecutive channels */
+	__u32 buffer_offset; /* offset of the channel's part of the userspace buffer in pages */
+	__u32 pending; /* set by the kernel when new bios are queued, cleared by the daemon */
 };
 
+#define CUDARAM_MAX_QUEUE_DEPTH 4096
+#define CUDARAM_MAX_CHANNELS 64
+
 /* 0xF1 is currently free - see Documentation/ioctl/ioctl-number.txt */
 #define CUDARAM_ACTIVATE  _IOW(0xF1, 1, struct cudaram_params)
-#define CUDARAM_WORK     _IOWR(0xF1, 2, struct cudaram_work)
+#define CUDARAM_KICK       _IO(0xF1, 2)
+#define CUDARAM_CHANNEL_FD _IO(0xF1, 3)
 
 #ifdef __KERNEL__
 
@@ -30,6 +101,7 @@ struct cudaram_work {
 #include <linux/list.h>
 #include <linux/genhd.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/spinlock.h>
 
 #define MB_SHIFT 20
@@ -43,23 +115,152 @@ struct cudaram_work {
 #define CUDARAM_STATE_TAKEN   1 /* control device taken */
 #define CUDARAM_STATE_READY   2 /* ready to service requests */
 
+/* Work published in the SQ and not completed yet, owns a slice of the channel's buffer */
+struct cudaram_tag {
+	struct bio *bio; /* adjacent bios merged into the work, chained through bi_next */
+	unsigned int len; /* pages of all the bios */
+	int mapped; /* bio pages are mapped in the data window */
+	unsigned int dir; /* CUDARAM_* dir of the bios */
+	s64 published; /* time the work was published in the SQ in ns */
+};
+
+#define CUDARAM_FIFO_STAMPS 8
+#define CUDARAM_FIFO_TIMES 32
+
+/* FIFO of pending bios of a single direction */
+struct cudaram_fifo {
+	struct bio *bio_first; /* list of pending bios */
+	struct bio *bio_last; /* last bio for quick addition */
+
+	/*
+	 * Arrival times of the bios, oldest first. Bios arriving within a
+	 * fraction of the deadline of each other share a stamp so that a few
+	 * stamps cover the whole deadline. Only the oldest is checked.
+	 */
+	struct {
+		unsigned long time; /* in jiffies */
+		unsigned int count; /* number of bios */
+	} stamps[CUDARAM_FIFO_STAMPS];
+	unsigned int first_stamp;
+	unsigned int nr_stamps;
+
+	/*
+	 * Exact arrival times of the first bios in ns for the latency stats.
+	 * Bios arriving while it's full go untimed, and so do the ones after
+	 * them until those are gone to keep the times in the order of the bios.
+	 */
+	s64 times[CUDARAM_FIFO_TIMES];
+	unsigned int first_time;
+	unsigned int nr_times;
+	unsigned int nr_untimed;
+};
+
+/*
+ * Queue of pending bios, the hardware queue of a channel.
+ *
+ * Each CPU submits to the queue of a single channel so that CPUs sharing a
+ * queue are the only ones contending on its lock and cache line.
+ *
+ * Reads and writes are queued separately. Reads are preferred, up to
+ * read_ratio of them are dispatched for each write, unless the oldest write
+ * is past its deadline and the oldest read is not.
+ */
+struct cudaram_queue {
+	spinlock_t lock; /* protect from make_request/kick races */
+	int ready; /* accepting bios, the device is active */
+	wait_queue_head_t new_work; /* woken up on new work */
+	struct cudaram_ring *ring; /* ring of the channel, valid while ready */
+	struct cudaram_fifo fifos[2]; /* indexed by READ/WRITE */
+	unsigned int reads_dispatched; /* reads dispatched ahead of pending writes */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Channel serving a single daemon thread.
+ *
+ * Each channel has its own SQ/CQ, tags and part of the userspace buffer, and
+ * its kicks are serialized separately so that the daemon threads can fetch and
+ * complete work independently.
+ */
+struct cudaram_channel {
+	struct cudaram_dev *cudaram;
+	unsigned int id;
+	struct mutex lock; /* protect from concurrent kicks */
+	struct cudaram_queue *queue; /* pending bios of the CPUs mapped to the channel */
+
+	void __user *user_buffer; /* the channel's part of the userspace buffer */
+	void *buffer; /* the same part mapped in the kernel, NULL if the buffer isn't pinned */
+	unsigned long window_start; /* address of the data window in the daemon, 0 if not mapped */
+
+	struct cudaram_ring *ring; /* SQ/CQ shared with the daemon */
+	unsigned int sq_tail; /* private copies of the indices owned by the kernel */
+	unsigned int cq_head;
+
+	struct cudaram_tag *tags;
+	unsigned int *free_tags; /* stack of free tags */
+	unsigned int nr_free_tags;
+};
+
+#define CUDARAM_NR_DIRS 4 /* CUDARAM_READ through CUDARAM_FLUSH */
+
+/* Latency stages of a bio */
+#define CUDARAM_LAT_QUEUE   0 /* from make_request until popped for the SQ */
+#define CUDARAM_LAT_COPY    1 /* copying a work's data to or from the buffer, or mapping it */
+#define CUDARAM_LAT_SERVICE 2 /* from publishing the work in the SQ until reaping its completion */
+#define CUDARAM_NR_LATS     3
+
+/* Bucket 0 is under 1us, bucket i covers [2^(i-1), 2^i) us and the last one anything longer */
+#define CUDARAM_HIST_BUCKETS 24
+
+/*
+ * Counters of a device, per CPU so that updating them costs no more than
+ * touching a local cache line. Summed up when read through debugfs.
+ */
+struct cudaram_stats {
+	u64 ios[CUDARAM_NR_DIRS]; /* completed bios */
+	u64 bytes[CUDARAM_NR_DIRS];
+	u64 hist[CUDARAM_NR_LATS][CUDARAM_NR_DIRS][CUDARAM_HIST_BUCKETS];
+	unsigned int max_queued; /* most bios queued on a channel at once */
+};
+
 struct cudaram_dev {
 	unsigned int state; /* one of CUDARAM_STATE_* */
 
-	spinlock_t lock; /* protect from make_request/ioctl races */
-	struct mutex ctl_lock; /* protect from multiple ioctls */
+	spinlock_t lock; /* protect the state */
+	struct mutex ctl_lock; /* protect from concurrent activation and mmap */
 
-	void __user *user_buffer; /* userspace buffer used to transfer data */
+	/*
+	 * Queues live as long as the device so that make_request can pick one
+	 * without synchronizing with activation, the first nr_queues are used.
+	 */
+	struct cudaram_queue queues[CUDARAM_MAX_CHANNELS];
+	unsigned int nr_queues;
 
-	wait_queue_head_t new_work; /* woken up on new work */
-	struct bio *bio_first; /* list of pending bios */
-	struct bio *bio_last; /* last bio for quick addition */
-	struct bio *current_work; /* only a single bio can be the current work */
+	/* Layout shared by all the channels, kept privately as the mappings are writable by the daemon */
+	unsigned int flags; /* CUDARAM_FLAG_* */
+	unsigned int queue_depth; /* tags per channel */
+	unsigned int tag_pages; /* size of each tag's slice of the userspace buffer in pages */
+	unsigned int sq_offset;
+	unsigned int cq_offset;
+	unsigned int window_offset; /* offset of the data window in a channel's mapping, 0 if not zero-copy */
+	unsigned int channel_size; /* size of a channel's mapping */
+	struct address_space *window_mapping; /* used to unmap pages from the data windows */
+
+	/* The userspace buffer pinned and mapped in the kernel, if it could be pinned */
+	struct page **buffer_pages;
+	unsigned int nr_buffer_pages;
+	void *buffer;
+
+	struct cudaram_channel *channels;
+	unsigned int nr_channels;
 
 	int id; /* id corresponds to the minor of the block and control devices */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	struct cdev ctl; /* control device */
+	struct file *ctl_file; /* the open control device, pinned by the channel fds */
+
+	struct cudaram_stats __percpu *stats;
+	struct dentry *debugfs; /* debugfs directory of the device */
 
 	struct list_head list; /* list of all devices */
 };